@@ -0,0 +1,144 @@
+/*
+ * Copyright 2023 Alexander Rvachev.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+package org.bitmapdecoder.benchmark;
+
+import android.graphics.Bitmap;
+import androidx.benchmark.BenchmarkState;
+import androidx.benchmark.junit4.BenchmarkRule;
+import org.bitmapdecoder.PngDecoder;
+import org.junit.After;
+import org.junit.Before;
+import org.junit.Rule;
+import org.junit.Test;
+import org.junit.runner.RunWith;
+import org.junit.runners.Parameterized;
+
+import java.nio.ByteBuffer;
+import java.util.ArrayList;
+import java.util.Arrays;
+import java.util.List;
+import java.util.concurrent.Callable;
+import java.util.concurrent.ExecutorService;
+import java.util.concurrent.Executors;
+import java.util.concurrent.Future;
+
+import static org.junit.Assert.assertNotNull;
+
+/**
+ * Time of decoding a fixed number of images with several threads, each with it's own {@link PngDecoder.Context}
+ * and output Bitmap, the way images are prefetched in background. The decoders share nothing but the process-wide
+ * counters, so the time should go down in proportion to the number of threads (up to the number of cores).
+ * Anything that makes threads wait for each other, such as JNI critical sections holding off garbage collection,
+ * shows up as worse scaling.
+ */
+@RunWith(Parameterized.class)
+public class ConcurrentDecodeBenchmark {
+    private static final String IMAGE = "palette_16_1024";
+
+    private static final int DECODES_PER_ITERATION = 32;
+
+    @Rule
+    public final BenchmarkRule benchmarkRule = new BenchmarkRule();
+
+    private final int threads;
+
+    private final List<PngDecoder.Context> contexts = new ArrayList<>();
+
+    private ExecutorService executor;
+    private List<Callable<PngDecoder.DecodingResult>> tasks;
+
+    public ConcurrentDecodeBenchmark(int threads) {
+        this.threads = threads;
+    }
+
+    @Parameterized.Parameters(name = "threads={0}")
+    public static List<Object[]> threadCounts() {
+        return Arrays.asList(new Object[][] { { 1 }, { 2 }, { 4 }, { 8 } });
+    }
+
+    @Before
+    public void setUp() {
+        final Corpus.Image image = findImage();
+        final ByteBuffer buffer = image.toDirectBuffer();
+
+        final ThreadLocal<Worker> workers = new ThreadLocal<Worker>() {
+            @Override
+            protected Worker initialValue() {
+                final Worker worker = new Worker(image.headerInfo);
+                synchronized (contexts) {
+                    contexts.add(worker.context);
+                }
+                return worker;
+            }
+        };
+
+        tasks = new ArrayList<>(DECODES_PER_ITERATION);
+        for (int i = 0; i < DECODES_PER_ITERATION; ++i) {
+            final ByteBuffer source = buffer.duplicate();
+            tasks.add(new Callable<PngDecoder.DecodingResult>() {
+                @Override
+                public PngDecoder.DecodingResult call() {
+                    final Worker worker = workers.get();
+                    return PngDecoder.decodeIndexed(worker.context, source, worker.bitmap, 0);
+                }
+            });
+        }
+
+        executor = Executors.newFixedThreadPool(threads);
+    }
+
+    @After
+    public void tearDown() {
+        executor.shutdownNow();
+
+        synchronized (contexts) {
+            for (PngDecoder.Context context : contexts) {
+                context.close();
+            }
+            contexts.clear();
+        }
+    }
+
+    @Test
+    public void pngDecoder() throws Exception {
+        final BenchmarkState state = benchmarkRule.getState();
+
+        while (state.keepRunning()) {
+            for (Future<PngDecoder.DecodingResult> result : executor.invokeAll(tasks)) {
+                assertNotNull(result.get());
+            }
+        }
+    }
+
+    private static Corpus.Image findImage() {
+        for (Corpus.Image image : Corpus.get()) {
+            if (image.name.equals(IMAGE)) {
+                return image;
+            }
+        }
+        throw new AssertionError(IMAGE);
+    }
+
+    // decoder state of one thread, the output Bitmap is overwritten by every decode
+    private static final class Worker {
+        final PngDecoder.Context context = new PngDecoder.Context();
+        final Bitmap bitmap;
+
+        Worker(PngDecoder.PngHeaderInfo headerInfo) {
+            bitmap = Bitmap.createBitmap(headerInfo.width, headerInfo.height, Bitmap.Config.ALPHA_8);
+        }
+    }
+}
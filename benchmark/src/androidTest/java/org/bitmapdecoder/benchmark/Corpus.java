@@ -0,0 +1,123 @@
+/*
+ * Copyright 2023 Alexander Rvachev.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+package org.bitmapdecoder.benchmark;
+
+import android.content.Context;
+import android.content.res.Resources;
+import android.util.TypedValue;
+import androidx.test.platform.app.InstrumentationRegistry;
+import org.bitmapdecoder.PngDecoder;
+
+import java.io.ByteArrayOutputStream;
+import java.io.IOException;
+import java.io.InputStream;
+import java.nio.ByteBuffer;
+import java.util.ArrayList;
+import java.util.List;
+
+/**
+ * Fixed set of images, shared by all benchmarks: drawables of demo app and generated images.
+ * Changing the corpus makes results incomparable with earlier runs, so only add new entries.
+ */
+final class Corpus {
+    private static final String[] DEMO_DRAWABLES = {
+            "ic_test", "ic_crushed", "green", "photo_clean8", "photo_clean"
+    };
+
+    private static List<Image> images;
+
+    private Corpus() {}
+
+    static final class Image {
+        final String name;
+        final byte[] data;
+        final PngDecoder.PngHeaderInfo headerInfo;
+
+        Image(String name, byte[] data) {
+            this.name = name;
+            this.data = data;
+            this.headerInfo = PngDecoder.getImageInfo(ByteBuffer.wrap(data));
+        }
+
+        boolean isIndexedOrGreyscale() {
+            return headerInfo.isIndexed() || headerInfo.isGreyscale();
+        }
+
+        ByteBuffer toDirectBuffer() {
+            final ByteBuffer buffer = ByteBuffer.allocateDirect(data.length);
+            buffer.put(data);
+            buffer.flip();
+            return buffer;
+        }
+
+        @Override
+        public String toString() {
+            return name;
+        }
+    }
+
+    static synchronized List<Image> get() {
+        if (images == null) {
+            images = load(InstrumentationRegistry.getInstrumentation().getContext());
+        }
+        return images;
+    }
+
+    /**
+     * @return corpus as JUnit parameters
+     */
+    static List<Object[]> parameters() {
+        final List<Object[]> parameters = new ArrayList<>();
+        for (Image image : get()) {
+            parameters.add(new Object[] { image });
+        }
+        return parameters;
+    }
+
+    private static List<Image> load(Context context) {
+        final List<Image> result = new ArrayList<>();
+
+        final Resources resources = context.getResources();
+        for (String name : DEMO_DRAWABLES) {
+            final int id = resources.getIdentifier(name, "drawable", context.getPackageName());
+            result.add(new Image(name, readResource(resources, id)));
+        }
+
+        result.add(new Image("palette_256_2048", SyntheticImages.indexed(2048, 2048, 256, 1)));
+        result.add(new Image("palette_16_1024", SyntheticImages.indexed(1024, 1024, 16, 2)));
+        result.add(new Image("grey8_2048", SyntheticImages.greyscale(2048, 2048, 8, 3)));
+        result.add(new Image("grey16_1024", SyntheticImages.greyscale(1024, 1024, 16, 4)));
+        result.add(new Image("mask_512", SyntheticImages.mask(512, 512)));
+        result.add(new Image("tiled_4096", SyntheticImages.tiled(4096, 4096, 64, 5)));
+
+        return result;
+    }
+
+    private static byte[] readResource(Resources resources, int id) {
+        // density of the resource is irrelevant, BitmapFactory is told not to scale
+        try (InputStream stream = resources.openRawResource(id, new TypedValue())) {
+            final ByteArrayOutputStream out = new ByteArrayOutputStream();
+            final byte[] chunk = new byte[16 * 1024];
+            int read;
+            while ((read = stream.read(chunk)) != -1) {
+                out.write(chunk, 0, read);
+            }
+            return out.toByteArray();
+        } catch (IOException e) {
+            throw new AssertionError(e);
+        }
+    }
+}
@@ -0,0 +1,191 @@
+/*
+ * Copyright 2023 Alexander Rvachev.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+package org.bitmapdecoder.benchmark;
+
+import android.annotation.TargetApi;
+import android.graphics.Bitmap;
+import android.graphics.BitmapFactory;
+import android.graphics.ImageDecoder;
+import androidx.benchmark.BenchmarkState;
+import androidx.benchmark.junit4.BenchmarkRule;
+import androidx.test.filters.SdkSuppress;
+import org.bitmapdecoder.PngDecoder;
+import org.junit.After;
+import org.junit.Before;
+import org.junit.Rule;
+import org.junit.Test;
+import org.junit.runner.RunWith;
+import org.junit.runners.Parameterized;
+
+import java.io.IOException;
+import java.nio.ByteBuffer;
+import java.util.List;
+
+import static org.junit.Assert.assertNotNull;
+import static org.junit.Assume.assumeTrue;
+
+/**
+ * Decoding time (and allocation count, reported by androidx.benchmark) of the same image
+ * with PngDecoder and platform decoders.
+ */
+@RunWith(Parameterized.class)
+public class DecodeBenchmark {
+    @Rule
+    public final BenchmarkRule benchmarkRule = new BenchmarkRule();
+
+    private final Corpus.Image image;
+
+    private ByteBuffer buffer;
+    private PngDecoder.Context context;
+
+    public DecodeBenchmark(Corpus.Image image) {
+        this.image = image;
+    }
+
+    @Parameterized.Parameters(name = "{0}")
+    public static List<Object[]> images() {
+        return Corpus.parameters();
+    }
+
+    @Before
+    public void setUp() {
+        buffer = image.toDirectBuffer();
+        context = new PngDecoder.Context();
+    }
+
+    @After
+    public void tearDown() {
+        context.close();
+    }
+
+    /**
+     * Decoding into reused Bitmap with reused decoder context, the way it's done for resources within a process.
+     */
+    @Test
+    public void pngDecoder() {
+        final BenchmarkState state = benchmarkRule.getState();
+
+        if (image.isIndexedOrGreyscale()) {
+            final Bitmap bitmap = Bitmap.createBitmap(image.headerInfo.width, image.headerInfo.height, Bitmap.Config.ALPHA_8);
+            while (state.keepRunning()) {
+                assertNotNull(PngDecoder.decodeIndexed(context, buffer, bitmap, 0));
+            }
+        } else {
+            final Bitmap bitmap = Bitmap.createBitmap(image.headerInfo.width, image.headerInfo.height, Bitmap.Config.ARGB_8888);
+            while (state.keepRunning()) {
+                assertNotNull(PngDecoder.decodeRgba(context, buffer, bitmap));
+            }
+        }
+    }
+
+    /**
+     * Same as {@link #pngDecoder}, but without verifying checksums, the way resources are decoded by IndexedDrawable.
+     * The difference between two is the cost of CRC-32 of chunks and Adler-32 of image data, which all decoders
+     * (Wuffs, as well as row-by-row and parallel ones) verify, unless the source is trusted.
+     */
+    @Test
+    public void pngDecoderTrustedSource() {
+        final BenchmarkState state = benchmarkRule.getState();
+
+        final int options = PngDecoder.OPTION_TRUSTED_SOURCE;
+
+        if (image.isIndexedOrGreyscale()) {
+            final Bitmap bitmap = Bitmap.createBitmap(image.headerInfo.width, image.headerInfo.height, Bitmap.Config.ALPHA_8);
+            while (state.keepRunning()) {
+                assertNotNull(PngDecoder.decodeIndexed(context, buffer, bitmap, options));
+            }
+        } else {
+            final Bitmap bitmap = Bitmap.createBitmap(image.headerInfo.width, image.headerInfo.height, Bitmap.Config.ARGB_8888);
+            while (state.keepRunning()) {
+                assertNotNull(PngDecoder.decodeRgba(context, buffer, bitmap, options));
+            }
+        }
+    }
+
+    /**
+     * Subsampled preview with longest side of 256 pixels, that PngImageView shows for large images before they are
+     * decoded to fit the view. Compare with {@link #pngDecoder} for time to first pixel.
+     */
+    @Test
+    public void pngDecoderPreview() {
+        // only indexed images take this path
+        assumeTrue(image.isIndexedOrGreyscale());
+
+        final BenchmarkState state = benchmarkRule.getState();
+
+        int sampleSize = 1;
+        while (Math.max(image.headerInfo.width, image.headerInfo.height) > 256 * sampleSize) {
+            sampleSize *= 2;
+        }
+
+        final Bitmap bitmap = Bitmap.createBitmap(PngDecoder.getSampledSize(image.headerInfo.width, sampleSize),
+                PngDecoder.getSampledSize(image.headerInfo.height, sampleSize), Bitmap.Config.ALPHA_8);
+        while (state.keepRunning()) {
+            assertNotNull(PngDecoder.decodeIndexed(context, buffer, bitmap, 0, sampleSize));
+        }
+    }
+
+    /**
+     * Same as {@link #pngDecoder}, but allocates new output Bitmap each time, like the first decoding of resource.
+     */
+    @Test
+    public void pngDecoderNewBitmap() {
+        final BenchmarkState state = benchmarkRule.getState();
+
+        final int width = image.headerInfo.width, height = image.headerInfo.height;
+
+        while (state.keepRunning()) {
+            if (image.isIndexedOrGreyscale()) {
+                final Bitmap bitmap = Bitmap.createBitmap(width, height, Bitmap.Config.ALPHA_8);
+                assertNotNull(PngDecoder.decodeIndexed(context, buffer, bitmap, 0));
+            } else {
+                final Bitmap bitmap = Bitmap.createBitmap(width, height, Bitmap.Config.ARGB_8888);
+                assertNotNull(PngDecoder.decodeRgba(context, buffer, bitmap));
+            }
+        }
+    }
+
+    @Test
+    public void bitmapFactory() {
+        final BenchmarkState state = benchmarkRule.getState();
+
+        final BitmapFactory.Options options = new BitmapFactory.Options();
+        options.inScaled = false;
+
+        while (state.keepRunning()) {
+            assertNotNull(BitmapFactory.decodeByteArray(image.data, 0, image.data.length, options));
+        }
+    }
+
+    @Test
+    @TargetApi(28)
+    @SdkSuppress(minSdkVersion = 28)
+    public void imageDecoder() throws IOException {
+        final BenchmarkState state = benchmarkRule.getState();
+
+        final ImageDecoder.OnHeaderDecodedListener software = new ImageDecoder.OnHeaderDecodedListener() {
+            @Override
+            public void onHeaderDecoded(ImageDecoder decoder, ImageDecoder.ImageInfo info, ImageDecoder.Source source) {
+                decoder.setAllocator(ImageDecoder.ALLOCATOR_SOFTWARE);
+            }
+        };
+
+        while (state.keepRunning()) {
+            final ImageDecoder.Source source = ImageDecoder.createSource(ByteBuffer.wrap(image.data));
+            assertNotNull(ImageDecoder.decodeBitmap(source, software));
+        }
+    }
+}
@@ -0,0 +1,126 @@
+/*
+ * Copyright 2023 Alexander Rvachev.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+package org.bitmapdecoder.benchmark;
+
+import android.annotation.TargetApi;
+import android.graphics.*;
+import android.hardware.HardwareBuffer;
+import android.media.Image;
+import android.media.ImageReader;
+import android.os.Handler;
+import android.os.HandlerThread;
+import androidx.benchmark.BenchmarkState;
+import androidx.benchmark.junit4.BenchmarkRule;
+import androidx.test.filters.SdkSuppress;
+import org.bitmapdecoder.PngSupport;
+import org.junit.After;
+import org.junit.Before;
+import org.junit.Rule;
+import org.junit.Test;
+import org.junit.runner.RunWith;
+import org.junit.runners.Parameterized;
+
+import java.nio.ByteBuffer;
+import java.util.List;
+
+import static org.junit.Assert.assertNotNull;
+
+/**
+ * Time to draw the first frame with newly decoded image: texture upload and {@link org.bitmapdecoder.PaletteShader}
+ * setup, but not decoding itself. Frames are rendered offscreen into ImageReader.
+ */
+@TargetApi(33)
+@SdkSuppress(minSdkVersion = 33)
+@RunWith(Parameterized.class)
+public class FirstDrawBenchmark {
+    private static final int MAX_SURFACE_SIZE = 1024;
+
+    @Rule
+    public final BenchmarkRule benchmarkRule = new BenchmarkRule();
+
+    private final Corpus.Image image;
+
+    private HandlerThread readerThread;
+    private ImageReader imageReader;
+    private HardwareRenderer renderer;
+    private RenderNode content;
+
+    public FirstDrawBenchmark(Corpus.Image image) {
+        this.image = image;
+    }
+
+    @Parameterized.Parameters(name = "{0}")
+    public static List<Object[]> images() {
+        return Corpus.parameters();
+    }
+
+    @Before
+    public void setUp() {
+        final int width = Math.min(image.headerInfo.width, MAX_SURFACE_SIZE);
+        final int height = Math.min(image.headerInfo.height, MAX_SURFACE_SIZE);
+
+        readerThread = new HandlerThread("png-benchmark-reader");
+        readerThread.start();
+
+        imageReader = ImageReader.newInstance(width, height, PixelFormat.RGBA_8888, 3,
+                HardwareBuffer.USAGE_GPU_COLOR_OUTPUT | HardwareBuffer.USAGE_GPU_SAMPLED_IMAGE);
+        imageReader.setOnImageAvailableListener(new ImageReader.OnImageAvailableListener() {
+            @Override
+            public void onImageAvailable(ImageReader reader) {
+                final Image frame = reader.acquireLatestImage();
+                if (frame != null) {
+                    frame.close();
+                }
+            }
+        }, new Handler(readerThread.getLooper()));
+
+        content = new RenderNode("png-benchmark");
+        content.setPosition(0, 0, width, height);
+
+        renderer = new HardwareRenderer();
+        renderer.setSurface(imageReader.getSurface());
+        renderer.setContentRoot(content);
+    }
+
+    @After
+    public void tearDown() {
+        renderer.destroy();
+        imageReader.close();
+        readerThread.quitSafely();
+    }
+
+    @Test
+    public void firstDraw() {
+        final BenchmarkState state = benchmarkRule.getState();
+
+        final ByteBuffer buffer = image.toDirectBuffer();
+
+        while (state.keepRunning()) {
+            state.pauseTiming();
+            final Paint paint = PngSupport.getPaint(buffer, 0);
+            assertNotNull(paint);
+            state.resumeTiming();
+
+            final RecordingCanvas canvas = content.beginRecording();
+            canvas.drawPaint(paint);
+            content.endRecording();
+
+            renderer.createRenderRequest()
+                    .setWaitForPresent(true)
+                    .syncAndDraw();
+        }
+    }
+}
@@ -0,0 +1,107 @@
+/*
+ * Copyright 2023 Alexander Rvachev.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+package org.bitmapdecoder.benchmark;
+
+import android.graphics.Bitmap;
+import android.graphics.BitmapFactory;
+import android.os.Bundle;
+import android.os.Debug;
+import android.util.Log;
+import androidx.test.platform.app.InstrumentationRegistry;
+import org.bitmapdecoder.PngDecoder;
+import org.junit.Test;
+import org.junit.runner.RunWith;
+import org.junit.runners.Parameterized;
+
+import java.nio.ByteBuffer;
+import java.util.List;
+
+import static org.junit.Assert.assertNotNull;
+
+/**
+ * Native memory, needed to decode an image (besides the output Bitmap). This is not timed, so it does not use
+ * BenchmarkRule. Results are logged and reported as instrumentation status, e.g. for
+ * {@code adb shell am instrument -r}.
+ *
+ * <p>Decoder contexts keep their buffers until trimmed, so the peak usage of PngDecoder is measured as growth of native
+ * heap after decoding with fresh context. BitmapFactory frees its buffers immediately, so only the retained size
+ * (which includes the decoded Bitmap on Android 8 and above) is reported for it.
+ */
+@RunWith(Parameterized.class)
+public class NativeMemoryBenchmark {
+    private static final String TAG = "PngBenchmark";
+
+    private static final int STATUS_REPORT = 2;
+
+    private final Corpus.Image image;
+
+    public NativeMemoryBenchmark(Corpus.Image image) {
+        this.image = image;
+    }
+
+    @Parameterized.Parameters(name = "{0}")
+    public static List<Object[]> images() {
+        return Corpus.parameters();
+    }
+
+    @Test
+    public void pngDecoderPeak() {
+        final ByteBuffer buffer = image.toDirectBuffer();
+
+        final int width = image.headerInfo.width, height = image.headerInfo.height;
+
+        final Bitmap bitmap = image.isIndexedOrGreyscale()
+                ? Bitmap.createBitmap(width, height, Bitmap.Config.ALPHA_8)
+                : Bitmap.createBitmap(width, height, Bitmap.Config.ARGB_8888);
+
+        try (PngDecoder.Context context = new PngDecoder.Context()) {
+            final long before = Debug.getNativeHeapAllocatedSize();
+
+            if (image.isIndexedOrGreyscale()) {
+                assertNotNull(PngDecoder.decodeIndexed(context, buffer, bitmap, 0));
+            } else {
+                assertNotNull(PngDecoder.decodeRgba(context, buffer, bitmap));
+            }
+
+            report("pngDecoderPeakNativeBytes", Debug.getNativeHeapAllocatedSize() - before);
+        }
+    }
+
+    @Test
+    public void bitmapFactoryRetained() {
+        final BitmapFactory.Options options = new BitmapFactory.Options();
+        options.inScaled = false;
+
+        final long before = Debug.getNativeHeapAllocatedSize();
+
+        final Bitmap bitmap = BitmapFactory.decodeByteArray(image.data, 0, image.data.length, options);
+        assertNotNull(bitmap);
+
+        report("bitmapFactoryRetainedNativeBytes", Debug.getNativeHeapAllocatedSize() - before);
+
+        bitmap.recycle();
+    }
+
+    private void report(String metric, long bytes) {
+        final String key = image.name + "_" + metric;
+
+        Log.i(TAG, key + ": " + bytes);
+
+        final Bundle status = new Bundle();
+        status.putLong(key, bytes);
+        InstrumentationRegistry.getInstrumentation().sendStatus(STATUS_REPORT, status);
+    }
+}
@@ -0,0 +1,213 @@
+/*
+ * Copyright 2023 Alexander Rvachev.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+package org.bitmapdecoder.benchmark;
+
+import android.annotation.TargetApi;
+import android.graphics.*;
+import android.hardware.HardwareBuffer;
+import android.media.Image;
+import android.media.ImageReader;
+import android.os.Handler;
+import android.os.HandlerThread;
+import androidx.benchmark.BenchmarkState;
+import androidx.benchmark.junit4.BenchmarkRule;
+import androidx.test.ext.junit.runners.AndroidJUnit4;
+import androidx.test.filters.SdkSuppress;
+import org.bitmapdecoder.PaletteShader;
+import org.junit.After;
+import org.junit.Before;
+import org.junit.Rule;
+import org.junit.Test;
+import org.junit.runner.RunWith;
+
+/**
+ * Cost of PaletteShader creation: compiling SkSL into SkRuntimeEffect (on the calling thread) and compiling
+ * the effect into GPU program (on RenderThread, during the first draw).
+ *
+ * <p>Skia caches GPU programs by effect, so only the first draw of each effect is slow. To measure it over
+ * and over, {@link #drawNewEffect} makes every effect unique by appending a comment to the shader source.
+ */
+@TargetApi(33)
+@SdkSuppress(minSdkVersion = 33)
+@RunWith(AndroidJUnit4.class)
+public class ShaderBenchmark {
+    private static final String SOURCE = "uniform shader t;" +
+            "uniform shader p;" +
+            "vec4 main(vec2 c){" +
+            "return p.eval(vec2(t.eval(c).a*255,0));" +
+            "}";
+
+    private static final int SIZE = 256;
+
+    @Rule
+    public final BenchmarkRule benchmarkRule = new BenchmarkRule();
+
+    private BitmapShader image, palette;
+
+    private HandlerThread readerThread;
+    private ImageReader imageReader;
+    private HardwareRenderer renderer;
+    private RenderNode content;
+
+    @Before
+    public void setUp() {
+        final Bitmap imageBitmap = Bitmap.createBitmap(SIZE, SIZE, Bitmap.Config.ALPHA_8);
+        final Bitmap paletteBitmap = Bitmap.createBitmap(256, 1, Bitmap.Config.ARGB_8888);
+        for (int i = 0; i < 256; ++i) {
+            paletteBitmap.setPixel(i, 0, Color.rgb(i, 255 - i, i / 2));
+        }
+        imageBitmap.eraseColor(Color.argb(0x80, 0, 0, 0));
+
+        image = new BitmapShader(imageBitmap, Shader.TileMode.CLAMP, Shader.TileMode.CLAMP);
+        palette = new BitmapShader(paletteBitmap, Shader.TileMode.CLAMP, Shader.TileMode.CLAMP);
+        image.setFilterMode(BitmapShader.FILTER_MODE_NEAREST);
+        palette.setFilterMode(BitmapShader.FILTER_MODE_NEAREST);
+
+        readerThread = new HandlerThread("png-benchmark-reader");
+        readerThread.start();
+
+        imageReader = ImageReader.newInstance(SIZE, SIZE, PixelFormat.RGBA_8888, 3,
+                HardwareBuffer.USAGE_GPU_COLOR_OUTPUT | HardwareBuffer.USAGE_GPU_SAMPLED_IMAGE);
+        imageReader.setOnImageAvailableListener(new ImageReader.OnImageAvailableListener() {
+            @Override
+            public void onImageAvailable(ImageReader reader) {
+                final Image frame = reader.acquireLatestImage();
+                if (frame != null) {
+                    frame.close();
+                }
+            }
+        }, new Handler(readerThread.getLooper()));
+
+        content = new RenderNode("png-benchmark");
+        content.setPosition(0, 0, SIZE, SIZE);
+
+        renderer = new HardwareRenderer();
+        renderer.setSurface(imageReader.getSurface());
+        renderer.setContentRoot(content);
+    }
+
+    @After
+    public void tearDown() {
+        renderer.destroy();
+        imageReader.close();
+        readerThread.quitSafely();
+    }
+
+    @Test
+    public void compile() {
+        final BenchmarkState state = benchmarkRule.getState();
+
+        while (state.keepRunning()) {
+            new PaletteShader().setBitmap(palette, image);
+        }
+    }
+
+    @Test
+    public void compilePacked() {
+        final BenchmarkState state = benchmarkRule.getState();
+
+        while (state.keepRunning()) {
+            new PaletteShader(4, SIZE).setBitmap(palette, image);
+        }
+    }
+
+    @Test
+    public void obtainPooled() {
+        final BenchmarkState state = benchmarkRule.getState();
+
+        PaletteShader.prewarm(8, 1);
+
+        while (state.keepRunning()) {
+            final PaletteShader shader = PaletteShader.obtain();
+            shader.setBitmap(palette, image);
+            PaletteShader.recycle(shader);
+        }
+    }
+
+    /**
+     * Recoloring an image with one of two cached palettes, as done when switching between themes.
+     */
+    @Test
+    public void swapPalette() {
+        final BenchmarkState state = benchmarkRule.getState();
+
+        final int[] light = new int[256];
+        final int[] dark = new int[256];
+        for (int i = 0; i < 256; ++i) {
+            light[i] = Color.rgb(i, 255 - i, i / 2);
+            dark[i] = Color.rgb(255 - i, i, i / 2);
+        }
+
+        final PaletteShader shader = new PaletteShader();
+        shader.setBitmap(palette, image);
+
+        int counter = 0;
+
+        while (state.keepRunning()) {
+            shader.updatePalette(counter++ % 2 == 0 ? dark : light);
+        }
+    }
+
+    /**
+     * SkSL compilation, GPU program compilation and linking, then drawing.
+     */
+    @Test
+    public void drawNewEffect() {
+        final BenchmarkState state = benchmarkRule.getState();
+
+        int counter = 0;
+
+        while (state.keepRunning()) {
+            final RuntimeShader shader = new RuntimeShader(SOURCE + "//" + counter++);
+            shader.setInputShader("p", palette);
+            shader.setInputBuffer("t", image);
+
+            draw(shader);
+        }
+    }
+
+    /**
+     * Drawing with already compiled effect, to be subtracted from {@link #drawNewEffect}.
+     */
+    @Test
+    public void drawPooledEffect() {
+        final BenchmarkState state = benchmarkRule.getState();
+
+        PaletteShader.prewarm(8, 1);
+
+        while (state.keepRunning()) {
+            final PaletteShader shader = PaletteShader.obtain();
+            shader.setBitmap(palette, image);
+
+            draw(shader);
+
+            PaletteShader.recycle(shader);
+        }
+    }
+
+    private void draw(Shader shader) {
+        final Paint paint = new Paint();
+        paint.setShader(shader);
+
+        final RecordingCanvas canvas = content.beginRecording();
+        canvas.drawPaint(paint);
+        content.endRecording();
+
+        renderer.createRenderRequest()
+                .setWaitForPresent(true)
+                .syncAndDraw();
+    }
+}
@@ -0,0 +1,211 @@
+/*
+ * Copyright 2023 Alexander Rvachev.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+package org.bitmapdecoder.benchmark;
+
+import java.io.ByteArrayOutputStream;
+import java.io.DataOutputStream;
+import java.io.IOException;
+import java.util.Random;
+import java.util.zip.CRC32;
+import java.util.zip.Deflater;
+
+/**
+ * Deterministic PNG images for the benchmark corpus. Images are generated instead of being checked in,
+ * so that the corpus can contain big images without bloating the repository.
+ */
+final class SyntheticImages {
+    private static final int COLOR_GREY = 0;
+    private static final int COLOR_INDEXED = 3;
+
+    private SyntheticImages() {}
+
+    /**
+     * Indexed image, made of randomly colored runs (similar to flat artwork), with partially transparent palette.
+     */
+    static byte[] indexed(int width, int height, int colors, long seed) {
+        final Random random = new Random(seed);
+
+        final byte[] palette = new byte[colors * 3];
+        random.nextBytes(palette);
+
+        final byte[] alpha = new byte[colors];
+        for (int i = 0; i < colors; ++i) {
+            alpha[i] = (byte) (i % 4 == 0 ? 0x80 : 0xFF);
+        }
+
+        final byte[][] rows = new byte[height][width];
+        for (int y = 0; y < height; ++y) {
+            for (int x = 0; x < width; ) {
+                final int run = 1 + random.nextInt(32);
+                final byte color = (byte) random.nextInt(colors);
+                for (int end = Math.min(x + run, width); x < end; ++x) {
+                    rows[y][x] = y > 0 && random.nextInt(4) != 0 ? rows[y - 1][x] : color;
+                }
+            }
+        }
+
+        return encode(width, height, 8, COLOR_INDEXED, palette, alpha, rows);
+    }
+
+    /**
+     * Indexed image with single color, different only in alpha, which is decoded as alpha mask.
+     */
+    static byte[] mask(int width, int height) {
+        final byte[] palette = new byte[256 * 3];
+        final byte[] alpha = new byte[256];
+        for (int i = 0; i < 256; ++i) {
+            palette[i * 3] = (byte) 0x21;
+            palette[i * 3 + 1] = (byte) 0x96;
+            palette[i * 3 + 2] = (byte) 0xF3;
+            alpha[i] = (byte) i;
+        }
+
+        final byte[][] rows = new byte[height][width];
+        final float cx = width / 2f, cy = height / 2f;
+        for (int y = 0; y < height; ++y) {
+            for (int x = 0; x < width; ++x) {
+                final double distance = Math.hypot(x - cx, y - cy) / Math.min(cx, cy);
+                rows[y][x] = (byte) (distance >= 1 ? 0 : (int) (255 * (1 - distance)));
+            }
+        }
+
+        return encode(width, height, 8, COLOR_INDEXED, palette, alpha, rows);
+    }
+
+    /**
+     * Greyscale gradient with some noise. Bit depth is 8 or 16.
+     */
+    static byte[] greyscale(int width, int height, int bitDepth, long seed) {
+        final Random random = new Random(seed);
+
+        final int bytesPerPixel = bitDepth / 8;
+
+        final byte[][] rows = new byte[height][width * bytesPerPixel];
+        for (int y = 0; y < height; ++y) {
+            for (int x = 0; x < width; ++x) {
+                final int value = ((x + y) * 0xFFFF / (width + height) + random.nextInt(0x400)) & 0xFFFF;
+                if (bytesPerPixel == 2) {
+                    rows[y][x * 2] = (byte) (value >> 8);
+                    rows[y][x * 2 + 1] = (byte) value;
+                } else {
+                    rows[y][x] = (byte) (value >> 8);
+                }
+            }
+        }
+
+        return encode(width, height, bitDepth, COLOR_GREY, null, null, rows);
+    }
+
+    /**
+     * Big indexed image, that repeats small pattern, for example a background texture.
+     */
+    static byte[] tiled(int width, int height, int tileSize, long seed) {
+        final byte[] tile = indexedPattern(tileSize, seed);
+
+        final Random random = new Random(seed);
+
+        final byte[] palette = new byte[16 * 3];
+        random.nextBytes(palette);
+
+        final byte[][] rows = new byte[height][width];
+        for (int y = 0; y < height; ++y) {
+            for (int x = 0; x < width; ++x) {
+                rows[y][x] = tile[(y % tileSize) * tileSize + x % tileSize];
+            }
+        }
+
+        return encode(width, height, 8, COLOR_INDEXED, palette, null, rows);
+    }
+
+    private static byte[] indexedPattern(int size, long seed) {
+        final Random random = new Random(seed);
+
+        final byte[] pattern = new byte[size * size];
+        for (int i = 0; i < pattern.length; ++i) {
+            pattern[i] = (byte) random.nextInt(16);
+        }
+        return pattern;
+    }
+
+    private static byte[] encode(int width, int height, int bitDepth, int colorType, byte[] palette, byte[] alpha, byte[][] rows) {
+        try {
+            final ByteArrayOutputStream out = new ByteArrayOutputStream();
+            out.write(new byte[] { (byte) 0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n' });
+
+            final ByteArrayOutputStream header = new ByteArrayOutputStream();
+            final DataOutputStream headerData = new DataOutputStream(header);
+            headerData.writeInt(width);
+            headerData.writeInt(height);
+            headerData.writeByte(bitDepth);
+            headerData.writeByte(colorType);
+            headerData.writeByte(0);
+            headerData.writeByte(0);
+            headerData.writeByte(0);
+            writeChunk(out, "IHDR", header.toByteArray());
+
+            if (palette != null) {
+                writeChunk(out, "PLTE", palette);
+            }
+            if (alpha != null) {
+                writeChunk(out, "tRNS", alpha);
+            }
+
+            final Deflater deflater = new Deflater(Deflater.DEFAULT_COMPRESSION);
+            final ByteArrayOutputStream compressed = new ByteArrayOutputStream();
+            final byte[] chunk = new byte[64 * 1024];
+            final byte[] noFilter = new byte[1];
+
+            for (byte[] row : rows) {
+                deflate(deflater, noFilter, chunk, compressed);
+                deflate(deflater, row, chunk, compressed);
+            }
+
+            deflater.finish();
+            while (!deflater.finished()) {
+                compressed.write(chunk, 0, deflater.deflate(chunk));
+            }
+            deflater.end();
+
+            writeChunk(out, "IDAT", compressed.toByteArray());
+            writeChunk(out, "IEND", new byte[0]);
+
+            return out.toByteArray();
+        } catch (IOException e) {
+            throw new AssertionError(e);
+        }
+    }
+
+    private static void deflate(Deflater deflater, byte[] input, byte[] chunk, ByteArrayOutputStream output) {
+        deflater.setInput(input);
+        while (!deflater.needsInput()) {
+            output.write(chunk, 0, deflater.deflate(chunk));
+        }
+    }
+
+    private static void writeChunk(ByteArrayOutputStream out, String type, byte[] data) throws IOException {
+        final DataOutputStream stream = new DataOutputStream(out);
+        final byte[] typeBytes = type.getBytes("US-ASCII");
+
+        final CRC32 crc = new CRC32();
+        crc.update(typeBytes);
+        crc.update(data);
+
+        stream.writeInt(data.length);
+        stream.write(typeBytes);
+        stream.write(data);
+        stream.writeInt((int) crc.getValue());
+    }
+}
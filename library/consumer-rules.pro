@@ -5,6 +5,9 @@
 -keepclassmembernames class org.bitmapdecoder.* {
     native <methods>;
 }
+-keepclassmembers class org.bitmapdecoder.PngDecoder {
+    private static int readChannel(java.nio.channels.ReadableByteChannel, java.nio.ByteBuffer, int, int);
+}
 -keepclassmembers class org.bitmapdecoder.ShaderDrawable {
     public void clearMutated();
 }
\ No newline at end of file
@@ -0,0 +1,546 @@
+// Copyright 2023 Alexander Rvachev
+// Licensed under Apache License, Version 2.0
+// Refer to the LICENSE file included.
+
+// Per-pixel and per-palette loops. On arm64 Advanced SIMD is always present,
+// so vectorized versions are selected at compile time, other ABIs use scalar code.
+// Row loops are instantiated for each bit depth (and other per-image parameters)
+// from always inlined templates below, callers pick an instance once per image
+
+#include "kernels.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__aarch64__)
+#include <arm_neon.h>
+#define PNGS_NEON 1
+#endif
+
+// body of a template, that is instantiated with constant arguments
+#define TEMPLATE static inline __attribute__((always_inline))
+
+// copied from wuffs internals
+static inline uint32_t abgr_nonpremul_to_argb_premul(uint32_t argb_nonpremul) {
+  uint32_t a = 0xFF & (argb_nonpremul >> 24);
+  uint32_t a16 = a * (0x101 * 0x101);
+
+  uint32_t r = 0xFF & (argb_nonpremul >> 16);
+  r = ((r * a16) / 0xFFFF) >> 8;
+  uint32_t g = 0xFF & (argb_nonpremul >> 8);
+  g = ((g * a16) / 0xFFFF) >> 8;
+  uint32_t b = 0xFF & (argb_nonpremul >> 0);
+  b = ((b * a16) / 0xFFFF) >> 8;
+
+  return (a << 24) | (b << 16) | (g << 8) | (r << 0);
+}
+
+#ifdef PNGS_NEON
+// same rounding as abgr_nonpremul_to_argb_premul: (c * a * 257) / 65280,
+// computed as z = x + (x >> 8), then exact z / 255 for 16-bit z
+static inline uint8x8_t premultiply_half(uint8x8_t c, uint8x8_t a) {
+    uint16x8_t x = vmull_u8(c, a);
+    uint16x8_t z = vaddq_u16(vsraq_n_u16(x, x, 8), vdupq_n_u16(1));
+    return vshrn_n_u16(vsraq_n_u16(z, z, 8), 8);
+}
+
+static inline uint8x16_t premultiply(uint8x16_t c, uint8x16_t a) {
+    return vcombine_u8(premultiply_half(vget_low_u8(c), vget_low_u8(a)),
+                       premultiply_half(vget_high_u8(c), vget_high_u8(a)));
+}
+
+static inline uint8x16x4_t load_table(const uint8_t *table) {
+    uint8x16x4_t result;
+    result.val[0] = vld1q_u8(table);
+    result.val[1] = vld1q_u8(table + 16);
+    result.val[2] = vld1q_u8(table + 32);
+    result.val[3] = vld1q_u8(table + 48);
+    return result;
+}
+
+// 256-entry lookup for 16 bytes at once: TBL zeroes out-of-range lanes, TBX leaves them alone,
+// so each quarter of table fills only lanes with indices in its range
+static inline uint8x16_t lookup(uint8x16x4_t t0, uint8x16x4_t t1, uint8x16x4_t t2, uint8x16x4_t t3, uint8x16_t idx) {
+    const uint8x16_t quarter = vdupq_n_u8(64);
+
+    uint8x16_t result = vqtbl4q_u8(t0, idx);
+    idx = vsubq_u8(idx, quarter);
+    result = vqtbx4q_u8(result, t1, idx);
+    idx = vsubq_u8(idx, quarter);
+    result = vqtbx4q_u8(result, t2, idx);
+    idx = vsubq_u8(idx, quarter);
+    return vqtbx4q_u8(result, t3, idx);
+}
+#endif
+
+int copyPalette(uint8_t *restrict dest, const uint8_t *restrict src, size_t size) {
+    int is_opaque = 1;
+
+    size_t i = 0;
+
+#ifdef PNGS_NEON
+    uint8x16_t min_alpha = vdupq_n_u8(0xFF);
+
+    for (; i + 64 <= size; i += 64) {
+        const uint8x16x4_t bgra = vld4q_u8(src + i);
+        const uint8x16_t alpha = bgra.val[3];
+
+        min_alpha = vminq_u8(min_alpha, alpha);
+
+        uint8x16x4_t rgba;
+        rgba.val[0] = premultiply(bgra.val[2], alpha);
+        rgba.val[1] = premultiply(bgra.val[1], alpha);
+        rgba.val[2] = premultiply(bgra.val[0], alpha);
+        rgba.val[3] = alpha;
+
+        vst4q_u8(dest + i, rgba);
+    }
+
+    if (vminvq_u8(min_alpha) != 0xFF) is_opaque = 0;
+#endif
+
+    for (; i < size; i += 4) {
+        const uint32_t* srcColor = (const uint32_t*) (src + i);
+        uint32_t* dstColor = (uint32_t*) (dest + i);
+
+        const uint32_t abgr = *srcColor;
+        const uint32_t alpha = 0xFF & (abgr >> 24);
+        if (alpha != 0xFF) is_opaque = 0;
+
+        *dstColor = abgr_nonpremul_to_argb_premul(abgr);
+    }
+
+    return is_opaque;
+}
+
+void map_bytes(uint8_t *dest, const uint8_t *src, const uint8_t *restrict table, size_t size) {
+    size_t i = 0;
+
+#ifdef PNGS_NEON
+    const uint8x16x4_t t0 = load_table(table);
+    const uint8x16x4_t t1 = load_table(table + 64);
+    const uint8x16x4_t t2 = load_table(table + 128);
+    const uint8x16x4_t t3 = load_table(table + 192);
+
+    for (; i + 16 <= size; i += 16) {
+        vst1q_u8(dest + i, lookup(t0, t1, t2, t3, vld1q_u8(src + i)));
+    }
+#endif
+
+    for (; i < size; i++) {
+        dest[i] = table[src[i]];
+    }
+}
+
+size_t find_mapped(const uint8_t *src, const uint8_t *restrict table, size_t size) {
+    size_t i = 0;
+
+#ifdef PNGS_NEON
+    const uint8x16x4_t t0 = load_table(table);
+    const uint8x16x4_t t1 = load_table(table + 64);
+    const uint8x16x4_t t2 = load_table(table + 128);
+    const uint8x16x4_t t3 = load_table(table + 192);
+
+    for (; i + 16 <= size; i += 16) {
+        if (vmaxvq_u8(lookup(t0, t1, t2, t3, vld1q_u8(src + i))) != 0) {
+            // found (let scalar loop below locate the exact position)
+            break;
+        }
+    }
+#endif
+
+    for (; i < size; i++) {
+        if (table[src[i]] != 0) return i;
+    }
+
+    return size;
+}
+
+TEMPLATE int unfilter(uint8_t *restrict row, const uint8_t *restrict prev, size_t size, size_t bpp, uint8_t filter) {
+    size_t i;
+
+    switch (filter) {
+        case 0:
+            break;
+        case 1:
+            for (i = bpp; i < size; i++) {
+                row[i] = (uint8_t) (row[i] + row[i - bpp]);
+            }
+            break;
+        case 2:
+            for (i = 0; i < size; i++) {
+                row[i] = (uint8_t) (row[i] + prev[i]);
+            }
+            break;
+        case 3:
+            for (i = 0; i < bpp && i < size; i++) {
+                row[i] = (uint8_t) (row[i] + (prev[i] >> 1));
+            }
+            for (; i < size; i++) {
+                row[i] = (uint8_t) (row[i] + ((row[i - bpp] + prev[i]) >> 1));
+            }
+            break;
+        case 4:
+            for (i = 0; i < bpp && i < size; i++) {
+                row[i] = (uint8_t) (row[i] + prev[i]);
+            }
+            for (; i < size; i++) {
+                const int a = row[i - bpp], b = prev[i], c = prev[i - bpp];
+                const int pa = abs(b - c), pb = abs(a - c), pc = abs(a + b - c - c);
+                const int predictor = (pa <= pb && pa <= pc) ? a : (pb <= pc) ? b : c;
+                row[i] = (uint8_t) (row[i] + predictor);
+            }
+            break;
+        default:
+            return 0;
+    }
+
+    return 1;
+}
+
+int unfilter_row(uint8_t *restrict row, const uint8_t *restrict prev, size_t size, size_t bpp, uint8_t filter) {
+    return unfilter(row, prev, size, bpp, filter);
+}
+
+static int unfilter_row_1(uint8_t *restrict row, const uint8_t *restrict prev, size_t size, size_t bpp, uint8_t filter) {
+    return unfilter(row, prev, size, 1, filter);
+}
+
+static int unfilter_row_2(uint8_t *restrict row, const uint8_t *restrict prev, size_t size, size_t bpp, uint8_t filter) {
+    return unfilter(row, prev, size, 2, filter);
+}
+
+row_unfilter select_unfilter(size_t bpp) {
+    switch (bpp) {
+        case 1:
+            return unfilter_row_1;
+        case 2:
+            return unfilter_row_2;
+        default:
+            return unfilter_row;
+    }
+}
+
+#ifdef PNGS_NEON
+// for each of 16 output lanes: source byte (relative to the first of the block) and right shift of the sample,
+// for 1, 2 and 4 bits per sample. Each block of 16 source bytes expands to 8 / bit_depth vectors
+static const uint8_t expand_bytes[3][16] = {
+    { 0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 1, 1, 1, 1 },
+    { 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3 },
+    { 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7 },
+};
+
+static const int8_t expand_shifts[3][16] = {
+    { -7, -6, -5, -4, -3, -2, -1, 0, -7, -6, -5, -4, -3, -2, -1, 0 },
+    { -6, -4, -2, 0, -6, -4, -2, 0, -6, -4, -2, 0, -6, -4, -2, 0 },
+    { -4, 0, -4, 0, -4, 0, -4, 0, -4, 0, -4, 0, -4, 0, -4, 0 },
+};
+#endif
+
+// 16-bit big-endian samples to 8 bits: keep the most significant byte, same as Wuffs
+TEMPLATE void narrow_row(uint8_t *restrict dest, const uint8_t *restrict src, uint32_t count) {
+    uint32_t i = 0;
+
+#ifdef PNGS_NEON
+    for (; i + 16 <= count; i += 16) {
+        vst1q_u8(dest + i, vld2q_u8(src + i * 2).val[0]);
+    }
+#endif
+
+    for (; i < count; i++) {
+        dest[i] = src[i * 2];
+    }
+}
+
+// 1, 2 or 4-bit samples, starting at the first bit of src, to bytes, multiplied by multiplier
+TEMPLATE void expand_row(uint8_t *restrict dest, const uint8_t *restrict src, uint32_t count,
+                       uint8_t bit_depth, uint32_t multiplier) {
+    const uint32_t per_byte = 8u / bit_depth;
+    const uint32_t mask = (1u << bit_depth) - 1;
+
+    uint32_t i = 0;
+
+#ifdef PNGS_NEON
+    const int variant = bit_depth == 1 ? 0 : bit_depth == 2 ? 1 : 2;
+
+    const uint8x16_t bytes = vld1q_u8(expand_bytes[variant]);
+    const int8x16_t shifts = vld1q_s8(expand_shifts[variant]);
+    const uint8x16_t step = vdupq_n_u8((uint8_t) (16 / per_byte));
+    const uint8x16_t masks = vdupq_n_u8((uint8_t) mask);
+    const uint8x16_t multipliers = vdupq_n_u8((uint8_t) multiplier);
+
+    for (; i + 16 * per_byte <= count; i += 16 * per_byte, src += 16) {
+        const uint8x16_t packed = vld1q_u8(src);
+
+        uint8x16_t index = bytes;
+        for (uint32_t k = 0; k < per_byte; k++) {
+            const uint8x16_t samples = vandq_u8(vshlq_u8(vqtbl1q_u8(packed, index), shifts), masks);
+            vst1q_u8(dest + i + k * 16, vmulq_u8(samples, multipliers));
+            index = vaddq_u8(index, step);
+        }
+    }
+#endif
+
+    // whole bytes, then the remaining samples of the last one
+    for (; i + per_byte <= count; i += per_byte) {
+        const uint32_t packed = *src++;
+        for (uint32_t k = 0; k < per_byte; k++) {
+            dest[i + k] = (uint8_t) (((packed >> (8 - bit_depth * (k + 1))) & mask) * multiplier);
+        }
+    }
+
+    for (uint32_t k = 0; i < count; i++, k++) {
+        dest[i] = (uint8_t) (((*src >> (8 - bit_depth * (k + 1))) & mask) * multiplier);
+    }
+}
+
+// sub-byte samples, multiplied by multiplier (1 or the one, that scales them to full range)
+TEMPLATE void sample_packed(uint8_t *restrict dest, const uint8_t *restrict row, uint32_t count,
+                            uint32_t x0, uint32_t step, uint8_t bit_depth, uint32_t multiplier) {
+    const uint32_t mask = (1u << bit_depth) - 1;
+    const uint32_t per_byte_log2 = bit_depth == 1 ? 3 : bit_depth == 2 ? 2 : 1;
+
+    uint32_t i, x;
+
+    // samples, that don't start at byte boundary, are picked one by one
+    for (i = 0, x = x0; i < count && (step != 1 || (x & ((1u << per_byte_log2) - 1)) != 0); i++, x += step) {
+        const uint32_t shift = 8 - bit_depth * ((x & ((1u << per_byte_log2) - 1)) + 1);
+        dest[i] = (uint8_t) (((row[x >> per_byte_log2] >> shift) & mask) * multiplier);
+    }
+
+    if (i < count) {
+        expand_row(dest + i, row + (x >> per_byte_log2), count - i, bit_depth, multiplier);
+    }
+}
+
+#define SAMPLER_PARAMS uint8_t *restrict dest, const uint8_t *restrict row, uint32_t count, uint32_t x0, uint32_t step
+
+static void sample_8(SAMPLER_PARAMS) {
+    for (uint32_t i = 0, x = x0; i < count; i++, x += step) {
+        dest[i] = row[x];
+    }
+}
+
+static void sample_8_contiguous(SAMPLER_PARAMS) {
+    memcpy(dest, row + x0, count);
+}
+
+static void sample_16(SAMPLER_PARAMS) {
+    for (uint32_t i = 0, x = x0; i < count; i++, x += step) {
+        dest[i] = row[x * 2];
+    }
+}
+
+static void sample_16_contiguous(SAMPLER_PARAMS) {
+    narrow_row(dest, row + x0 * 2, count);
+}
+
+#define PACKED_SAMPLERS(depth)                                                          \
+    static void sample_##depth(SAMPLER_PARAMS) {                                        \
+        sample_packed(dest, row, count, x0, step, depth, 1);                            \
+    }                                                                                   \
+    static void sample_##depth##_contiguous(SAMPLER_PARAMS) {                           \
+        sample_packed(dest, row, count, x0, 1, depth, 1);                               \
+    }                                                                                   \
+    static void sample_##depth##_scaled(SAMPLER_PARAMS) {                               \
+        sample_packed(dest, row, count, x0, step, depth, 255 / ((1u << depth) - 1));    \
+    }                                                                                   \
+    static void sample_##depth##_scaled_contiguous(SAMPLER_PARAMS) {                    \
+        sample_packed(dest, row, count, x0, 1, depth, 255 / ((1u << depth) - 1));       \
+    }
+
+PACKED_SAMPLERS(1)
+PACKED_SAMPLERS(2)
+PACKED_SAMPLERS(4)
+
+row_sampler select_sampler(uint8_t bit_depth, int scale, uint32_t step) {
+    // [bit depth][scale][contiguous]
+    static const row_sampler packed[3][2][2] = {
+        { { sample_1, sample_1_contiguous }, { sample_1_scaled, sample_1_scaled_contiguous } },
+        { { sample_2, sample_2_contiguous }, { sample_2_scaled, sample_2_scaled_contiguous } },
+        { { sample_4, sample_4_contiguous }, { sample_4_scaled, sample_4_scaled_contiguous } },
+    };
+
+    const int contiguous = step == 1;
+
+    switch (bit_depth) {
+        case 8:
+            return contiguous ? sample_8_contiguous : sample_8;
+        case 16:
+            return contiguous ? sample_16_contiguous : sample_16;
+        default:
+            return packed[bit_depth == 1 ? 0 : bit_depth == 2 ? 1 : 2][scale != 0][contiguous];
+    }
+}
+
+void sample_row(uint8_t *restrict dest, const uint8_t *restrict row, uint32_t count,
+                uint32_t x0, uint32_t step, uint8_t bit_depth, int scale) {
+    select_sampler(bit_depth, scale, step)(dest, row, count, x0, step);
+}
+
+TEMPLATE void pack(uint8_t *restrict dest, const uint8_t *restrict src, uint32_t count, uint8_t bits) {
+    const uint32_t per_byte = 8 / bits;
+    const uint32_t mask = (1u << bits) - 1;
+
+    uint32_t i = 0;
+
+    for (; i + per_byte <= count; i += per_byte) {
+        uint32_t packed = 0;
+        for (uint32_t k = 0; k < per_byte; k++) {
+            packed = (packed << bits) | (src[i + k] & mask);
+        }
+        *dest++ = (uint8_t) packed;
+    }
+
+    if (i < count) {
+        uint32_t packed = 0;
+        for (uint32_t k = 0; k < per_byte; k++) {
+            packed = (packed << bits) | (i + k < count ? src[i + k] & mask : 0);
+        }
+        *dest = (uint8_t) packed;
+    }
+}
+
+static void pack_row_1(uint8_t *restrict dest, const uint8_t *restrict src, uint32_t count) {
+    pack(dest, src, count, 1);
+}
+
+static void pack_row_2(uint8_t *restrict dest, const uint8_t *restrict src, uint32_t count) {
+    pack(dest, src, count, 2);
+}
+
+static void pack_row_4(uint8_t *restrict dest, const uint8_t *restrict src, uint32_t count) {
+    pack(dest, src, count, 4);
+}
+
+row_packer select_packer(uint8_t bits) {
+    return bits == 1 ? pack_row_1 : bits == 2 ? pack_row_2 : pack_row_4;
+}
+
+void pack_row(uint8_t *restrict dest, const uint8_t *restrict src, uint32_t count, uint8_t bits) {
+    select_packer(bits)(dest, src, count);
+}
+
+void map_pixels(uint8_t *restrict dest, const uint8_t *restrict src, const uint32_t *restrict table, uint32_t count) {
+    for (uint32_t i = 0; i < count; i++) {
+        memcpy(dest + (size_t) i * 4, table + src[i], 4);
+    }
+}
+
+// single channel of abgr_nonpremul_to_argb_premul
+static inline uint32_t premultiply_8(uint32_t c, uint32_t a) {
+    return ((c * (a * (0x101 * 0x101))) / 0xFFFF) >> 8;
+}
+
+// Wuffs premultiplies 16-bit samples before dropping their low byte
+static inline uint32_t premultiply_16(uint32_t c, uint32_t a) {
+    return ((c * a) / 0xFFFF) >> 8;
+}
+
+TEMPLATE void convert_rgba(uint8_t *restrict dest, const uint8_t *restrict row, uint32_t count,
+                           const uint16_t *restrict key, uint8_t color_type, uint8_t bit_depth, int has_key) {
+    const uint32_t channels = color_type == 0 ? 1 : color_type == 2 ? 3 : color_type == 4 ? 2 : 4;
+    const uint32_t size = bit_depth / 8;
+    const uint32_t max = bit_depth == 16 ? 0xFFFF : 0xFF;
+    const int has_alpha = channels == 2 || channels == 4;
+
+    uint32_t i = 0;
+
+#ifdef PNGS_NEON
+    if (channels == 4 && size == 1) {
+        for (; i + 16 <= count; i += 16) {
+            const uint8x16x4_t src = vld4q_u8(row + (size_t) i * 4);
+
+            uint8x16x4_t rgba;
+            rgba.val[0] = premultiply(src.val[0], src.val[3]);
+            rgba.val[1] = premultiply(src.val[1], src.val[3]);
+            rgba.val[2] = premultiply(src.val[2], src.val[3]);
+            rgba.val[3] = src.val[3];
+
+            vst4q_u8(dest + (size_t) i * 4, rgba);
+        }
+    } else if (channels == 3 && size == 1 && !has_key) {
+        for (; i + 16 <= count; i += 16) {
+            const uint8x16x3_t src = vld3q_u8(row + (size_t) i * 3);
+
+            uint8x16x4_t rgba;
+            rgba.val[0] = src.val[0];
+            rgba.val[1] = src.val[1];
+            rgba.val[2] = src.val[2];
+            rgba.val[3] = vdupq_n_u8(0xFF);
+
+            vst4q_u8(dest + (size_t) i * 4, rgba);
+        }
+    }
+#endif
+
+    for (; i < count; i++) {
+        const uint8_t *p = row + (size_t) i * channels * size;
+        uint8_t *d = dest + (size_t) i * 4;
+
+        uint32_t s[4];
+        for (uint32_t k = 0; k < channels; k++) {
+            s[k] = size == 2 ? ((uint32_t) p[k * 2] << 8) | p[k * 2 + 1] : p[k];
+        }
+
+        const uint32_t r = s[0];
+        const uint32_t g = channels >= 3 ? s[1] : s[0];
+        const uint32_t b = channels >= 3 ? s[2] : s[0];
+
+        if (has_key && r == (key[0] & max) && (channels == 1 || (g == (key[1] & max) && b == (key[2] & max)))) {
+            memset(d, 0, 4);
+        } else if (!has_alpha) {
+            d[0] = (uint8_t) (r >> (bit_depth - 8));
+            d[1] = (uint8_t) (g >> (bit_depth - 8));
+            d[2] = (uint8_t) (b >> (bit_depth - 8));
+            d[3] = 0xFF;
+        } else {
+            const uint32_t a = s[channels - 1];
+            d[0] = (uint8_t) (size == 2 ? premultiply_16(r, a) : premultiply_8(r, a));
+            d[1] = (uint8_t) (size == 2 ? premultiply_16(g, a) : premultiply_8(g, a));
+            d[2] = (uint8_t) (size == 2 ? premultiply_16(b, a) : premultiply_8(b, a));
+            d[3] = (uint8_t) (a >> (bit_depth - 8));
+        }
+    }
+}
+
+#define RGBA_CONVERTER(name, color_type, bit_depth, has_key)                                                   \
+    static void name(uint8_t *restrict dest, const uint8_t *restrict row, uint32_t count,                       \
+                     const uint16_t *restrict key) {                                                            \
+        convert_rgba(dest, row, count, key, color_type, bit_depth, has_key);                                    \
+    }
+
+RGBA_CONVERTER(rgba_from_grey_16, 0, 16, 0)
+RGBA_CONVERTER(rgba_from_grey_16_keyed, 0, 16, 1)
+RGBA_CONVERTER(rgba_from_rgb_8, 2, 8, 0)
+RGBA_CONVERTER(rgba_from_rgb_8_keyed, 2, 8, 1)
+RGBA_CONVERTER(rgba_from_rgb_16, 2, 16, 0)
+RGBA_CONVERTER(rgba_from_rgb_16_keyed, 2, 16, 1)
+RGBA_CONVERTER(rgba_from_grey_alpha_8, 4, 8, 0)
+RGBA_CONVERTER(rgba_from_grey_alpha_16, 4, 16, 0)
+RGBA_CONVERTER(rgba_from_rgba_8, 6, 8, 0)
+RGBA_CONVERTER(rgba_from_rgba_16, 6, 16, 0)
+
+rgba_converter select_rgba_converter(uint8_t color_type, uint8_t bit_depth, int has_key) {
+    if (bit_depth != 8 && bit_depth != 16) {
+        return NULL;
+    }
+
+    const int wide = bit_depth == 16;
+
+    switch (color_type) {
+        case 0:
+            return !wide ? NULL : has_key ? rgba_from_grey_16_keyed : rgba_from_grey_16;
+        case 2:
+            if (wide) {
+                return has_key ? rgba_from_rgb_16_keyed : rgba_from_rgb_16;
+            }
+            return has_key ? rgba_from_rgb_8_keyed : rgba_from_rgb_8;
+        case 4:
+            return wide ? rgba_from_grey_alpha_16 : rgba_from_grey_alpha_8;
+        case 6:
+            return wide ? rgba_from_rgba_16 : rgba_from_rgba_8;
+        default:
+            return NULL;
+    }
+}
@@ -0,0 +1,64 @@
+// Copyright 2023 Alexander Rvachev
+// Licensed under Apache License, Version 2.0
+// Refer to the LICENSE file included.
+
+#ifndef PNGS_KERNELS_H
+#define PNGS_KERNELS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Convert Wuffs palette (non-premultiplied BGRA) to premultiplied RGBA, expected by Android.
+// Returns 1 if all colors are fully opaque
+int copyPalette(uint8_t *restrict dest, const uint8_t *restrict src, size_t size);
+
+// dest[i] = table[src[i]]; dest and src may point to the same memory
+void map_bytes(uint8_t *dest, const uint8_t *src, const uint8_t *restrict table, size_t size);
+
+// Returns position of first byte in src, that maps to non-zero value in table, or size if there is none
+size_t find_mapped(const uint8_t *src, const uint8_t *restrict table, size_t size);
+
+// Reverse PNG filter of a single row in place. prev is the previous (already unfiltered) row or zeroes,
+// bpp is the number of bytes per complete pixel (at least 1). Returns 0 if filter type is invalid
+int unfilter_row(uint8_t *restrict row, const uint8_t *restrict prev, size_t size, size_t bpp, uint8_t filter);
+
+typedef int (*row_unfilter)(uint8_t *restrict row, const uint8_t *restrict prev, size_t size, size_t bpp, uint8_t filter);
+
+// unfilter_row, specialized for given bpp (which is then ignored by the returned function)
+row_unfilter select_unfilter(size_t bpp);
+
+// Pick every step-th sample of unfiltered row, starting from sample x0, and expand it to 8 bits.
+// bit_depth is 1, 2, 4, 8 or 16, sub-byte samples are scaled to full range only if scale is set
+// (16-bit samples keep the most significant byte). Contiguous rows (step 1) are converted in bulk
+void sample_row(uint8_t *restrict dest, const uint8_t *restrict row, uint32_t count,
+                uint32_t x0, uint32_t step, uint8_t bit_depth, int scale);
+
+typedef void (*row_sampler)(uint8_t *restrict dest, const uint8_t *restrict row, uint32_t count,
+                            uint32_t x0, uint32_t step);
+
+// sample_row, specialized for given bit_depth, scale and contiguity of rows (step 1 or not),
+// to be selected once per image instead of branching on them for every row
+row_sampler select_sampler(uint8_t bit_depth, int scale, uint32_t step);
+
+// Pack 8-bit indices into bits-wide (1, 2 or 4) fields, most significant first, same as PNG does.
+// Unused low bits of the last byte are zeroed
+void pack_row(uint8_t *restrict dest, const uint8_t *restrict src, uint32_t count, uint8_t bits);
+
+typedef void (*row_packer)(uint8_t *restrict dest, const uint8_t *restrict src, uint32_t count);
+
+// pack_row, specialized for given bits
+row_packer select_packer(uint8_t bits);
+
+// dest[i] = table[src[i]] for 4-byte entries (premultiplied RGBA colors of palette or greyscale levels)
+void map_pixels(uint8_t *restrict dest, const uint8_t *restrict src, const uint32_t *restrict table, uint32_t count);
+
+// Convert unfiltered row of count pixels with 8 or 16 bits per sample (16-bit greyscale, RGB, greyscale with alpha
+// or RGBA, PNG color type 0, 2, 4 and 6) to premultiplied RGBA, rounding the same way as Wuffs. Pixels, equal
+// to key (samples of tRNS chunk in PNG order, only the low byte is compared for 8-bit images), become transparent
+typedef void (*rgba_converter)(uint8_t *restrict dest, const uint8_t *restrict row, uint32_t count,
+                               const uint16_t *restrict key);
+
+// converter for given color type, bit depth and presence of tRNS, NULL if the combination is not supported
+rgba_converter select_rgba_converter(uint8_t color_type, uint8_t bit_depth, int has_key);
+
+#endif
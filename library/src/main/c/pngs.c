@@ -6,7 +6,13 @@
 
 #include <stdio.h>
 #include <stdint.h>
+#include <string.h>
 #include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <dlfcn.h>
+#include <pthread.h>
 #include <sys/mman.h>
 #include <arpa/inet.h>
 #include <android/log.h>
@@ -14,6 +20,7 @@
 #include <android/bitmap.h>
 #include <android/trace.h>
 #include "jni.h"
+#include "kernels.h"
 
 #define WUFFS_CONFIG__MODULES
 #define WUFFS_CONFIG__MODULE__ADLER32
@@ -29,259 +36,2939 @@
 
 #include "wuffs-unsupported-snapshot.c"
 
+#ifdef PNGS_PGO_GENERATE
+// from compiler-rt profile runtime, linked into instrumented builds
+int __llvm_profile_write_file(void);
+#endif
+
 #define LOG_TAG "pngs"
 
-#define LOG(str, ...) (__android_log_print(ANDROID_LOG_ERROR, LOG_TAG, str, __VA_ARGS__))
+// Details of failures are only logged by debug builds, callers learn the reason from ERROR_* code in result
+#ifdef NDEBUG
+#define LOG(str, ...) ((void) 0)
+#else
+#define LOG(str, ...) (__android_log_print(ANDROID_LOG_DEBUG, LOG_TAG, str, __VA_ARGS__))
+#endif
 
 #define OPTION_DECODE_AS_MASK 0x4
 #define OPTION_EXTRACT_MASK 0x8
+#define OPTION_PACK_INDICES 0x10
+#define OPTION_PARALLEL 0x20
+#define OPTION_TRUSTED_SOURCE 0x40
 
 #define FLAG_U8_MASK 0x2
 #define FLAG_GREY 0x4
 #define FLAG_OPAQUE 0x8
+#define FLAG_RGBA 0x10
+// bits per index of packed image, stored in the second byte of result
+#define FLAG_PACKED_SHIFT 8
+// bit depth of source image, stored in the third byte of result
+#define FLAG_DEPTH_SHIFT 16
+// reason of failure, stored in the highest byte of result (with the lowest bit clear)
+#define FLAG_ERROR_SHIFT 24
+
+// Reasons of decoding failure, same as PngDecoder.ERROR_* constants
+enum {
+    ERROR_NONE,
+    // corrupted or truncated image data
+    ERROR_MALFORMED,
+    // valid image or request, that this decoder (or device) does not handle
+    ERROR_UNSUPPORTED,
+    // image has colors and can not be decoded to 8-bit output
+    ERROR_NOT_INDEXED,
+    // output Bitmap or buffer is too small, has wrong format or doesn't contain requested region
+    ERROR_OUTPUT,
+    ERROR_ALLOCATION,
+    ERROR_LOCK,
+    // reading from file descriptor or channel failed
+    ERROR_IO,
+    ERROR_COUNT
+};
+
+// AHARDWAREBUFFER_FORMAT_R8_UNORM, not present in older NDK headers
+#define HARDWARE_BUFFER_FORMAT_R8 0x38
+
+// layout of image information, returned by probe()
+#define PROBE_WIDTH 0
+#define PROBE_HEIGHT 1
+#define PROBE_BIT_DEPTH 2
+#define PROBE_COLOR_TYPE 3
+#define PROBE_PALETTE_SIZE 4
+#define PROBE_FLAGS 5
+#define PROBE_WORKBUF_LENGTH 6
+#define PROBE_FIELDS 7
+
+#define PROBE_FLAG_TRANSPARENCY 0x1
+#define PROBE_FLAG_INTERLACED 0x2
+#define PROBE_FLAG_DECODABLE 0x4
+
+// size of input buffer for streaming decoding (from file descriptors and channels)
+#define STREAM_BUFFER_SIZE (64 * 1024)
+
+// Stages of decoding. Each one is both shown as trace section and timed for PngDecoder.Stats
+enum {
+    STAGE_CONFIG,
+    STAGE_ALLOCATION,
+    STAGE_INFLATE,
+    STAGE_PALETTE,
+    STAGE_MASK,
+    STAGE_LOCK,
+    STAGE_COUNT
+};
+
+static const char* const stage_names[STAGE_COUNT] = {
+    "config", "allocation", "inflate", "palette", "mask", "lock"
+};
+
+// layout of statistics, returned by getStats()
+#define STATS_DECODES 0
+#define STATS_FAILURES 1
+#define STATS_BYTES_DECODED 2
+#define STATS_BUFFER_BYTES 3
+#define STATS_STAGE_NANOS 4
+#define STATS_ERRORS (STATS_STAGE_NANOS + STAGE_COUNT)
+#define STATS_FIELDS (STATS_ERRORS + ERROR_COUNT)
+
+// process-wide, updated by all threads without locking
+static int64_t stats[STATS_FIELDS];
+
+// ATrace_beginSection is only available since API 23 and ATrace_setCounter since API 29
+static void trace_begin(const char* name) {
+    if (__builtin_available(android 23, *)) {
+        ATrace_beginSection(name);
+    }
+}
+
+static void trace_end(void) {
+    if (__builtin_available(android 23, *)) {
+        ATrace_endSection();
+    }
+}
 
-// copied from wuffs internals
-static inline uint32_t abgr_nonpremul_to_argb_premul(uint32_t argb_nonpremul) {
-  uint32_t a = 0xFF & (argb_nonpremul >> 24);
-  uint32_t a16 = a * (0x101 * 0x101);
+static void trace_counter(const char* name, int64_t value) {
+    if (__builtin_available(android 29, *)) {
+        if (ATrace_isEnabled()) {
+            ATrace_setCounter(name, value);
+        }
+    }
+}
+
+static int64_t add_stat(int field, int64_t value) {
+    return __atomic_add_fetch(&stats[field], value, __ATOMIC_RELAXED);
+}
+
+static int64_t now_nanos(void) {
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return (int64_t) time.tv_sec * 1000000000 + time.tv_nsec;
+}
+
+static int64_t stage_begin(int stage) {
+    trace_begin(stage_names[stage]);
+    return now_nanos();
+}
+
+static void stage_end(int stage, int64_t started) {
+    add_stat(STATS_STAGE_NANOS + stage, now_nanos() - started);
+    trace_end();
+}
 
-  uint32_t r = 0xFF & (argb_nonpremul >> 16);
-  r = ((r * a16) / 0xFFFF) >> 8;
-  uint32_t g = 0xFF & (argb_nonpremul >> 8);
-  g = ((g * a16) / 0xFFFF) >> 8;
-  uint32_t b = 0xFF & (argb_nonpremul >> 0);
-  b = ((b * a16) / 0xFFFF) >> 8;
+// Reason of the latest failure on current thread. Each failing step records it's own reason with fail(),
+// so that decoding functions can keep returning 0, and the reason is picked up by count_decode()
+static __thread uint8_t last_error;
 
-  return (a << 24) | (b << 16) | (g << 8) | (r << 0);
+static int fail(int error) {
+    last_error = (uint8_t) error;
+    return 0;
 }
 
-static int copyPalette(const uint8_t *restrict dest, const uint8_t *restrict src, size_t size) {
-    int is_opaque = 1;
+static int take_error(void) {
+    const int error = last_error;
+    last_error = ERROR_NONE;
+    return error;
+}
 
-    for (int i = 0; i < size; i += 4) {
-        const uint32_t* srcColor = (uint32_t*) (src + i);
-        uint32_t* dstColor = (uint32_t*) (dest + i);
+// called once per decoding request with it's final result, turns failure into error code
+static jint count_decode(jint result) {
+    int error = take_error();
 
-        const uint32_t abgr = *srcColor;
-        const uint32_t alpha = 0xFF & (abgr >> 24);
-        if (alpha != 0xFF) is_opaque = 0;
+    if (result != 0) {
+        add_stat(STATS_DECODES, 1);
+        return result;
+    }
 
-        *dstColor = abgr_nonpremul_to_argb_premul(abgr);
+    if (error == ERROR_NONE) {
+        error = ERROR_UNSUPPORTED;
     }
 
-    return is_opaque;
+    add_stat(STATS_FAILURES, 1);
+    add_stat(STATS_ERRORS + error, 1);
+
+    return error << FLAG_ERROR_SHIFT;
+}
+
+static void count_decoded_bytes(uint64_t bytes) {
+    trace_counter("pngs_bytes_decoded", add_stat(STATS_BYTES_DECODED, (int64_t) bytes));
 }
 
-static void extract_mask(uint8_t *restrict dest, uint8_t *restrict src, uint32_t *restrict palette, size_t size) {
-    for (int i = 0; i < size; i++) {
-        uint8_t value = src[i];
-        uint32_t color = palette[value];
-        uint8_t alpha = (uint8_t) ((color >> 24) & 0xFF);
-        dest[i] = alpha;
+// native buffers of all decoder contexts, that are currently allocated
+static void count_buffer_bytes(int64_t delta) {
+    if (delta != 0) {
+        trace_counter("pngs_buffer_bytes", add_stat(STATS_BUFFER_BYTES, delta));
     }
 }
 
-static int convert_to_mask(uint8_t *restrict dest, uint8_t *restrict src, uint32_t *restrict palette, size_t size) {
-    uint32_t hue = 0;
+// 8-bit image rows, e.g. locked Bitmap pixels
+typedef struct image_plane {
+    uint8_t* ptr;
+    size_t stride;
+    uint32_t width;
+    uint32_t height;
+} image_plane;
+
+static void make_alpha_table(uint8_t *restrict table, const uint32_t *restrict palette) {
+    for (int i = 0; i < 256; i++) {
+        table[i] = (uint8_t) ((palette[i] >> 24) & 0xFF);
+    }
+}
+
+static void plane_to_mask(const image_plane *plane, const uint32_t *restrict palette) {
+    uint8_t alpha[256];
+    make_alpha_table(alpha, palette);
+
+    if (plane->stride == plane->width) {
+        map_bytes(plane->ptr, plane->ptr, alpha, (size_t) plane->width * plane->height);
+        return;
+    }
+
+    for (uint32_t y = 0; y < plane->height; y++) {
+        uint8_t* row = plane->ptr + y * plane->stride;
+
+        map_bytes(row, row, alpha, plane->width);
+    }
+}
+
+// returns 1 if some pixel of plane maps to non-zero table entry and stores it in *found
+static int plane_find_mapped(const image_plane *plane, const uint8_t *restrict table, uint8_t *found) {
+    size_t row_size = plane->width;
+    uint32_t rows = plane->height;
+
+    if (plane->stride == plane->width) {
+        row_size *= rows;
+        rows = 1;
+    }
+
+    for (uint32_t y = 0; y < rows; y++) {
+        const uint8_t* row = plane->ptr + y * plane->stride;
 
-    for (int i = 0; i < size; i++) {
-        uint8_t value = src[i];
-        uint32_t color = palette[value];
-        uint8_t alpha = (uint8_t) ((color >> 24) & 0xFF);
-        dest[i] = alpha;
+        size_t position = find_mapped(row, table, row_size);
+        if (position != row_size) {
+            *found = row[position];
+            return 1;
+        }
+    }
+
+    return 0;
+}
 
-        if (alpha != 0) {
-            if (hue != 0 && (hue & 0x00FFFFFF) != (color & 0x00FFFFFF)) return 0;
+static int plane_is_single_hue(const image_plane *plane, const uint32_t *restrict palette) {
+    // cheap check first: all visible colors of palette have the same hue
+    uint32_t hue = 0;
+    int single_hue = 1;
+
+    for (int i = 0; i < 256; i++) {
+        uint32_t color = palette[i];
+        if ((color >> 24) != 0) {
+            if (hue != 0 && (hue & 0x00FFFFFF) != (color & 0x00FFFFFF)) {
+                single_hue = 0;
+                break;
+            }
             hue = color;
         }
     }
 
-    return 1;
+    if (single_hue) {
+        return 1;
+    }
+
+    // otherwise only visible colors actually used by image matter:
+    // take the first visible pixel and look for visible pixels of different hue
+    uint8_t table[256];
+    make_alpha_table(table, palette);
+
+    uint8_t first;
+    if (!plane_find_mapped(plane, table, &first)) {
+        return 1;
+    }
+
+    hue = palette[first] & 0x00FFFFFF;
+
+    for (int i = 0; i < 256; i++) {
+        uint32_t color = palette[i];
+        table[i] = (color >> 24) != 0 && (color & 0x00FFFFFF) != hue;
+    }
+
+    return !plane_find_mapped(plane, table, &first);
 }
 
-JNIEXPORT jint JNICALL Java_org_bitmapdecoder_PngDecoder_decode(
-        JNIEnv* env,
-        jclass type,
-        jobject buffer,
-        jobject out_image,
-        jbyteArray out_palette,
-        jint position,
-        jint limit,
-        jint options
-) {
+// Decoder state, that can be reused between decoding calls. The work and staging buffers
+// only grow, so after a couple of images their allocation cost disappears entirely
+typedef struct decoder_context {
+    // each decoding pass (re)initializes the decoder it needs
+    union {
+        wuffs_png__decoder decoder;
+        // used by the row-by-row decoder for subsampled output
+        wuffs_zlib__decoder inflater;
+    };
+    wuffs_base__slice_u8 workbuf;
+    wuffs_base__slice_u8 staging;
+    wuffs_base__slice_u8 input;
+} decoder_context;
+
+// PNG data, either mapped into memory in it's entirety or streamed in chunks
+typedef struct image_source {
+    wuffs_base__io_buffer buffer;
+    JNIEnv* env;
+    // file descriptor, -1 if not reading from file
+    int fd;
+    off_t offset;
+    // end of image within file, -1 if unknown
+    off_t end;
+    // java.nio.channels.ReadableByteChannel, NULL if not reading from channel
+    jobject channel;
+    jobject channel_buffer;
+    jclass decoder_class;
+    jmethodID read_method;
+    // exception, thrown by channel (rethrown after the Bitmap is unlocked)
+    jthrowable error;
+    // set when the last refill() failed to read, so that the following short read is not blamed on the image
+    uint8_t read_failed;
+    // bits per sample from IHDR, 0 until the header is read
+    uint8_t bit_depth;
+    // skip CRC-32 of chunks and Adler-32 of image data, see OPTION_TRUSTED_SOURCE
+    uint8_t ignore_checksum;
+    // palette and rows of precompiled image (see read_container), NULL for PNG
+    const uint8_t* container_palette;
+    const uint8_t* container_rows;
+    size_t container_stride;
+} image_source;
+
+static uint8_t* reserve(wuffs_base__slice_u8 *arena, uint64_t size) {
+    if (arena->len < size) {
+        const int64_t started = stage_begin(STAGE_ALLOCATION);
+        const int64_t old_len = (int64_t) arena->len;
+
+        free(arena->ptr);
+
+        *arena = wuffs_base__malloc_slice_u8(malloc, size);
+
+        count_buffer_bytes((int64_t) arena->len - old_len);
+        stage_end(STAGE_ALLOCATION, started);
+    }
+
+    return arena->ptr;
+}
+
+static void reset_buffers(decoder_context *context) {
+    context->workbuf = wuffs_base__empty_slice_u8();
+    context->staging = wuffs_base__empty_slice_u8();
+    context->input = wuffs_base__empty_slice_u8();
+}
+
+static void release_buffers(decoder_context *context) {
+    count_buffer_bytes(-(int64_t) (context->workbuf.len + context->staging.len + context->input.len));
+
+    free(context->workbuf.ptr);
+    free(context->staging.ptr);
+    free(context->input.ptr);
+
+    reset_buffers(context);
+}
+
+static int map_source(JNIEnv* env, jobject buffer, jint position, jint limit, image_source* src) {
     uint8_t* mapped = (*env)->GetDirectBufferAddress(env, buffer);
     if (mapped == NULL) {
+        return fail(ERROR_UNSUPPORTED);
+    }
+
+    const size_t size = limit - position;
+
+    *src = (image_source) {
+        .buffer = wuffs_base__ptr_u8__reader(mapped + position, size, true),
+        .env = env,
+        .fd = -1
+    };
+
+    return 1;
+}
+
+// prepare empty io_buffer in context's input arena, it will be filled by refill()
+static int open_stream(decoder_context* context, image_source* src) {
+    uint8_t* input = reserve(&context->input, STREAM_BUFFER_SIZE);
+    if (!input) {
+        LOG("%s\n", "Could not allocate input buffer");
+        return fail(ERROR_ALLOCATION);
+    }
+
+    src->buffer = wuffs_base__ptr_u8__reader(input, STREAM_BUFFER_SIZE, false);
+    src->buffer.meta.wi = 0;
+
+    return 1;
+}
+
+static ssize_t read_fd(image_source* src, uint8_t* dest, size_t size) {
+    if (src->end >= 0 && (off_t) size > src->end - src->offset) {
+        size = src->end - src->offset;
+    }
+
+    ssize_t bytes_read;
+    do {
+        bytes_read = pread(src->fd, dest, size, src->offset);
+    } while (bytes_read < 0 && errno == EINTR);
+
+    if (bytes_read < 0) {
+        LOG("Failed to read file: %d\n", errno);
+        return -1;
+    }
+
+    src->offset += bytes_read;
+
+    return bytes_read;
+}
+
+static ssize_t read_channel(image_source* src, uint8_t* dest, size_t size) {
+    JNIEnv* env = src->env;
+
+    const jint position = (jint) (dest - src->buffer.data.ptr);
+
+    jint bytes_read = (*env)->CallStaticIntMethod(env, src->decoder_class, src->read_method,
+                                                  src->channel, src->channel_buffer, position, position + (jint) size);
+
+    if ((*env)->ExceptionCheck(env)) {
+        src->error = (*env)->ExceptionOccurred(env);
+        (*env)->ExceptionClear(env);
+        return -1;
+    }
+
+    return bytes_read < 0 ? 0 : bytes_read;
+}
+
+// called when Wuffs suspends with short_read: move unread bytes to the start of buffer
+// and read the next chunk after them. Returns 0 if no more data can be supplied
+static int refill(image_source* src) {
+    wuffs_base__io_buffer* buf = &src->buffer;
+    if (buf->meta.closed) {
+        return 0;
+    }
+
+    wuffs_base__io_buffer__compact(buf);
+
+    const size_t room = buf->data.len - buf->meta.wi;
+    if (room == 0) {
+        return 0;
+    }
+
+    uint8_t* dest = buf->data.ptr + buf->meta.wi;
+
+    const ssize_t bytes_read = src->channel != NULL
+            ? read_channel(src, dest, room)
+            : read_fd(src, dest, room);
+
+    if (bytes_read < 0) {
+        src->read_failed = 1;
         return 0;
     }
 
-    mapped += position;
+    if (bytes_read == 0) {
+        buf->meta.closed = true;
+    } else {
+        buf->meta.wi += bytes_read;
+    }
+
+    return 1;
+}
 
-    const jlong size = limit - position;
+// reason of failed Wuffs call, src may be NULL for in-memory data
+static int status_error(const image_source* src, const wuffs_base__status* status) {
+    if (status->repr == wuffs_base__suspension__short_read && src != NULL && src->read_failed) {
+        return ERROR_IO;
+    }
+    if (status->repr != NULL && strstr(status->repr, ": unsupported ") != NULL) {
+        return ERROR_UNSUPPORTED;
+    }
+    return ERROR_MALFORMED;
+}
 
-    wuffs_png__decoder decoder;
-    wuffs_base__status i_status = wuffs_png__decoder__initialize(&decoder, sizeof decoder, WUFFS_VERSION, 0);
+static int read_config(decoder_context* context, image_source* src, wuffs_base__image_config* imageconfig) {
+    wuffs_png__decoder* decoder = &context->decoder;
+    wuffs_base__status i_status = wuffs_png__decoder__initialize(decoder, sizeof *decoder, WUFFS_VERSION,
+                                                                 WUFFS_INITIALIZE__LEAVE_INTERNAL_BUFFERS_UNINITIALIZED);
     if (!wuffs_base__status__is_ok(&i_status)) {
         LOG("%s\n", wuffs_base__status__message(&i_status));
-        return 0;
+        return fail(ERROR_UNSUPPORTED);
     }
 
-    wuffs_base__io_buffer src = {
-        .data = {
-            .ptr = mapped,
-            .len = size
-        },
-        .meta = {
-            .wi = size,
-            .ri = 0,
-            .pos = 0,
-            .closed = true
+    if (src->ignore_checksum) {
+        wuffs_png__decoder__set_quirk_enabled(decoder, WUFFS_BASE__QUIRK_IGNORE_CHECKSUM, true);
+    }
+
+    wuffs_base__status dic_status;
+    do {
+        dic_status = wuffs_png__decoder__decode_image_config(decoder, imageconfig, &src->buffer);
+
+        // Wuffs checks, that IHDR is the first chunk, so the bit depth is at fixed offset
+        // (as long as the start of image has not yet been compacted away by refill)
+        if (src->buffer.meta.pos == 0 && src->buffer.meta.wi > 24) {
+            src->bit_depth = src->buffer.data.ptr[24];
         }
-    };
+    } while (dic_status.repr == wuffs_base__suspension__short_read && refill(src));
 
-    wuffs_base__image_config imageconfig;
-    wuffs_base__status dic_status = wuffs_png__decoder__decode_image_config(&decoder, &imageconfig, &src);
     if (!wuffs_base__status__is_ok(&dic_status)) {
         LOG("%s\n", wuffs_base__status__message(&dic_status));
-        return 0;
+        return fail(status_error(src, &dic_status));
     }
 
-    if (!wuffs_base__image_config__is_valid(&imageconfig)) {
+    if (!wuffs_base__image_config__is_valid(imageconfig)) {
         LOG("%s\n", "Invalid configuration");
-        return 0;
+        return fail(ERROR_MALFORMED);
     }
 
-    const uint32_t img_width = wuffs_base__pixel_config__width(&imageconfig.pixcfg);
-    const uint32_t img_height = wuffs_base__pixel_config__height(&imageconfig.pixcfg);
+    return 1;
+}
 
-    AndroidBitmapInfo bitmap_info;
-    bitmap_info.width = 0;
-    bitmap_info.height = 0;
+static int read_container(image_source* src, wuffs_base__image_config* imageconfig);
 
-    AndroidBitmap_getInfo(env, out_image, &bitmap_info);
+static int decode_config(decoder_context* context, image_source* src, wuffs_base__image_config* imageconfig) {
+    const int64_t started = stage_begin(STAGE_CONFIG);
 
-    if (img_width * img_height > bitmap_info.width * bitmap_info.height) {
-        LOG("Bitmap is %d x %d, needed %d x %d\n", bitmap_info.width, bitmap_info.height, img_width, img_height);
-        return 0;
-    }
+    const int result = read_container(src, imageconfig) || read_config(context, src, imageconfig);
 
-    wuffs_base__slice_u8 workbuff, dstbuff;
+    stage_end(STAGE_CONFIG, started);
 
-    void* separate_buffer = NULL;
+    return result;
+}
 
-    void* dst_buffer = NULL;
-    uint64_t dst_len;
+static int check_bitmap(JNIEnv* env, jobject out_image, const wuffs_base__pixel_config* pixcfg, AndroidBitmapInfo* bitmap_info) {
+    const uint32_t img_width = wuffs_base__pixel_config__width(pixcfg);
+    const uint32_t img_height = wuffs_base__pixel_config__height(pixcfg);
 
-    wuffs_base__pixel_format source_format = wuffs_base__pixel_config__pixel_format(&imageconfig.pixcfg);
-    if (source_format.repr == WUFFS_BASE__PIXEL_FORMAT__Y ||
-        source_format.repr == WUFFS_BASE__PIXEL_FORMAT__Y_16LE ||
-        source_format.repr == WUFFS_BASE__PIXEL_FORMAT__Y_16BE) {
+    bitmap_info->width = 0;
+    bitmap_info->height = 0;
 
-        wuffs_base__pixel_config__set(
-            &imageconfig.pixcfg, WUFFS_BASE__PIXEL_FORMAT__Y,
-            WUFFS_BASE__PIXEL_SUBSAMPLING__NONE, img_width, img_height);
+    AndroidBitmap_getInfo(env, out_image, bitmap_info);
 
-        dst_len = img_width * img_height;
+    if (img_width > bitmap_info->width || img_height > bitmap_info->height) {
+        LOG("Bitmap is %d x %d, needed %d x %d\n", bitmap_info->width, bitmap_info->height, img_width, img_height);
+        return fail(ERROR_OUTPUT);
+    }
 
-        AndroidBitmap_lockPixels(env, out_image, &dst_buffer);
-    } else if (out_palette == NULL) {
-        return 0;
-    } else {
-        //LOG("%s\n", "Decoding indexed to ALPHA8 with palette");
+    return 1;
+}
+
+static int lock_bitmap(JNIEnv* env, jobject bitmap, void** pixels) {
+    const int64_t started = stage_begin(STAGE_LOCK);
 
-        // decode as indexed
-keep_palette:
-        dst_len = img_width * img_height + 256 * 4;
-allocate_buffer:
-        separate_buffer = calloc(dst_len, 1);
-        dst_buffer = separate_buffer;
+    const int locked = AndroidBitmap_lockPixels(env, bitmap, pixels) == ANDROID_BITMAP_RESULT_SUCCESS;
+
+    stage_end(STAGE_LOCK, started);
+
+    if (!locked) {
+        LOG("%s\n", "Failed to lock Bitmap pixels");
+        return fail(ERROR_LOCK);
     }
 
-    if (!dst_buffer) {
-        LOG("%s\n", "Could not allocate result buffer");
-        return 0;
+    return 1;
+}
+
+static void unlock_bitmap(JNIEnv* env, jobject bitmap) {
+    const int64_t started = stage_begin(STAGE_LOCK);
+
+    AndroidBitmap_unlockPixels(env, bitmap);
+
+    stage_end(STAGE_LOCK, started);
+}
+
+// decode the image into plane (in destination format, described by pixcfg)
+static int decode_pixels(decoder_context* context,
+                         image_source* src,
+                         const wuffs_base__pixel_config* pixcfg,
+                         const image_plane* plane,
+                         uint32_t* palette) {
+    wuffs_png__decoder* decoder = &context->decoder;
+
+    uint64_t workbuf_len_max_incl = wuffs_png__decoder__workbuf_len(decoder).max_incl;
+    uint8_t* workbuf_ptr = reserve(&context->workbuf, workbuf_len_max_incl);
+    if (!workbuf_ptr && workbuf_len_max_incl != 0) {
+        LOG("%s\n", "Could not allocate work buffer");
+        return fail(ERROR_ALLOCATION);
     }
 
-    dstbuff = wuffs_base__make_slice_u8(dst_buffer, dst_len);
+    wuffs_base__slice_u8 workbuff = wuffs_base__make_slice_u8(workbuf_ptr, workbuf_len_max_incl);
+
+    const wuffs_base__pixel_format dst_format = wuffs_base__pixel_config__pixel_format(pixcfg);
+    const uint32_t bytes_per_pixel = wuffs_base__pixel_format__bits_per_pixel(&dst_format) / 8;
+
+    wuffs_base__table_u8 table = {
+        .ptr = plane->ptr,
+        .width = (size_t) plane->width * bytes_per_pixel,
+        .height = plane->height,
+        .stride = plane->stride
+    };
 
     wuffs_base__pixel_buffer pb;
-    wuffs_base__status newbuffer_status = wuffs_base__pixel_buffer__set_from_slice(&pb, &imageconfig.pixcfg, dstbuff);
+    wuffs_base__status newbuffer_status = wuffs_base__pixel_buffer__set_interleaved(
+            &pb, pixcfg, table, wuffs_base__make_slice_u8((uint8_t*) palette, 256 * 4));
 
     if (!wuffs_base__status__is_ok(&newbuffer_status)) {
         LOG("%s\n", wuffs_base__status__message(&newbuffer_status));
-        return 0;
+        return fail(ERROR_UNSUPPORTED);
     }
 
-    uint64_t workbuf_len_max_incl = wuffs_png__decoder__workbuf_len(&decoder).max_incl;
-    workbuff = wuffs_base__malloc_slice_u8(malloc, workbuf_len_max_incl);
-    if (!workbuff.ptr) {
-        LOG("%s\n", "Could not allocate work buffer");
-        return 0;
-    }
+    const int64_t started = stage_begin(STAGE_INFLATE);
+
+    wuffs_base__status framestatus;
+    do {
+        framestatus = wuffs_png__decoder__decode_frame(decoder, &pb, &src->buffer, WUFFS_BASE__PIXEL_BLEND__SRC, workbuff, NULL);
+    } while (framestatus.repr == wuffs_base__suspension__short_read && refill(src));
 
-    ATrace_beginSection("decode_frame");
+    stage_end(STAGE_INFLATE, started);
 
-    wuffs_base__status framestatus = wuffs_png__decoder__decode_frame(&decoder, &pb, &src, WUFFS_BASE__PIXEL_BLEND__SRC, workbuff, NULL);
     if (!wuffs_base__status__is_ok(&framestatus)) {
         LOG("Decoding failed: %s\n", wuffs_base__status__message(&framestatus));
-        return 0;
+        return fail(status_error(src, &framestatus));
     }
 
-    ATrace_endSection();
+    count_decoded_bytes((uint64_t) table.width * table.height);
 
-    free(workbuff.ptr);
+    return 1;
+}
 
-    jint result = 1;
+// greyscale and indexed images are decoded as 8-bit image + palette (for indexed images)
+static int select_indexed_format(wuffs_base__image_config* imageconfig, jbyteArray out_palette) {
+    const uint32_t img_width = wuffs_base__pixel_config__width(&imageconfig->pixcfg);
+    const uint32_t img_height = wuffs_base__pixel_config__height(&imageconfig->pixcfg);
 
-    uint32_t single = 0;
-    int is_opaque = 0;
+    wuffs_base__pixel_format source_format = wuffs_base__pixel_config__pixel_format(&imageconfig->pixcfg);
+    if (source_format.repr == WUFFS_BASE__PIXEL_FORMAT__Y ||
+        source_format.repr == WUFFS_BASE__PIXEL_FORMAT__Y_16LE ||
+        source_format.repr == WUFFS_BASE__PIXEL_FORMAT__Y_16BE) {
 
-    if (wuffs_base__pixel_config__pixel_format(&imageconfig.pixcfg).repr == WUFFS_BASE__PIXEL_FORMAT__Y) {
-        is_opaque = 1;
-        result |= FLAG_GREY;
-        result |= FLAG_OPAQUE;
-    } else if (out_palette != NULL) {
-        const uint8_t* palette = wuffs_base__pixel_buffer__palette(&pb).ptr;
+        wuffs_base__pixel_config__set(
+            &imageconfig->pixcfg, WUFFS_BASE__PIXEL_FORMAT__Y,
+            WUFFS_BASE__PIXEL_SUBSAMPLING__NONE, img_width, img_height);
+    } else if (out_palette == NULL || !wuffs_base__pixel_format__is_indexed(&source_format)) {
+        return fail(ERROR_NOT_INDEXED);
+    }
 
-        void *palette_mem = (*env)->GetPrimitiveArrayCritical(env, out_palette, NULL);
+    return 1;
+}
 
-        is_opaque = copyPalette(palette_mem, palette, 256 * 4);
+// Convert the palette to premultiplied RGBA and copy it into Java array, returns 1 if it is opaque.
+// Unlike GetPrimitiveArrayCritical, SetByteArrayRegion never holds off garbage collection, which
+// would stall every other thread, that allocates while several images are being decoded
+static int publish_palette(JNIEnv* env, jbyteArray out_palette, const uint32_t* palette) {
+    uint8_t converted[256 * sizeof(uint32_t)];
 
-        (*env)->ReleasePrimitiveArrayCritical(env, out_palette, palette_mem, 0);
+    const int is_opaque = copyPalette(converted, (const uint8_t*) palette, sizeof converted);
 
-        if (is_opaque) {
-            result |= FLAG_OPAQUE;
-        }
-    }
+    (*env)->SetByteArrayRegion(env, out_palette, 0, sizeof converted, (const jbyte*) converted);
+
+    return is_opaque;
+}
+
+// hand the palette over to Java and convert the plane to alpha mask, if requested
+static jint finish_indexed_plane(
+        JNIEnv* env,
+        const image_plane* plane,
+        int is_grey,
+        const uint32_t* palette,
+        jbyteArray out_palette,
+        jint options
+) {
+    jint result = 1;
 
-    if (separate_buffer == NULL) {
-        // we have decoded the image directly into Bitmap, unlock it
-        AndroidBitmap_unlockPixels(env, out_image);
+    if (is_grey) {
+        result |= FLAG_GREY;
+        result |= FLAG_OPAQUE;
     } else {
-        // copy the image to output Bitmap and release the storage
-        uint8_t* fullimage = wuffs_base__pixel_buffer__plane(&pb, 0).ptr;
+        const int64_t copy_started = stage_begin(STAGE_PALETTE);
+
+        const int is_opaque = publish_palette(env, out_palette, palette);
 
-        void *buffer_mem;
-        AndroidBitmap_lockPixels(env, out_image, &buffer_mem);
+        stage_end(STAGE_PALETTE, copy_started);
 
-        uint32_t* palette = (uint32_t*) wuffs_base__pixel_buffer__palette(&pb).ptr;
+        if (is_opaque) {
+            result |= FLAG_OPAQUE;
+        }
 
         // if we have an image where all visible palette entries have the same color
         // (different only be alpha value); this allows us to convert it to alpha mask!
         // furthermore, if we know that the image is to be tinted, we can convert to mask
-        // regardless of palette!
+        // regardless of palette! Both conversions are done in place
         if ((options & OPTION_EXTRACT_MASK) != 0) {
-            LOG("%s\n", "Forced mask conversion!!");
-            extract_mask(buffer_mem, fullimage, palette, img_width * img_height);
-            result |= FLAG_U8_MASK;
-        } else if (!is_opaque && (options & OPTION_DECODE_AS_MASK) != 0 && convert_to_mask(buffer_mem, fullimage, palette, img_width * img_height)) {
+            const int64_t mask_started = stage_begin(STAGE_MASK);
+
+            plane_to_mask(plane, palette);
             result |= FLAG_U8_MASK;
-        } else {
-            memcpy(buffer_mem, fullimage, img_width * img_height);
-        }
 
-        AndroidBitmap_unlockPixels(env, out_image);
-        free(dst_buffer);
+            stage_end(STAGE_MASK, mask_started);
+        } else if (!is_opaque && (options & OPTION_DECODE_AS_MASK) != 0) {
+            const int64_t mask_started = stage_begin(STAGE_MASK);
+
+            if (plane_is_single_hue(plane, palette)) {
+                plane_to_mask(plane, palette);
+                result |= FLAG_U8_MASK;
+            }
+
+            stage_end(STAGE_MASK, mask_started);
+        }
     }
 
     return result;
 }
+
+static int decode_grey_rows(decoder_context* context, const image_source* src, const image_plane* plane);
+
+static void copy_container(const image_source* src, const image_plane* plane, uint32_t* palette);
+
+static int decode_parallel(const image_source* src, const image_plane* plane, uint32_t* palette);
+
+static int decode_rgba_rows(decoder_context* context, const image_source* src, const image_plane* plane);
+
+// decode into locked 8-bit plane (Bitmap or hardware buffer) and post-process it
+static jint decode_indexed_plane(
+        JNIEnv* env,
+        decoder_context* context,
+        image_source* src,
+        const wuffs_base__image_config* imageconfig,
+        const image_plane* plane,
+        jbyteArray out_palette,
+        jint options
+) {
+    uint32_t palette[256];
+
+    const int is_grey = wuffs_base__pixel_config__pixel_format(&imageconfig->pixcfg).repr == WUFFS_BASE__PIXEL_FORMAT__Y;
+
+    int decoded = -1;
+    if (src->container_rows != NULL) {
+        copy_container(src, plane, palette);
+        decoded = 1;
+    } else if ((options & OPTION_PARALLEL) != 0) {
+        decoded = decode_parallel(src, plane, palette);
+    }
+
+    if (decoded < 0 && is_grey && src->bit_depth != 8) {
+        // Wuffs would inflate the whole image into work buffer at it's original depth first
+        decoded = decode_grey_rows(context, src, plane);
+    }
+    if (decoded < 0) {
+        decoded = decode_pixels(context, src, &imageconfig->pixcfg, plane, palette);
+    }
+
+    if (!decoded) {
+        return 0;
+    }
+
+    const jint result = finish_indexed_plane(env, plane, is_grey, palette, out_palette, options);
+
+    return result | src->bit_depth << FLAG_DEPTH_SHIFT;
+}
+
+static jint decode(
+        JNIEnv* env,
+        decoder_context* context,
+        image_source* src,
+        jobject out_image,
+        jbyteArray out_palette,
+        jint options
+) {
+    src->ignore_checksum = (options & OPTION_TRUSTED_SOURCE) != 0;
+
+    wuffs_base__image_config imageconfig;
+    if (!decode_config(context, src, &imageconfig)) {
+        return 0;
+    }
+
+    AndroidBitmapInfo bitmap_info;
+    if (!check_bitmap(env, out_image, &imageconfig.pixcfg, &bitmap_info)) {
+        return 0;
+    }
+
+    if (!select_indexed_format(&imageconfig, out_palette)) {
+        return 0;
+    }
+
+    void* bitmap_pixels;
+    if (!lock_bitmap(env, out_image, &bitmap_pixels)) {
+        return 0;
+    }
+
+    // both greyscale and indexed images are decoded straight into Bitmap,
+    // only the palette is kept in separate memory
+    image_plane plane = {
+        .ptr = bitmap_pixels,
+        .stride = bitmap_info.stride,
+        .width = wuffs_base__pixel_config__width(&imageconfig.pixcfg),
+        .height = wuffs_base__pixel_config__height(&imageconfig.pixcfg)
+    };
+
+    jint result = decode_indexed_plane(env, context, src, &imageconfig, &plane, out_palette, options);
+
+    unlock_bitmap(env, out_image);
+
+    return result;
+}
+
+// AHardwareBuffer CPU access lives in libnativewindow, which only exists since API 26.
+// Linking to it directly would prevent the library from loading on older devices
+typedef struct hardware_buffer_api {
+    void (*describe)(const AHardwareBuffer*, AHardwareBuffer_Desc*);
+    int (*lock)(AHardwareBuffer*, uint64_t, int32_t, const ARect*, void**);
+    int (*unlock)(AHardwareBuffer*, int32_t*);
+} hardware_buffer_api;
+
+static hardware_buffer_api hardware_buffers;
+static pthread_once_t hardware_buffers_once = PTHREAD_ONCE_INIT;
+
+static void load_hardware_buffer_api(void) {
+    void* library = dlopen("libnativewindow.so", RTLD_NOW | RTLD_LOCAL);
+    if (library == NULL) {
+        return;
+    }
+
+    hardware_buffers.describe = dlsym(library, "AHardwareBuffer_describe");
+    hardware_buffers.lock = dlsym(library, "AHardwareBuffer_lock");
+    hardware_buffers.unlock = dlsym(library, "AHardwareBuffer_unlock");
+}
+
+static const hardware_buffer_api* get_hardware_buffer_api(void) {
+    pthread_once(&hardware_buffers_once, load_hardware_buffer_api);
+
+    if (!hardware_buffers.describe || !hardware_buffers.lock || !hardware_buffers.unlock) {
+        return NULL;
+    }
+
+    return &hardware_buffers;
+}
+
+// same as decode(), but writes to CPU-mapped R8 AHardwareBuffer, that can be wrapped as HARDWARE Bitmap
+static jint decode_hardware(
+        JNIEnv* env,
+        decoder_context* context,
+        image_source* src,
+        jobject out_buffer,
+        jbyteArray out_palette,
+        jint options
+) {
+    src->ignore_checksum = (options & OPTION_TRUSTED_SOURCE) != 0;
+
+    wuffs_base__image_config imageconfig;
+    if (!decode_config(context, src, &imageconfig)) {
+        return 0;
+    }
+
+    const hardware_buffer_api* api = get_hardware_buffer_api();
+    if (api == NULL) {
+        LOG("%s\n", "AHardwareBuffer is not supported");
+        return fail(ERROR_UNSUPPORTED);
+    }
+
+    AHardwareBuffer* hardware_buffer = AHardwareBuffer_fromHardwareBuffer(env, out_buffer);
+    if (hardware_buffer == NULL) {
+        return fail(ERROR_OUTPUT);
+    }
+
+    AHardwareBuffer_Desc desc = {0};
+    api->describe(hardware_buffer, &desc);
+
+    const uint32_t img_width = wuffs_base__pixel_config__width(&imageconfig.pixcfg);
+    const uint32_t img_height = wuffs_base__pixel_config__height(&imageconfig.pixcfg);
+
+    if (desc.format != HARDWARE_BUFFER_FORMAT_R8 || img_width > desc.width || img_height > desc.height) {
+        LOG("Buffer is %d x %d (format %d), needed %d x %d\n", desc.width, desc.height, desc.format, img_width, img_height);
+        return fail(ERROR_OUTPUT);
+    }
+
+    if (!select_indexed_format(&imageconfig, out_palette)) {
+        return 0;
+    }
+
+    const int64_t lock_started = stage_begin(STAGE_LOCK);
+
+    void* buffer_pixels;
+    const int lock_status = api->lock(hardware_buffer, AHARDWAREBUFFER_USAGE_CPU_WRITE_RARELY, -1, NULL, &buffer_pixels);
+
+    stage_end(STAGE_LOCK, lock_started);
+
+    if (lock_status != 0) {
+        LOG("%s\n", "Failed to lock hardware buffer");
+        return fail(ERROR_LOCK);
+    }
+
+    // stride of hardware buffer is in pixels (which are bytes here)
+    image_plane plane = {
+        .ptr = buffer_pixels,
+        .stride = desc.stride,
+        .width = img_width,
+        .height = img_height
+    };
+
+    jint result = decode_indexed_plane(env, context, src, &imageconfig, &plane, out_palette, options);
+
+    const int64_t unlock_started = stage_begin(STAGE_LOCK);
+
+    api->unlock(hardware_buffer, NULL);
+
+    stage_end(STAGE_LOCK, unlock_started);
+
+    return result;
+}
+
+// Decode any kind of PNG image into ARGB_8888 Bitmap (RGBA premultiplied in memory). Wuffs only reads
+// the header here: its pixel swizzler is trimmed down to 8-bit formats, so rows are converted by
+// kernels as they are inflated
+static jint decode_rgba(
+        JNIEnv* env,
+        decoder_context* context,
+        image_source* src,
+        jobject out_image,
+        jint options
+) {
+    src->ignore_checksum = (options & OPTION_TRUSTED_SOURCE) != 0;
+
+    wuffs_base__image_config imageconfig;
+    if (!decode_config(context, src, &imageconfig)) {
+        return 0;
+    }
+
+    if (src->container_rows != NULL) {
+        LOG("%s\n", "Precompiled images have no RGBA form");
+        return fail(ERROR_UNSUPPORTED);
+    }
+
+    const uint32_t img_width = wuffs_base__pixel_config__width(&imageconfig.pixcfg);
+    const uint32_t img_height = wuffs_base__pixel_config__height(&imageconfig.pixcfg);
+
+    AndroidBitmapInfo bitmap_info;
+    if (!check_bitmap(env, out_image, &imageconfig.pixcfg, &bitmap_info)) {
+        return 0;
+    }
+
+    if (bitmap_info.format != ANDROID_BITMAP_FORMAT_RGBA_8888) {
+        LOG("%s\n", "Bitmap must be ARGB_8888");
+        return fail(ERROR_OUTPUT);
+    }
+
+    if (src->fd >= 0 || src->channel != NULL) {
+        LOG("%s\n", "RGBA images are only decoded from memory");
+        return fail(ERROR_UNSUPPORTED);
+    }
+
+    void* bitmap_pixels;
+    if (!lock_bitmap(env, out_image, &bitmap_pixels)) {
+        return 0;
+    }
+
+    image_plane plane = {
+        .ptr = bitmap_pixels,
+        .stride = bitmap_info.stride,
+        .width = img_width,
+        .height = img_height
+    };
+
+    const int decoded = decode_rgba_rows(context, src, &plane);
+
+    unlock_bitmap(env, out_image);
+
+    if (!decoded) {
+        return 0;
+    }
+
+    jint result = 1 | FLAG_RGBA | src->bit_depth << FLAG_DEPTH_SHIFT;
+
+    if (wuffs_base__image_config__first_frame_is_opaque(&imageconfig)) {
+        result |= FLAG_OPAQUE;
+    }
+
+    return result;
+}
+
+static uint32_t read_u32be(const uint8_t* p) {
+    return ((uint32_t) p[0] << 24) | ((uint32_t) p[1] << 16) | ((uint32_t) p[2] << 8) | p[3];
+}
+
+// Part of image to decode. Only every step-th pixel in both directions ends up in the output,
+// which is ceil(width / step) x ceil(height / step) pixels. Zero width selects the whole image
+typedef struct sample_rect {
+    uint32_t x;
+    uint32_t y;
+    uint32_t width;
+    uint32_t height;
+    uint32_t step;
+} sample_rect;
+
+#define PNG_COLOR_GREY 0
+#define PNG_COLOR_RGB 2
+#define PNG_COLOR_INDEXED 3
+#define PNG_COLOR_GREY_ALPHA 4
+#define PNG_COLOR_RGBA 6
+
+// Conversion of sampled rows to output: either to 8-bit samples or, if pack_bits is non-zero, to packed indices.
+// The kernels are selected once per image, so that per-pixel loops don't branch on bit depth and sampling step
+typedef struct row_writer {
+    row_sampler sample;
+    // NULL unless rows are packed
+    row_packer pack;
+    uint32_t x;
+    uint32_t step;
+    // rows, that are already packed the same way, are copied as-is
+    size_t copy_offset;
+    size_t copy_size;
+} row_writer;
+
+static void init_row_writer(row_writer* writer, const sample_rect* rect, uint32_t count,
+                            uint8_t bit_depth, int scale, uint8_t pack_bits) {
+    writer->sample = select_sampler(bit_depth, pack_bits == 0 && scale, rect->step);
+    writer->pack = pack_bits != 0 ? select_packer(pack_bits) : NULL;
+    writer->x = rect->x;
+    writer->step = rect->step;
+    writer->copy_offset = 0;
+    writer->copy_size = 0;
+
+    if (pack_bits != 0 && pack_bits == bit_depth && rect->step == 1 && rect->x % (8 / bit_depth) == 0) {
+        writer->copy_offset = rect->x / (8 / bit_depth);
+        writer->copy_size = ((size_t) count * bit_depth + 7) / 8;
+    }
+}
+
+// scratch must have room for count bytes, if rows are packed
+static void write_row(const row_writer* writer, uint8_t* dest, const uint8_t* row, uint32_t count, uint8_t* scratch) {
+    if (writer->copy_size != 0) {
+        memcpy(dest, row + writer->copy_offset, writer->copy_size);
+    } else if (writer->pack == NULL) {
+        writer->sample(dest, row, count, writer->x, writer->step);
+    } else {
+        writer->sample(scratch, row, count, writer->x, writer->step);
+        writer->pack(dest, scratch, count);
+    }
+}
+
+// PNG, that is inflated one row at time instead of having Wuffs buffer the entire image in work buffer
+typedef struct png_rows {
+    uint32_t width;
+    uint32_t height;
+    uint8_t bit_depth;
+    uint8_t color_type;
+    uint8_t interlaced;
+    // same layout as palette, produced by Wuffs
+    uint32_t palette[256];
+    // the transparent color of greyscale and RGB images (tRNS chunk), samples in PNG order
+    uint8_t has_key;
+    uint16_t key[3];
+    // the next chunk with image data and the end of PNG
+    const uint8_t* pos;
+    const uint8_t* end;
+    // check CRC-32 of every critical chunk read and Adler-32 of image data, if it is inflated up to the end
+    // (unless OPTION_TRUSTED_SOURCE is set, same as Wuffs does)
+    uint8_t verify;
+} png_rows;
+
+// CRC-32 at the end of chunk must match it's type and data
+static int check_chunk_crc(const uint8_t* chunk, uint32_t length) {
+    wuffs_crc32__ieee_hasher hasher;
+    wuffs_crc32__ieee_hasher__initialize(&hasher, sizeof hasher, WUFFS_VERSION, 0);
+
+    const uint32_t crc = wuffs_crc32__ieee_hasher__update_u32(&hasher, wuffs_base__make_slice_u8((uint8_t*) chunk + 4, length + 4));
+
+    return crc == read_u32be(chunk + 8 + length);
+}
+
+// Parse chunks up to the first IDAT. Returns 0 if the image should be left to Wuffs,
+// either because it's malformed or because it is not the kind we can handle here
+static int parse_rows_header(const uint8_t* data, size_t size, int verify, png_rows* png) {
+    static const uint8_t signature[8] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n' };
+
+    if (size < sizeof signature || memcmp(data, signature, sizeof signature) != 0) {
+        return 0;
+    }
+
+    int have_header = 0;
+    uint32_t palette_size = 0;
+
+    size_t pos = sizeof signature;
+
+    while (size - pos >= 12) {
+        const uint32_t length = read_u32be(data + pos);
+        const uint8_t* type = data + pos + 4;
+        const uint8_t* chunk = data + pos + 8;
+
+        // like Wuffs, ignore CRC-32 of ancillary chunks (lowercase first letter of type)
+        if (length > size - pos - 12 || (verify && (type[0] & 0x20) == 0 && !check_chunk_crc(data + pos, length))) {
+            return 0;
+        }
+
+        if (memcmp(type, "IHDR", 4) == 0) {
+            if (have_header || pos != sizeof signature || length != 13) {
+                return 0;
+            }
+
+            png->width = read_u32be(chunk);
+            png->height = read_u32be(chunk + 4);
+            png->bit_depth = chunk[8];
+            png->color_type = chunk[9];
+
+            // same limits as Wuffs
+            if (png->width == 0 || png->height == 0 || png->width > 0xFFFFFF || png->height > 0xFFFFFF) {
+                return 0;
+            }
+
+            // compression, filter and interlace methods
+            if (chunk[10] != 0 || chunk[11] != 0 || chunk[12] > 1) {
+                return 0;
+            }
+
+            png->interlaced = chunk[12];
+            png->has_key = 0;
+
+            const uint8_t depth = png->bit_depth;
+            switch (png->color_type) {
+                case PNG_COLOR_GREY:
+                    if (depth != 1 && depth != 2 && depth != 4 && depth != 8 && depth != 16) {
+                        return 0;
+                    }
+                    break;
+                case PNG_COLOR_INDEXED:
+                    if (depth != 1 && depth != 2 && depth != 4 && depth != 8) {
+                        return 0;
+                    }
+                    break;
+                case PNG_COLOR_RGB:
+                case PNG_COLOR_GREY_ALPHA:
+                case PNG_COLOR_RGBA:
+                    if (depth != 8 && depth != 16) {
+                        return 0;
+                    }
+                    break;
+                default:
+                    return 0;
+            }
+
+            // entries, missing from PLTE, are opaque black
+            for (int i = 0; i < 256; i++) {
+                png->palette[i] = 0xFF000000;
+            }
+
+            have_header = 1;
+        } else if (!have_header) {
+            return 0;
+        } else if (memcmp(type, "PLTE", 4) == 0 && (png->color_type == PNG_COLOR_RGB || png->color_type == PNG_COLOR_RGBA)) {
+            // suggested palette of truecolor image is not used for decoding
+        } else if (memcmp(type, "PLTE", 4) == 0) {
+            if (png->color_type != PNG_COLOR_INDEXED || palette_size != 0
+                    || length == 0 || length % 3 != 0 || length / 3 > (1u << png->bit_depth)) {
+                return 0;
+            }
+
+            palette_size = length / 3;
+
+            for (uint32_t i = 0; i < palette_size; i++) {
+                const uint8_t* rgb = chunk + i * 3;
+                png->palette[i] = 0xFF000000 | ((uint32_t) rgb[0] << 16) | ((uint32_t) rgb[1] << 8) | rgb[2];
+            }
+        } else if (memcmp(type, "tRNS", 4) == 0 && (png->color_type == PNG_COLOR_GREY || png->color_type == PNG_COLOR_RGB)) {
+            const uint32_t samples = png->color_type == PNG_COLOR_GREY ? 1 : 3;
+            if (png->has_key || length != samples * 2) {
+                return 0;
+            }
+
+            for (uint32_t i = 0; i < samples; i++) {
+                png->key[i] = (uint16_t) ((chunk[i * 2] << 8) | chunk[i * 2 + 1]);
+            }
+
+            png->has_key = 1;
+        } else if (memcmp(type, "tRNS", 4) == 0) {
+            if (png->color_type != PNG_COLOR_INDEXED || palette_size == 0 || length > palette_size) {
+                return 0;
+            }
+
+            for (uint32_t i = 0; i < length; i++) {
+                png->palette[i] = (png->palette[i] & 0x00FFFFFF) | ((uint32_t) chunk[i] << 24);
+            }
+        } else if (memcmp(type, "IDAT", 4) == 0) {
+            if (png->color_type == PNG_COLOR_INDEXED && palette_size == 0) {
+                return 0;
+            }
+
+            png->pos = data + pos;
+            png->end = data + size;
+            png->verify = (uint8_t) verify;
+            return 1;
+        } else if (memcmp(type, "IEND", 4) == 0) {
+            return 0;
+        }
+
+        pos += 12 + (size_t) length;
+    }
+
+    return 0;
+}
+
+// images, that are decoded as 8-bit samples (see select_indexed_format): non-interlaced indexed and greyscale,
+// unless it has transparent color
+static int is_indexed_rows(const png_rows* png) {
+    return !png->interlaced
+            && (png->color_type == PNG_COLOR_INDEXED || (png->color_type == PNG_COLOR_GREY && !png->has_key));
+}
+
+// bytes in unfiltered row of given number of pixels, not counting the filter type
+static size_t row_bytes(const png_rows* png, uint32_t width) {
+    static const uint8_t channels[7] = { 1, 0, 3, 1, 2, 0, 4 };
+
+    return ((size_t) width * channels[png->color_type] * png->bit_depth + 7) / 8;
+}
+
+// point src at the contents of the next IDAT chunk. Returns 0 when image data is over
+static int next_idat(png_rows* png, wuffs_base__io_buffer* src) {
+    while (png->end - png->pos >= 12) {
+        const uint32_t length = read_u32be(png->pos);
+        const uint8_t* chunk = png->pos + 8;
+
+        if (memcmp(png->pos + 4, "IDAT", 4) != 0 || length > (size_t) (png->end - png->pos) - 12) {
+            return 0;
+        }
+
+        if (png->verify && !check_chunk_crc(png->pos, length)) {
+            LOG("%s\n", "Bad CRC of image data");
+            return 0;
+        }
+
+        png->pos += 12 + (size_t) length;
+
+        if (length != 0) {
+            *src = wuffs_base__ptr_u8__reader((uint8_t*) chunk, length, false);
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+// Image data, inflated one row at time
+typedef struct row_stream {
+    wuffs_zlib__decoder* inflater;
+    png_rows* png;
+    wuffs_base__io_buffer src;
+    wuffs_base__slice_u8 workbuf;
+    // position of the next row in inflated data, the inflater resolves back-references into earlier rows by it
+    uint64_t pos;
+    // set once the zlib stream has ended (including it's checksum, unless that is ignored)
+    int finished;
+} row_stream;
+
+static int open_row_stream(decoder_context* context, png_rows* png, wuffs_base__slice_u8 workbuf, row_stream* stream) {
+    wuffs_zlib__decoder* inflater = &context->inflater;
+    wuffs_base__status i_status = wuffs_zlib__decoder__initialize(inflater, sizeof *inflater, WUFFS_VERSION,
+                                                                  WUFFS_INITIALIZE__LEAVE_INTERNAL_BUFFERS_UNINITIALIZED);
+    if (!wuffs_base__status__is_ok(&i_status)) {
+        LOG("%s\n", wuffs_base__status__message(&i_status));
+        return fail(ERROR_UNSUPPORTED);
+    }
+
+    // the checksum is past the last row, which is not reached, unless the entire image is decoded
+    if (!png->verify) {
+        wuffs_zlib__decoder__set_quirk_enabled(inflater, WUFFS_BASE__QUIRK_IGNORE_CHECKSUM, true);
+    }
+
+    if (!next_idat(png, &stream->src)) {
+        LOG("%s\n", "No image data");
+        return fail(ERROR_MALFORMED);
+    }
+
+    stream->inflater = inflater;
+    stream->png = png;
+    stream->workbuf = workbuf;
+    stream->pos = 0;
+    stream->finished = 0;
+
+    return 1;
+}
+
+// inflate the next size bytes (filter type and contents of row)
+static int read_row(row_stream* stream, uint8_t* row, size_t size) {
+    wuffs_base__io_buffer dst = wuffs_base__ptr_u8__writer(row, size);
+    dst.meta.pos = stream->pos;
+
+    while (dst.meta.wi < dst.data.len) {
+        wuffs_base__status status = wuffs_zlib__decoder__transform_io(stream->inflater, &dst, &stream->src, stream->workbuf);
+
+        stream->finished = wuffs_base__status__is_ok(&status);
+
+        if (status.repr == wuffs_base__suspension__short_read) {
+            if (!next_idat(stream->png, &stream->src)) {
+                LOG("%s\n", "Image data is truncated");
+                return fail(ERROR_MALFORMED);
+            }
+        } else if (wuffs_base__status__is_error(&status)) {
+            LOG("Decoding failed: %s\n", wuffs_base__status__message(&status));
+            return fail(status_error(NULL, &status));
+        } else if (status.repr != wuffs_base__suspension__short_write && dst.meta.wi < dst.data.len) {
+            LOG("%s\n", "Image data is truncated");
+            return fail(ERROR_MALFORMED);
+        }
+    }
+
+    stream->pos += size;
+
+    return 1;
+}
+
+// after the last row the stream holds no data, only the end of last block and checksum
+static int finish_row_stream(row_stream* stream) {
+    uint8_t none;
+
+    wuffs_base__io_buffer dst = wuffs_base__ptr_u8__writer(&none, 0);
+    dst.meta.pos = stream->pos;
+
+    while (!stream->finished) {
+        wuffs_base__status status = wuffs_zlib__decoder__transform_io(stream->inflater, &dst, &stream->src, stream->workbuf);
+
+        if (wuffs_base__status__is_ok(&status)) {
+            stream->finished = 1;
+        } else if (status.repr == wuffs_base__suspension__short_read) {
+            if (!next_idat(stream->png, &stream->src)) {
+                LOG("%s\n", "Image data is truncated");
+                return fail(ERROR_MALFORMED);
+            }
+        } else if (wuffs_base__status__is_error(&status)) {
+            LOG("Decoding failed: %s\n", wuffs_base__status__message(&status));
+            return fail(status_error(NULL, &status));
+        } else {
+            LOG("%s\n", "Too much image data");
+            return fail(ERROR_MALFORMED);
+        }
+    }
+
+    return 1;
+}
+
+// Inflate and unfilter image rows one by one, sampling the needed ones into plane.
+// Only two rows are kept in memory and inflating stops after the last needed row
+static int inflate_rows_reserved(decoder_context* context, png_rows* png, const sample_rect* rect, const image_plane* plane,
+                                 uint32_t count, uint8_t pack_bits, uint8_t* rows) {
+    const size_t row_size = row_bytes(png, png->width);
+    const size_t pixel_size = png->bit_depth == 16 ? 2 : 1;
+
+    uint8_t* current = rows;
+    uint8_t* previous = rows + row_size + 1;
+    uint8_t* scratch = rows + 2 * (row_size + 1);
+
+    memset(previous, 0, row_size + 1);
+
+    uint8_t work[WUFFS_ZLIB__DECODER_WORKBUF_LEN_MAX_INCL_WORST_CASE];
+
+    row_stream stream;
+    if (!open_row_stream(context, png, wuffs_base__make_slice_u8(work, sizeof work), &stream)) {
+        return 0;
+    }
+
+    row_writer writer;
+    init_row_writer(&writer, rect, count, png->bit_depth, png->color_type == PNG_COLOR_GREY, pack_bits);
+
+    const row_unfilter unfilter = select_unfilter(pixel_size);
+    const uint32_t last_row = rect->y + (plane->height - 1) * rect->step;
+
+    uint32_t out_row = 0;
+
+    for (uint32_t y = 0; y <= last_row; y++) {
+        if (!read_row(&stream, current, row_size + 1)) {
+            return 0;
+        }
+
+        if (!unfilter(current + 1, previous + 1, row_size, pixel_size, current[0])) {
+            LOG("Invalid filter type: %d\n", current[0]);
+            return fail(ERROR_MALFORMED);
+        }
+
+        if (y >= rect->y && (y - rect->y) % rect->step == 0) {
+            write_row(&writer, plane->ptr + out_row * plane->stride, current + 1, count, scratch);
+            out_row++;
+        }
+
+        uint8_t* swap = previous;
+        previous = current;
+        current = swap;
+    }
+
+    if (png->verify && last_row == png->height - 1) {
+        return finish_row_stream(&stream);
+    }
+
+    return 1;
+}
+
+// the time of inflating is counted separately from allocating the row buffer
+static int inflate_rows(decoder_context* context, png_rows* png, const sample_rect* rect, const image_plane* plane,
+                        uint32_t count, uint8_t pack_bits) {
+    const size_t row_size = row_bytes(png, png->width);
+
+    // current and previous row, both prefixed with filter type, followed by scratch row for packing
+    uint8_t* rows = reserve(&context->staging, 2 * (row_size + 1) + count);
+    if (!rows) {
+        LOG("%s\n", "Could not allocate row buffer");
+        return fail(ERROR_ALLOCATION);
+    }
+
+    const int64_t started = stage_begin(STAGE_INFLATE);
+
+    const int decoded = inflate_rows_reserved(context, png, rect, plane, count, pack_bits, rows);
+
+    stage_end(STAGE_INFLATE, started);
+
+    return decoded;
+}
+
+// Precompiled image, converted from indexed or greyscale PNG at build time (by convertIndexedImages task
+// of the library). It holds the palette and 8-bit pixels, that decoding the PNG would produce, so they can be
+// copied (or sampled) straight from mapped file. All numbers are big-endian:
+//
+//    0  signature                     20  bit depth of original image
+//    8  width                         21  PNG color type (0 or 3)
+//   12  height                        22  zero up to palette
+//   16  stride (bytes per row)        64  palette, 256 entries in Wuffs layout (non-premultiplied BGRA)
+//                                   1088  rows, each stride bytes long
+#define CONTAINER_PALETTE_OFFSET 64
+#define CONTAINER_ROWS_OFFSET (CONTAINER_PALETTE_OFFSET + 256 * 4)
+
+// returns 0, if the source is not a container (including any malformed one)
+static int read_container(image_source* src, wuffs_base__image_config* imageconfig) {
+    static const uint8_t signature[8] = { 0x89, 'I', 'D', 'X', '\r', '\n', 0x1A, '\n' };
+
+    const uint8_t* data = src->buffer.data.ptr + src->buffer.meta.ri;
+    const size_t size = src->buffer.meta.wi - src->buffer.meta.ri;
+
+    if (src->fd >= 0 || src->channel != NULL || size < CONTAINER_ROWS_OFFSET
+            || memcmp(data, signature, sizeof signature) != 0) {
+        return 0;
+    }
+
+    const uint32_t width = read_u32be(data + 8);
+    const uint32_t height = read_u32be(data + 12);
+    const uint32_t stride = read_u32be(data + 16);
+    const uint8_t bit_depth = data[20];
+    const uint8_t color_type = data[21];
+
+    if (width == 0 || height == 0 || stride < width
+            || (color_type != PNG_COLOR_GREY && color_type != PNG_COLOR_INDEXED)
+            || (uint64_t) stride * (height - 1) + width > size - CONTAINER_ROWS_OFFSET) {
+        LOG("Invalid container: %u x %u, stride %u, color type %d\n", width, height, stride, color_type);
+        return 0;
+    }
+
+    const uint32_t format = color_type == PNG_COLOR_GREY
+            ? WUFFS_BASE__PIXEL_FORMAT__Y
+            : WUFFS_BASE__PIXEL_FORMAT__INDEXED__BGRA_NONPREMUL;
+
+    wuffs_base__image_config__set(imageconfig, format, WUFFS_BASE__PIXEL_SUBSAMPLING__NONE, width, height, 0, false);
+
+    src->bit_depth = bit_depth;
+    src->container_palette = data + CONTAINER_PALETTE_OFFSET;
+    src->container_rows = data + CONTAINER_ROWS_OFFSET;
+    src->container_stride = stride;
+
+    return 1;
+}
+
+static void copy_container(const image_source* src, const image_plane* plane, uint32_t* palette) {
+    const int64_t started = stage_begin(STAGE_INFLATE);
+
+    memcpy(palette, src->container_palette, 256 * sizeof(uint32_t));
+
+    if (plane->stride == src->container_stride) {
+        memcpy(plane->ptr, src->container_rows, plane->stride * (plane->height - 1) + plane->width);
+    } else {
+        for (uint32_t y = 0; y < plane->height; y++) {
+            memcpy(plane->ptr + y * plane->stride, src->container_rows + y * src->container_stride, plane->width);
+        }
+    }
+
+    stage_end(STAGE_INFLATE, started);
+
+    count_decoded_bytes((uint64_t) plane->width * plane->height);
+}
+
+// Decode in-memory non-interlaced greyscale image with 1, 2, 4 or 16 bits per pixel straight into plane,
+// converting rows to 8 bits as they are inflated. Returns -1 (before touching the decoder) if the image
+// should be left to Wuffs
+static int decode_grey_rows(decoder_context* context, const image_source* src, const image_plane* plane) {
+    png_rows png;
+
+    if (src->fd >= 0 || src->channel != NULL
+            || !parse_rows_header(src->buffer.data.ptr, src->buffer.meta.wi, !src->ignore_checksum, &png)
+            || !is_indexed_rows(&png) || png.color_type != PNG_COLOR_GREY
+            || png.width != plane->width || png.height != plane->height) {
+        return -1;
+    }
+
+    const sample_rect rect = { .x = 0, .y = 0, .width = png.width, .height = png.height, .step = 1 };
+
+    const int decoded = inflate_rows(context, &png, &rect, plane, png.width, 0);
+
+    if (decoded) {
+        count_decoded_bytes((uint64_t) plane->width * plane->height);
+    }
+
+    return decoded;
+}
+
+// Adam7 passes: first column and row, then log2 of distances between columns and rows
+static const uint8_t adam7_passes[7][4] = {
+    { 0, 0, 3, 3 }, { 4, 0, 3, 3 }, { 0, 4, 2, 3 }, { 2, 0, 2, 2 }, { 0, 2, 1, 2 }, { 1, 0, 1, 1 }, { 0, 1, 0, 1 },
+};
+
+static const uint8_t single_pass[1][4] = { { 0, 0, 0, 0 } };
+
+// Conversion of unfiltered rows to premultiplied RGBA: truecolor pixels are converted one by one,
+// indexed and greyscale samples (up to 8 bits) are unpacked and mapped through table of colors
+typedef struct rgba_writer {
+    rgba_converter convert;
+    // NULL for 8-bit samples, which are mapped as-is
+    row_sampler sample;
+    const uint16_t* key;
+    uint32_t colors[256];
+} rgba_writer;
+
+static void init_rgba_writer(rgba_writer* writer, const png_rows* png) {
+    writer->convert = NULL;
+    writer->sample = png->bit_depth < 8 ? select_sampler(png->bit_depth, 0, 1) : NULL;
+    writer->key = png->key;
+
+    if (png->color_type == PNG_COLOR_INDEXED) {
+        copyPalette((uint8_t*) writer->colors, (const uint8_t*) png->palette, sizeof writer->colors);
+    } else if (png->color_type == PNG_COLOR_GREY && png->bit_depth <= 8) {
+        const uint32_t levels = 1u << png->bit_depth;
+        const uint32_t multiplier = 255 / (levels - 1);
+
+        // the transparent color is compared before scaling
+        for (uint32_t i = 0; i < levels; i++) {
+            const uint32_t level = i * multiplier;
+            writer->colors[i] = png->has_key && i == (png->key[0] & (levels - 1))
+                    ? 0 : 0xFF000000 | level << 16 | level << 8 | level;
+        }
+    } else {
+        writer->convert = select_rgba_converter(png->color_type, png->bit_depth, png->has_key);
+    }
+}
+
+// scratch must have room for count bytes
+static void write_rgba_row(const rgba_writer* writer, uint8_t* dest, const uint8_t* row, uint32_t count, uint8_t* scratch) {
+    if (writer->convert != NULL) {
+        writer->convert(dest, row, count, writer->key);
+    } else if (writer->sample != NULL) {
+        writer->sample(scratch, row, count, 0, 1);
+        map_pixels(dest, scratch, writer->colors, count);
+    } else {
+        map_pixels(dest, row, writer->colors, count);
+    }
+}
+
+static int decode_rgba_reserved(decoder_context* context, png_rows* png, const image_plane* plane, uint8_t* rows) {
+    const size_t row_size = row_bytes(png, png->width);
+    const size_t pixel_size = row_bytes(png, 1);
+
+    uint8_t* current = rows;
+    uint8_t* previous = rows + row_size + 1;
+    uint8_t* scratch = rows + 2 * (row_size + 1);
+    uint8_t* pass_pixels = scratch + png->width;
+
+    uint8_t work[WUFFS_ZLIB__DECODER_WORKBUF_LEN_MAX_INCL_WORST_CASE];
+
+    row_stream stream;
+    if (!open_row_stream(context, png, wuffs_base__make_slice_u8(work, sizeof work), &stream)) {
+        return 0;
+    }
+
+    rgba_writer writer;
+    init_rgba_writer(&writer, png);
+
+    const row_unfilter unfilter = select_unfilter(pixel_size);
+
+    const uint8_t (*passes)[4] = png->interlaced ? adam7_passes : single_pass;
+    const uint32_t pass_count = png->interlaced ? 7 : 1;
+
+    for (uint32_t pass = 0; pass < pass_count; pass++) {
+        const uint32_t x0 = passes[pass][0], y0 = passes[pass][1];
+        const uint32_t dx = passes[pass][2], dy = passes[pass][3];
+
+        // passes without pixels have no rows (not even filter types) in image data
+        if (png->width <= x0 || png->height <= y0) {
+            continue;
+        }
+
+        const uint32_t pass_width = (png->width - x0 + (1u << dx) - 1) >> dx;
+        const size_t pass_size = row_bytes(png, pass_width);
+
+        memset(previous, 0, pass_size + 1);
+
+        for (uint32_t y = y0; y < png->height; y += 1u << dy) {
+            if (!read_row(&stream, current, pass_size + 1)) {
+                return 0;
+            }
+
+            if (!unfilter(current + 1, previous + 1, pass_size, pixel_size, current[0])) {
+                LOG("Invalid filter type: %d\n", current[0]);
+                return fail(ERROR_MALFORMED);
+            }
+
+            uint8_t* dest = plane->ptr + (size_t) y * plane->stride;
+
+            if (dx == 0) {
+                write_rgba_row(&writer, dest, current + 1, pass_width, scratch);
+            } else {
+                write_rgba_row(&writer, pass_pixels, current + 1, pass_width, scratch);
+
+                for (uint32_t i = 0; i < pass_width; i++) {
+                    memcpy(dest + (size_t) (x0 + (i << dx)) * 4, pass_pixels + (size_t) i * 4, 4);
+                }
+            }
+
+            uint8_t* swap = previous;
+            previous = current;
+            current = swap;
+        }
+    }
+
+    return !png->verify || finish_row_stream(&stream);
+}
+
+// Decode in-memory PNG of any kind (including interlaced images) into premultiplied RGBA plane row by row
+static int decode_rgba_rows(decoder_context* context, const image_source* src, const image_plane* plane) {
+    png_rows png;
+
+    if (!parse_rows_header(src->buffer.data.ptr, src->buffer.meta.wi, !src->ignore_checksum, &png)
+            || png.width != plane->width || png.height != plane->height) {
+        LOG("%s\n", "Malformed chunks before image data");
+        return fail(ERROR_MALFORMED);
+    }
+
+    if (png.color_type != PNG_COLOR_INDEXED && png.color_type != PNG_COLOR_GREY
+            && select_rgba_converter(png.color_type, png.bit_depth, png.has_key) == NULL) {
+        return fail(ERROR_UNSUPPORTED);
+    }
+
+    const size_t row_size = row_bytes(&png, png.width);
+
+    // current and previous row, both prefixed with filter type, then unpacked samples and,
+    // for interlaced images, converted pixels of pass (before they are spread over the row)
+    uint8_t* rows = reserve(&context->staging, 2 * (row_size + 1) + png.width + (png.interlaced ? png.width * 4 : 0));
+    if (!rows) {
+        LOG("%s\n", "Could not allocate row buffer");
+        return fail(ERROR_ALLOCATION);
+    }
+
+    const int64_t started = stage_begin(STAGE_INFLATE);
+
+    const int decoded = decode_rgba_reserved(context, &png, plane, rows);
+
+    stage_end(STAGE_INFLATE, started);
+
+    if (decoded) {
+        count_decoded_bytes((uint64_t) plane->width * 4 * plane->height);
+    }
+
+    return decoded;
+}
+
+// Images, split into bands by the encoder (see splitIndexedImages task of the library), can be decoded
+// by several threads. Each band after the first starts in a new IDAT chunk, right after full flush of deflate
+// stream (so it never refers to data of earlier bands), and it's first row is not filtered against
+// the row above it. The private "idSP" chunk (before IDAT) lists these bands, 8 bytes per band:
+// the first row and the offset of it's IDAT chunk from the first IDAT chunk, both big-endian
+#define MAX_BANDS 64
+#define MAX_DECODE_THREADS 8
+
+typedef struct image_band {
+    uint32_t first_row;
+    uint32_t end_row;
+    // IDAT chunks of band, it's inflater must not need any data past them
+    const uint8_t* pos;
+    const uint8_t* end;
+    // Adler-32 of inflated rows, and (for the last band) the one, that follows deflate stream
+    uint32_t adler;
+    uint32_t trailer;
+} image_band;
+
+typedef struct parallel_decode {
+    png_rows png;
+    const image_plane* plane;
+    image_band bands[MAX_BANDS];
+    uint32_t band_count;
+    // shared by all threads
+    uint32_t next_band;
+    uint32_t failures;
+} parallel_decode;
+
+static int find_bands(const uint8_t* data, parallel_decode* job) {
+    const png_rows* png = &job->png;
+    const uint8_t* first_idat = png->pos;
+
+    // chunks before IDAT have already been checked by parse_rows_header
+    const uint8_t* pos = data + 8;
+    while (pos < first_idat && memcmp(pos + 4, "idSP", 4) != 0) {
+        pos += 12 + (size_t) read_u32be(pos);
+    }
+
+    if (pos == first_idat) {
+        return 0;
+    }
+
+    const uint32_t length = read_u32be(pos);
+    const uint8_t* entries = pos + 8;
+
+    if (length == 0 || length % 8 != 0 || length / 8 >= MAX_BANDS) {
+        return 0;
+    }
+
+    job->band_count = length / 8 + 1;
+    job->bands[0] = (image_band) { .first_row = 0, .pos = first_idat };
+
+    for (uint32_t i = 1; i < job->band_count; i++) {
+        const uint32_t first_row = read_u32be(entries + (i - 1) * 8);
+        const uint32_t offset = read_u32be(entries + (i - 1) * 8 + 4);
+
+        image_band* previous = &job->bands[i - 1];
+
+        // the previous band must end with at least one chunk of it's own, finished by full flush
+        if (first_row <= previous->first_row || first_row >= png->height
+                || offset < (size_t) (previous->pos - first_idat) + 16 || offset > (size_t) (png->end - first_idat) - 12) {
+            return 0;
+        }
+
+        const uint8_t* band_pos = first_idat + offset;
+        static const uint8_t flush_marker[4] = { 0x00, 0x00, 0xFF, 0xFF };
+
+        if (memcmp(band_pos + 4, "IDAT", 4) != 0 || memcmp(band_pos - 8, flush_marker, 4) != 0) {
+            return 0;
+        }
+
+        previous->end_row = first_row;
+        previous->end = band_pos;
+
+        job->bands[i] = (image_band) { .first_row = first_row, .pos = band_pos };
+    }
+
+    job->bands[job->band_count - 1].end_row = png->height;
+    job->bands[job->band_count - 1].end = png->end;
+
+    return 1;
+}
+
+// Adler-32 of concatenation of two blocks of data, the second one len2 bytes long (same as adler32_combine of zlib)
+static uint32_t combine_adler(uint32_t adler1, uint32_t adler2, uint64_t len2) {
+    const uint32_t base = 65521;
+    const uint32_t rem = (uint32_t) (len2 % base);
+
+    uint32_t sum1 = adler1 & 0xFFFF;
+    uint32_t sum2 = (rem * sum1) % base;
+
+    sum1 += (adler2 & 0xFFFF) + base - 1;
+    sum2 += (adler1 >> 16) + (adler2 >> 16) + base - rem;
+
+    if (sum1 >= base) sum1 -= base;
+    if (sum1 >= base) sum1 -= base;
+    if (sum2 >= base * 2) sum2 -= base * 2;
+    if (sum2 >= base) sum2 -= base;
+
+    return sum1 | (sum2 << 16);
+}
+
+// big-endian Adler-32 right after the end of deflate stream
+static int read_trailer(png_rows* chunks, wuffs_base__io_buffer* src, uint32_t* trailer) {
+    uint32_t value = 0;
+
+    for (int i = 0; i < 4; i++) {
+        while (src->meta.ri == src->meta.wi) {
+            if (!next_idat(chunks, src)) {
+                return 0;
+            }
+        }
+        value = (value << 8) | src->data.ptr[src->meta.ri++];
+    }
+
+    *trailer = value;
+    return 1;
+}
+
+static int inflate_band(wuffs_deflate__decoder* inflater, uint8_t* rows, const parallel_decode* job, image_band* band) {
+    const png_rows* png = &job->png;
+    const size_t row_size = ((size_t) png->width * png->bit_depth + 7) / 8;
+    const size_t pixel_size = png->bit_depth == 16 ? 2 : 1;
+
+    uint8_t* current = rows;
+    uint8_t* previous = rows + row_size + 1;
+
+    memset(previous, 0, row_size + 1);
+
+    wuffs_base__status i_status = wuffs_deflate__decoder__initialize(inflater, sizeof *inflater, WUFFS_VERSION,
+                                                                     WUFFS_INITIALIZE__LEAVE_INTERNAL_BUFFERS_UNINITIALIZED);
+    if (!wuffs_base__status__is_ok(&i_status)) {
+        LOG("%s\n", wuffs_base__status__message(&i_status));
+        return 0;
+    }
+
+    uint8_t work[WUFFS_DEFLATE__DECODER_WORKBUF_LEN_MAX_INCL_WORST_CASE];
+    wuffs_base__slice_u8 workbuf = wuffs_base__make_slice_u8(work, sizeof work);
+
+    png_rows chunks = { .pos = band->pos, .end = band->end, .verify = png->verify };
+
+    wuffs_adler32__hasher hasher;
+    wuffs_adler32__hasher__initialize(&hasher, sizeof hasher, WUFFS_VERSION, 0);
+
+    wuffs_base__io_buffer src;
+    if (!next_idat(&chunks, &src)) {
+        return 0;
+    }
+
+    // bands are raw deflate data, only the first one is preceded by zlib header
+    if (band->first_row == 0) {
+        const uint8_t* header = src.data.ptr;
+        if (src.data.len < 2 || (header[0] & 0x0F) != 8 || (header[1] & 0x20) != 0 || ((header[0] << 8) | header[1]) % 31 != 0) {
+            return 0;
+        }
+        src.meta.ri = 2;
+    }
+
+    const sample_rect rect = { .x = 0, .y = 0, .width = png->width, .height = png->height, .step = 1 };
+
+    row_writer writer;
+    init_row_writer(&writer, &rect, png->width, png->bit_depth, png->color_type == PNG_COLOR_GREY, 0);
+
+    const row_unfilter unfilter = select_unfilter(pixel_size);
+
+    int finished = 0;
+
+    for (uint32_t y = band->first_row; y < band->end_row; y++) {
+        wuffs_base__io_buffer dst = wuffs_base__ptr_u8__writer(current, row_size + 1);
+
+        dst.meta.pos = (uint64_t) (y - band->first_row) * (row_size + 1);
+
+        while (dst.meta.wi < dst.data.len) {
+            wuffs_base__status status = wuffs_deflate__decoder__transform_io(inflater, &dst, &src, workbuf);
+
+            finished = wuffs_base__status__is_ok(&status);
+
+            if (status.repr == wuffs_base__suspension__short_read) {
+                // the inflater reads past the last row of band up to the next one, possibly emptying it's chunks
+                if (dst.meta.wi < dst.data.len && !next_idat(&chunks, &src)) {
+                    return 0;
+                }
+            } else if (wuffs_base__status__is_error(&status)) {
+                LOG("Decoding band failed: %s\n", wuffs_base__status__message(&status));
+                return 0;
+            } else if (status.repr != wuffs_base__suspension__short_write && dst.meta.wi < dst.data.len) {
+                return 0;
+            }
+        }
+
+        if (png->verify) {
+            band->adler = wuffs_adler32__hasher__update_u32(&hasher, wuffs_base__make_slice_u8(current, row_size + 1));
+        }
+
+        // the row above belongs to another band
+        const uint8_t filter = current[0];
+        if (y == band->first_row && y != 0 && filter != 0 && filter != 1) {
+            return 0;
+        }
+
+        if (!unfilter(current + 1, previous + 1, row_size, pixel_size, filter)) {
+            LOG("Invalid filter type: %d\n", filter);
+            return 0;
+        }
+
+        write_row(&writer, job->plane->ptr + y * job->plane->stride, current + 1, png->width, NULL);
+
+        uint8_t* swap = previous;
+        previous = current;
+        current = swap;
+    }
+
+    if (png->verify && band->end_row == png->height) {
+        wuffs_base__io_buffer dst = wuffs_base__ptr_u8__writer(current, 0);
+        dst.meta.pos = (uint64_t) (band->end_row - band->first_row) * (row_size + 1);
+
+        while (!finished) {
+            wuffs_base__status status = wuffs_deflate__decoder__transform_io(inflater, &dst, &src, workbuf);
+
+            finished = wuffs_base__status__is_ok(&status);
+
+            if (status.repr == wuffs_base__suspension__short_read) {
+                if (!next_idat(&chunks, &src)) {
+                    return 0;
+                }
+            } else if (!finished) {
+                return 0;
+            }
+        }
+
+        if (!read_trailer(&chunks, &src, &band->trailer)) {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+static void* decode_bands(void* arg) {
+    parallel_decode* job = arg;
+
+    const size_t row_size = ((size_t) job->png.width * job->png.bit_depth + 7) / 8;
+
+    wuffs_deflate__decoder* inflater = malloc(sizeof *inflater);
+    uint8_t* rows = malloc(2 * (row_size + 1));
+
+    if (inflater == NULL || rows == NULL) {
+        __atomic_add_fetch(&job->failures, 1, __ATOMIC_RELAXED);
+    }
+
+    while (__atomic_load_n(&job->failures, __ATOMIC_RELAXED) == 0) {
+        const uint32_t i = __atomic_fetch_add(&job->next_band, 1, __ATOMIC_RELAXED);
+        if (i >= job->band_count) {
+            break;
+        }
+
+        if (!inflate_band(inflater, rows, job, &job->bands[i])) {
+            __atomic_add_fetch(&job->failures, 1, __ATOMIC_RELAXED);
+        }
+    }
+
+    free(rows);
+    free(inflater);
+
+    return NULL;
+}
+
+// Decode in-memory image, split into bands, with several threads straight into plane. Returns -1 if the image
+// is not split or any band fails (and leaves it to be decoded serially). The palette is that of Wuffs
+static int decode_parallel(const image_source* src, const image_plane* plane, uint32_t* palette) {
+    parallel_decode job = { .plane = plane };
+
+    if (src->fd >= 0 || src->channel != NULL
+            || !parse_rows_header(src->buffer.data.ptr, src->buffer.meta.wi, !src->ignore_checksum, &job.png)
+            || !is_indexed_rows(&job.png) || job.png.width != plane->width || job.png.height != plane->height
+            || !find_bands(src->buffer.data.ptr, &job)) {
+        return -1;
+    }
+
+    uint32_t thread_count = job.band_count < MAX_DECODE_THREADS ? job.band_count : MAX_DECODE_THREADS;
+
+    const long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    if (cpus > 0 && cpus < thread_count) {
+        thread_count = (uint32_t) cpus;
+    }
+
+    if (thread_count < 2) {
+        return -1;
+    }
+
+    const int64_t started = stage_begin(STAGE_INFLATE);
+
+    pthread_t threads[MAX_DECODE_THREADS];
+    uint32_t started_threads = 0;
+
+    // the calling thread decodes bands as well
+    while (started_threads < thread_count - 1
+            && pthread_create(&threads[started_threads], NULL, decode_bands, &job) == 0) {
+        started_threads++;
+    }
+
+    decode_bands(&job);
+
+    for (uint32_t i = 0; i < started_threads; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    stage_end(STAGE_INFLATE, started);
+
+    if (job.failures != 0) {
+        LOG("%s\n", "Parallel decoding failed, decoding serially");
+        return -1;
+    }
+
+    if (job.png.verify) {
+        const size_t row_size = ((size_t) job.png.width * job.png.bit_depth + 7) / 8;
+
+        uint32_t adler = job.bands[0].adler;
+        for (uint32_t i = 1; i < job.band_count; i++) {
+            const image_band* band = &job.bands[i];
+            adler = combine_adler(adler, band->adler, (uint64_t) (band->end_row - band->first_row) * (row_size + 1));
+        }
+
+        // let the serial decoder report it
+        if (adler != job.bands[job.band_count - 1].trailer) {
+            LOG("%s\n", "Bad checksum of split image, decoding serially");
+            return -1;
+        }
+    }
+
+    memcpy(palette, job.png.palette, sizeof job.png.palette);
+
+    count_decoded_bytes((uint64_t) plane->width * plane->height);
+
+    return 1;
+}
+
+// Decode rect of in-memory image into locked 8-bit Bitmap, picking nearest pixels.
+// Sampling palette indices keeps them valid, unlike filtering. Rows above the rect still have
+// to be inflated (there is no way to skip them), but they are never kept in memory
+static jint decode_sampled(
+        JNIEnv* env,
+        decoder_context* context,
+        image_source* src,
+        jobject out_image,
+        jbyteArray out_palette,
+        jint options,
+        sample_rect rect
+) {
+    png_rows png;
+    uint32_t palette[256];
+    image_plane staged = {0};
+
+    src->ignore_checksum = (options & OPTION_TRUSTED_SOURCE) != 0;
+
+    const int64_t config_started = stage_begin(STAGE_CONFIG);
+
+    const int streamed = parse_rows_header(src->buffer.data.ptr, src->buffer.meta.wi, !src->ignore_checksum, &png)
+            && is_indexed_rows(&png);
+
+    stage_end(STAGE_CONFIG, config_started);
+
+    wuffs_base__image_config imageconfig;
+    uint32_t img_width;
+    uint32_t img_height;
+    int is_grey;
+
+    if (streamed) {
+        img_width = png.width;
+        img_height = png.height;
+        is_grey = png.color_type == PNG_COLOR_GREY;
+
+        src->bit_depth = png.bit_depth;
+
+        memcpy(palette, png.palette, sizeof palette);
+    } else {
+        if (!decode_config(context, src, &imageconfig) || !select_indexed_format(&imageconfig, out_palette)) {
+            return 0;
+        }
+
+        img_width = wuffs_base__pixel_config__width(&imageconfig.pixcfg);
+        img_height = wuffs_base__pixel_config__height(&imageconfig.pixcfg);
+        is_grey = wuffs_base__pixel_config__pixel_format(&imageconfig.pixcfg).repr == WUFFS_BASE__PIXEL_FORMAT__Y;
+    }
+
+    if (!is_grey && out_palette == NULL) {
+        return fail(ERROR_NOT_INDEXED);
+    }
+
+    if (rect.width == 0) {
+        rect.x = 0;
+        rect.y = 0;
+        rect.width = img_width;
+        rect.height = img_height;
+    }
+
+    if (rect.step == 0 || rect.height == 0 || rect.x >= img_width || rect.y >= img_height
+            || rect.width > img_width - rect.x || rect.height > img_height - rect.y) {
+        LOG("Invalid region %d,%d %d x %d (step %d) of %d x %d image\n",
+            rect.x, rect.y, rect.width, rect.height, rect.step, img_width, img_height);
+        return fail(ERROR_OUTPUT);
+    }
+
+    // indices of images with less than 8 bits per pixel can stay packed (unpacked by PaletteShader)
+    uint8_t pack_bits = 0;
+    if ((options & OPTION_PACK_INDICES) != 0 && !is_grey && src->bit_depth < 8) {
+        pack_bits = src->bit_depth;
+    }
+
+    const uint32_t out_width = (rect.width + rect.step - 1) / rect.step;
+    const uint32_t out_height = (rect.height + rect.step - 1) / rect.step;
+    const uint32_t out_bytes = pack_bits != 0 ? (uint32_t) (((uint64_t) out_width * pack_bits + 7) / 8) : out_width;
+
+    AndroidBitmapInfo bitmap_info = {0};
+    AndroidBitmap_getInfo(env, out_image, &bitmap_info);
+
+    if (out_bytes > bitmap_info.width || out_height > bitmap_info.height) {
+        LOG("Bitmap is %d x %d, needed %d x %d\n", bitmap_info.width, bitmap_info.height, out_bytes, out_height);
+        return fail(ERROR_OUTPUT);
+    }
+
+    // the staged image is followed by scratch row for packing
+    uint8_t* scratch = NULL;
+
+    if (!streamed && src->container_rows != NULL) {
+        // precompiled image is sampled right where it is mapped
+        staged = (image_plane) {
+            .ptr = (uint8_t*) src->container_rows,
+            .stride = src->container_stride,
+            .width = img_width,
+            .height = img_height
+        };
+
+        scratch = reserve(&context->staging, out_width);
+        if (scratch == NULL) {
+            LOG("%s\n", "Could not allocate staging buffer");
+            return fail(ERROR_ALLOCATION);
+        }
+
+        memcpy(palette, src->container_palette, sizeof palette);
+    } else if (!streamed) {
+        // let Wuffs decode the whole image, then sample it
+        staged = (image_plane) {
+            .ptr = reserve(&context->staging, (uint64_t) img_width * img_height + out_width),
+            .stride = img_width,
+            .width = img_width,
+            .height = img_height
+        };
+
+        if (staged.ptr == NULL) {
+            LOG("%s\n", "Could not allocate staging buffer");
+            return fail(ERROR_ALLOCATION);
+        }
+
+        if (!decode_pixels(context, src, &imageconfig.pixcfg, &staged, palette)) {
+            return 0;
+        }
+
+        scratch = staged.ptr + (size_t) img_width * img_height;
+    }
+
+    void* bitmap_pixels;
+    if (!lock_bitmap(env, out_image, &bitmap_pixels)) {
+        return 0;
+    }
+
+    image_plane plane = {
+        .ptr = bitmap_pixels,
+        .stride = bitmap_info.stride,
+        .width = out_bytes,
+        .height = out_height
+    };
+
+    int decoded = 1;
+
+    if (streamed) {
+        decoded = inflate_rows(context, &png, &rect, &plane, out_width, pack_bits);
+
+        if (decoded) {
+            count_decoded_bytes((uint64_t) out_bytes * out_height);
+        }
+    } else {
+        row_writer writer;
+        init_row_writer(&writer, &rect, out_width, 8, 0, pack_bits);
+
+        for (uint32_t i = 0; i < out_height; i++) {
+            const uint8_t* row = staged.ptr + (size_t) (rect.y + i * rect.step) * staged.stride;
+
+            write_row(&writer, plane.ptr + i * plane.stride, row, out_width, scratch);
+        }
+    }
+
+    jint result = 0;
+
+    if (decoded && pack_bits != 0) {
+        // packed indices can not be converted to mask
+        result = finish_indexed_plane(env, &plane, 0, palette, out_palette, options & ~(OPTION_DECODE_AS_MASK | OPTION_EXTRACT_MASK));
+        result |= pack_bits << FLAG_PACKED_SHIFT;
+    } else if (decoded) {
+        result = finish_indexed_plane(env, &plane, is_grey, palette, out_palette, options);
+    }
+
+    if (result != 0) {
+        result |= src->bit_depth << FLAG_DEPTH_SHIFT;
+    }
+
+    unlock_bitmap(env, out_image);
+
+    return result;
+}
+
+JNIEXPORT jlong JNICALL Java_org_bitmapdecoder_PngDecoder_createContext(
+        JNIEnv* env,
+        jclass type
+) {
+    decoder_context* context = calloc(1, sizeof(decoder_context));
+    if (context == NULL) {
+        return 0;
+    }
+
+    wuffs_base__status i_status = wuffs_png__decoder__initialize(&context->decoder, sizeof context->decoder,
+                                                                 WUFFS_VERSION, WUFFS_INITIALIZE__ALREADY_ZEROED);
+    if (!wuffs_base__status__is_ok(&i_status)) {
+        LOG("%s\n", wuffs_base__status__message(&i_status));
+        free(context);
+        return 0;
+    }
+
+    return (jlong) (intptr_t) context;
+}
+
+JNIEXPORT void JNICALL Java_org_bitmapdecoder_PngDecoder_trimContext(
+        JNIEnv* env,
+        jclass type,
+        jlong handle
+) {
+    decoder_context* context = (decoder_context*) (intptr_t) handle;
+
+    release_buffers(context);
+}
+
+JNIEXPORT void JNICALL Java_org_bitmapdecoder_PngDecoder_destroyContext(
+        JNIEnv* env,
+        jclass type,
+        jlong handle
+) {
+    decoder_context* context = (decoder_context*) (intptr_t) handle;
+
+    release_buffers(context);
+
+    free(context);
+
+#ifdef PNGS_PGO_GENERATE
+    // app processes are rarely shut down cleanly, so the profile is written here instead of at exit
+    __llvm_profile_write_file();
+#endif
+}
+
+JNIEXPORT jint JNICALL Java_org_bitmapdecoder_PngDecoder_decode(
+        JNIEnv* env,
+        jclass type,
+        jlong handle,
+        jobject buffer,
+        jobject out_image,
+        jbyteArray out_palette,
+        jint position,
+        jint limit,
+        jint options
+) {
+    image_source src;
+    if (!map_source(env, buffer, position, limit, &src)) {
+        return count_decode(0);
+    }
+
+    if (handle != 0) {
+        return count_decode(decode(env, (decoder_context*) (intptr_t) handle, &src, out_image, out_palette, options));
+    }
+
+    // one-off decoding, nothing to reuse
+    decoder_context context;
+    reset_buffers(&context);
+
+    jint result = count_decode(decode(env, &context, &src, out_image, out_palette, options));
+
+    release_buffers(&context);
+
+    return result;
+}
+
+// empty region (left == right) stands for the whole image
+JNIEXPORT jint JNICALL Java_org_bitmapdecoder_PngDecoder_decodeRegion(
+        JNIEnv* env,
+        jclass type,
+        jlong handle,
+        jobject buffer,
+        jobject out_image,
+        jbyteArray out_palette,
+        jint position,
+        jint limit,
+        jint options,
+        jint left,
+        jint top,
+        jint right,
+        jint bottom,
+        jint sample_size
+) {
+    image_source src;
+    if (!map_source(env, buffer, position, limit, &src)) {
+        return count_decode(0);
+    }
+
+    if (left < 0 || top < 0 || right < left || bottom < top || sample_size < 1) {
+        LOG("Invalid region %d,%d - %d,%d\n", left, top, right, bottom);
+        return count_decode(fail(ERROR_OUTPUT));
+    }
+
+    const sample_rect rect = {
+        .x = (uint32_t) left,
+        .y = (uint32_t) top,
+        .width = (uint32_t) (right - left),
+        .height = (uint32_t) (bottom - top),
+        .step = (uint32_t) sample_size
+    };
+
+    if (handle != 0) {
+        return count_decode(decode_sampled(env, (decoder_context*) (intptr_t) handle, &src, out_image, out_palette, options, rect));
+    }
+
+    decoder_context context;
+    reset_buffers(&context);
+
+    jint result = count_decode(decode_sampled(env, &context, &src, out_image, out_palette, options, rect));
+
+    release_buffers(&context);
+
+    return result;
+}
+
+JNIEXPORT jint JNICALL Java_org_bitmapdecoder_PngDecoder_decodeRgba(
+        JNIEnv* env,
+        jclass type,
+        jlong handle,
+        jobject buffer,
+        jobject out_image,
+        jint position,
+        jint limit,
+        jint options
+) {
+    image_source src;
+    if (!map_source(env, buffer, position, limit, &src)) {
+        return count_decode(0);
+    }
+
+    if (handle != 0) {
+        return count_decode(decode_rgba(env, (decoder_context*) (intptr_t) handle, &src, out_image, options));
+    }
+
+    decoder_context context;
+    reset_buffers(&context);
+
+    jint result = count_decode(decode_rgba(env, &context, &src, out_image, options));
+
+    release_buffers(&context);
+
+    return result;
+}
+
+JNIEXPORT jint JNICALL Java_org_bitmapdecoder_PngDecoder_decodeHardware(
+        JNIEnv* env,
+        jclass type,
+        jlong handle,
+        jobject buffer,
+        jobject out_buffer,
+        jbyteArray out_palette,
+        jint position,
+        jint limit,
+        jint options
+) {
+    image_source src;
+    if (!map_source(env, buffer, position, limit, &src)) {
+        return count_decode(0);
+    }
+
+    if (handle != 0) {
+        return count_decode(decode_hardware(env, (decoder_context*) (intptr_t) handle, &src, out_buffer, out_palette, options));
+    }
+
+    decoder_context context;
+    reset_buffers(&context);
+
+    jint result = count_decode(decode_hardware(env, &context, &src, out_buffer, out_palette, options));
+
+    release_buffers(&context);
+
+    return result;
+}
+
+static jint decode_stream(JNIEnv* env, jlong handle, image_source* src, jobject out_image, jbyteArray out_palette, jint options) {
+    decoder_context one_off;
+    decoder_context* context;
+
+    if (handle != 0) {
+        context = (decoder_context*) (intptr_t) handle;
+    } else {
+        reset_buffers(&one_off);
+        context = &one_off;
+    }
+
+    jint result = 0;
+
+    if (open_stream(context, src)) {
+        if (src->channel != NULL) {
+            // the ByteBuffer, passed to ReadableByteChannel#read
+            src->channel_buffer = (*env)->NewDirectByteBuffer(env, src->buffer.data.ptr, (jlong) src->buffer.data.len);
+        }
+
+        if (src->channel == NULL || src->channel_buffer != NULL) {
+            result = decode(env, context, src, out_image, out_palette, options);
+        } else {
+            fail(ERROR_ALLOCATION);
+        }
+    }
+
+    if (handle == 0) {
+        release_buffers(&one_off);
+    }
+
+    return count_decode(result);
+}
+
+JNIEXPORT jint JNICALL Java_org_bitmapdecoder_PngDecoder_decodeFd(
+        JNIEnv* env,
+        jclass type,
+        jlong handle,
+        jint fd,
+        jlong offset,
+        jlong length,
+        jobject out_image,
+        jbyteArray out_palette,
+        jint options
+) {
+    image_source src = {
+        .env = env,
+        .fd = fd,
+        .offset = (off_t) offset,
+        .end = length < 0 ? -1 : (off_t) (offset + length)
+    };
+
+    // let the kernel read ahead while we are busy inflating the previous chunk
+    posix_fadvise(fd, src.offset, length < 0 ? 0 : (off_t) length, POSIX_FADV_SEQUENTIAL);
+
+    return decode_stream(env, handle, &src, out_image, out_palette, options);
+}
+
+JNIEXPORT jint JNICALL Java_org_bitmapdecoder_PngDecoder_decodeChannel(
+        JNIEnv* env,
+        jclass type,
+        jlong handle,
+        jobject channel,
+        jobject out_image,
+        jbyteArray out_palette,
+        jint options
+) {
+    jmethodID read_method = (*env)->GetStaticMethodID(env, type, "readChannel",
+                                                      "(Ljava/nio/channels/ReadableByteChannel;Ljava/nio/ByteBuffer;II)I");
+    if (read_method == NULL) {
+        return count_decode(fail(ERROR_UNSUPPORTED));
+    }
+
+    image_source src = {
+        .env = env,
+        .fd = -1,
+        .end = -1,
+        .channel = channel,
+        .decoder_class = type,
+        .read_method = read_method
+    };
+
+    jint result = decode_stream(env, handle, &src, out_image, out_palette, options);
+
+    if (src.error != NULL) {
+        (*env)->Throw(env, src.error);
+    }
+
+    return result;
+}
+
+// Walk chunks before the image data to collect header information. Unlike Wuffs, this does not
+// require IHDR to be the first chunk (e.g. Apple's CgBI files), such images are reported as undecodable
+static int probe_image(decoder_context* context, const uint8_t* data, size_t size, jint* out) {
+    static const uint8_t signature[8] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n' };
+
+    if (size < sizeof signature || memcmp(data, signature, sizeof signature) != 0) {
+        return 0;
+    }
+
+    memset(out, 0, PROBE_FIELDS * sizeof(jint));
+
+    int have_header = 0;
+    int first_chunk = 1;
+    jint flags = 0;
+
+    size_t pos = sizeof signature;
+
+    while (size - pos >= 12) {
+        const uint32_t length = read_u32be(data + pos);
+        const uint8_t* type = data + pos + 4;
+        const uint8_t* chunk = data + pos + 8;
+
+        if (length > size - pos - 12) {
+            break;
+        }
+
+        if (memcmp(type, "IHDR", 4) == 0) {
+            if (length != 13) {
+                return 0;
+            }
+
+            const uint32_t width = read_u32be(chunk);
+            const uint32_t height = read_u32be(chunk + 4);
+
+            // PNG limits dimensions to 1 .. 2^31 - 1
+            if (width == 0 || height == 0 || width > INT32_MAX || height > INT32_MAX) {
+                return 0;
+            }
+
+            out[PROBE_WIDTH] = (jint) width;
+            out[PROBE_HEIGHT] = (jint) height;
+            out[PROBE_BIT_DEPTH] = chunk[8];
+            out[PROBE_COLOR_TYPE] = chunk[9];
+
+            if (chunk[12] != 0) {
+                flags |= PROBE_FLAG_INTERLACED;
+            }
+
+            if (first_chunk) {
+                flags |= PROBE_FLAG_DECODABLE;
+            }
+
+            have_header = 1;
+        } else if (memcmp(type, "PLTE", 4) == 0) {
+            out[PROBE_PALETTE_SIZE] = (jint) (length / 3);
+        } else if (memcmp(type, "tRNS", 4) == 0) {
+            flags |= PROBE_FLAG_TRANSPARENCY;
+        } else if (memcmp(type, "IDAT", 4) == 0 || memcmp(type, "IEND", 4) == 0) {
+            break;
+        }
+
+        first_chunk = 0;
+        pos += 12 + (size_t) length;
+    }
+
+    if (!have_header) {
+        return 0;
+    }
+
+    if ((flags & PROBE_FLAG_DECODABLE) != 0) {
+        image_source src = {
+            .buffer = wuffs_base__ptr_u8__reader((uint8_t*) data, size, true),
+            .fd = -1
+        };
+
+        wuffs_base__image_config imageconfig;
+        if (decode_config(context, &src, &imageconfig)) {
+            const uint64_t workbuf_len = wuffs_png__decoder__workbuf_len(&context->decoder).max_incl;
+
+            out[PROBE_WORKBUF_LENGTH] = workbuf_len > INT32_MAX ? INT32_MAX : (jint) workbuf_len;
+        } else {
+            flags &= ~PROBE_FLAG_DECODABLE;
+        }
+    }
+
+    out[PROBE_FLAGS] = flags;
+
+    return 1;
+}
+
+JNIEXPORT jint JNICALL Java_org_bitmapdecoder_PngDecoder_probe(
+        JNIEnv* env,
+        jclass type,
+        jlong handle,
+        jobjectArray buffers,
+        jintArray ranges,
+        jintArray out_info
+) {
+    decoder_context one_off;
+    decoder_context* context = (decoder_context*) (intptr_t) handle;
+    if (context == NULL) {
+        reset_buffers(&one_off);
+        context = &one_off;
+    }
+
+    const jsize count = (*env)->GetArrayLength(env, buffers);
+
+    jint probed = 0;
+
+    for (jsize i = 0; i < count; i++) {
+        jint range[2];
+        (*env)->GetIntArrayRegion(env, ranges, i * 2, 2, range);
+
+        jint info[PROBE_FIELDS] = {0};
+
+        jobject buffer = (*env)->GetObjectArrayElement(env, buffers, i);
+
+        const uint8_t* mapped = (*env)->GetDirectBufferAddress(env, buffer);
+        if (mapped != NULL && probe_image(context, mapped + range[0], range[1] - range[0], info)) {
+            probed++;
+        } else {
+            memset(info, 0, sizeof info);
+        }
+
+        (*env)->DeleteLocalRef(env, buffer);
+
+        (*env)->SetIntArrayRegion(env, out_info, i * PROBE_FIELDS, PROBE_FIELDS, info);
+    }
+
+    // images, that can't be decoded, are reported by flags
+    take_error();
+
+    if (context == &one_off) {
+        release_buffers(&one_off);
+    }
+
+    return probed;
+}
+
+JNIEXPORT void JNICALL Java_org_bitmapdecoder_PngDecoder_getStats(
+        JNIEnv* env,
+        jclass type,
+        jlongArray out_stats
+) {
+    jlong values[STATS_FIELDS];
+
+    for (int i = 0; i < STATS_FIELDS; i++) {
+        values[i] = (jlong) __atomic_load_n(&stats[i], __ATOMIC_RELAXED);
+    }
+
+    (*env)->SetLongArrayRegion(env, out_stats, 0, STATS_FIELDS, values);
+}
+
+// layout of animation information, returned by openAnimation()
+#define ANIMATION_WIDTH 0
+#define ANIMATION_HEIGHT 1
+#define ANIMATION_LOOPS 2
+#define ANIMATION_FRAMES 3
+#define ANIMATION_FIELDS 4
+
+// layout of frame information, returned by decodeFrame()
+#define FRAME_DURATION 0
+#define FRAME_DIRTY_LEFT 1
+#define FRAME_DIRTY_TOP 2
+#define FRAME_DIRTY_RIGHT 3
+#define FRAME_DIRTY_BOTTOM 4
+#define FRAME_INDEX 5
+#define FRAME_FIELDS 6
+
+// Decoder state of APNG playback, kept between frames. The canvas is the Bitmap itself,
+// only the pixels under current frame are saved (into staging buffer of context) for blending
+// and RESTORE_PREVIOUS disposal. The same image buffer must be passed to each call
+typedef struct animation_context {
+    decoder_context context;
+    wuffs_base__image_config imageconfig;
+    // reading position of the next frame within image buffer
+    uint64_t position;
+    // area of the previous frame and what to do with it before drawing the next one
+    wuffs_base__rect_ie_u32 previous;
+    wuffs_base__animation_disposal previous_disposal;
+    int has_previous;
+    // transparent palette index (or black), that fills disposed areas
+    uint8_t background;
+    uint8_t is_opaque;
+    uint8_t bit_depth;
+    uint8_t alpha[256];
+} animation_context;
+
+static void plane_fill_rect(const image_plane* plane, wuffs_base__rect_ie_u32 rect, uint8_t value) {
+    const uint32_t width = wuffs_base__rect_ie_u32__width(&rect);
+
+    for (uint32_t y = rect.min_incl_y; y < rect.max_excl_y; y++) {
+        memset(plane->ptr + y * plane->stride + rect.min_incl_x, value, width);
+    }
+}
+
+// area of canvas outside of rect
+static void plane_fill_outside(const image_plane* plane, wuffs_base__rect_ie_u32 rect, uint8_t value) {
+    plane_fill_rect(plane, wuffs_base__make_rect_ie_u32(0, 0, plane->width, rect.min_incl_y), value);
+    plane_fill_rect(plane, wuffs_base__make_rect_ie_u32(0, rect.max_excl_y, plane->width, plane->height), value);
+    plane_fill_rect(plane, wuffs_base__make_rect_ie_u32(0, rect.min_incl_y, rect.min_incl_x, rect.max_excl_y), value);
+    plane_fill_rect(plane, wuffs_base__make_rect_ie_u32(rect.max_excl_x, rect.min_incl_y, plane->width, rect.max_excl_y), value);
+}
+
+// copy rect of canvas to tightly packed buffer and back
+static void plane_save_rect(uint8_t* dest, const image_plane* plane, wuffs_base__rect_ie_u32 rect) {
+    const uint32_t width = wuffs_base__rect_ie_u32__width(&rect);
+
+    for (uint32_t y = rect.min_incl_y; y < rect.max_excl_y; y++, dest += width) {
+        memcpy(dest, plane->ptr + y * plane->stride + rect.min_incl_x, width);
+    }
+}
+
+static void plane_restore_rect(const image_plane* plane, wuffs_base__rect_ie_u32 rect, const uint8_t* src) {
+    const uint32_t width = wuffs_base__rect_ie_u32__width(&rect);
+
+    for (uint32_t y = rect.min_incl_y; y < rect.max_excl_y; y++, src += width) {
+        memcpy(plane->ptr + y * plane->stride + rect.min_incl_x, src, width);
+    }
+}
+
+// APNG_BLEND_OP_OVER for indexed canvas: Wuffs can only overwrite indices, so the saved pixels are put back
+// wherever the frame is fully transparent. Partially transparent pixels replace the canvas instead of mixing with it
+static void plane_blend_rect(const image_plane* plane, wuffs_base__rect_ie_u32 rect, const uint8_t* under,
+                             const uint8_t *restrict alpha) {
+    const uint32_t width = wuffs_base__rect_ie_u32__width(&rect);
+
+    for (uint32_t y = rect.min_incl_y; y < rect.max_excl_y; y++, under += width) {
+        uint8_t* row = plane->ptr + y * plane->stride + rect.min_incl_x;
+
+        for (uint32_t x = 0; x < width; x++) {
+            if (alpha[row[x]] == 0) {
+                row[x] = under[x];
+            }
+        }
+    }
+}
+
+static int read_frame_config(animation_context* anim, image_source* src, wuffs_base__frame_config* frameconfig) {
+    wuffs_png__decoder* decoder = &anim->context.decoder;
+
+    src->buffer.meta.ri = anim->position;
+
+    wuffs_base__status status = wuffs_png__decoder__decode_frame_config(decoder, frameconfig, &src->buffer);
+
+    // after the last frame start over (the number of loops is up to the caller). Wuffs' restart_frame does
+    // not rewind expected sequence number of APNG chunks, so the decoder is rather initialized again
+    if (status.repr == wuffs_base__note__end_of_data && anim->has_previous) {
+        wuffs_base__image_config imageconfig;
+
+        src->buffer.meta.ri = 0;
+
+        if (!read_config(&anim->context, src, &imageconfig)) {
+            return 0;
+        }
+
+        status = wuffs_png__decoder__decode_frame_config(decoder, frameconfig, &src->buffer);
+    }
+
+    if (!wuffs_base__status__is_ok(&status)) {
+        LOG("%s\n", wuffs_base__status__message(&status));
+        return fail(status_error(src, &status));
+    }
+
+    return 1;
+}
+
+// number of frames from acTL chunk, which precedes image data. Wuffs only counts frames as it decodes them
+static uint32_t count_frames(const uint8_t* data, size_t size) {
+    size_t pos = 8;
+
+    while (size - pos >= 12) {
+        const uint32_t length = read_u32be(data + pos);
+        const uint8_t* type = data + pos + 4;
+
+        if (length > size - pos - 12 || memcmp(type, "IDAT", 4) == 0) {
+            break;
+        }
+
+        if (memcmp(type, "acTL", 4) == 0 && length >= 8) {
+            return read_u32be(data + pos + 8);
+        }
+
+        pos += 12 + (size_t) length;
+    }
+
+    return 1;
+}
+
+// dispose the previous frame, decode the next one over it and report the changed area of canvas
+static jint decode_next_frame(
+        JNIEnv* env,
+        animation_context* anim,
+        image_source* src,
+        jobject out_image,
+        jbyteArray out_palette,
+        jint* frame_info
+) {
+    decoder_context* context = &anim->context;
+    const wuffs_base__pixel_config* pixcfg = &anim->imageconfig.pixcfg;
+
+    wuffs_base__frame_config frameconfig;
+    if (!read_frame_config(anim, src, &frameconfig)) {
+        return 0;
+    }
+
+    AndroidBitmapInfo bitmap_info;
+    if (!check_bitmap(env, out_image, pixcfg, &bitmap_info)) {
+        return 0;
+    }
+
+    const int is_grey = wuffs_base__pixel_config__pixel_format(pixcfg).repr == WUFFS_BASE__PIXEL_FORMAT__Y;
+
+    const wuffs_base__rect_ie_u32 canvas = wuffs_base__pixel_config__bounds(pixcfg);
+    const wuffs_base__rect_ie_u32 bounds = wuffs_base__rect_ie_u32__intersect(
+            &canvas, wuffs_base__frame_config__bounds(&frameconfig));
+
+    const uint64_t index = wuffs_base__frame_config__index(&frameconfig);
+
+    wuffs_base__animation_disposal disposal = wuffs_base__frame_config__disposal(&frameconfig);
+
+    // the first frame of each loop is drawn over empty canvas: there is nothing to blend with or to restore
+    const int blend = index != 0 && !is_grey && !wuffs_base__frame_config__overwrite_instead_of_blend(&frameconfig);
+
+    if (index == 0 && disposal == WUFFS_BASE__ANIMATION_DISPOSAL__RESTORE_PREVIOUS) {
+        disposal = WUFFS_BASE__ANIMATION_DISPOSAL__RESTORE_BACKGROUND;
+    }
+
+    void* bitmap_pixels;
+    if (!lock_bitmap(env, out_image, &bitmap_pixels)) {
+        return 0;
+    }
+
+    const image_plane plane = {
+        .ptr = bitmap_pixels,
+        .stride = bitmap_info.stride,
+        .width = wuffs_base__pixel_config__width(pixcfg),
+        .height = wuffs_base__pixel_config__height(pixcfg)
+    };
+
+    wuffs_base__rect_ie_u32 dirty = index == 0 ? canvas : bounds;
+
+    if (index != 0 && anim->has_previous) {
+        if (anim->previous_disposal == WUFFS_BASE__ANIMATION_DISPOSAL__RESTORE_BACKGROUND) {
+            plane_fill_rect(&plane, anim->previous, anim->background);
+        } else if (anim->previous_disposal == WUFFS_BASE__ANIMATION_DISPOSAL__RESTORE_PREVIOUS) {
+            plane_restore_rect(&plane, anim->previous, context->staging.ptr);
+        }
+
+        if (anim->previous_disposal != WUFFS_BASE__ANIMATION_DISPOSAL__NONE) {
+            dirty = wuffs_base__rect_ie_u32__unite(&dirty, anim->previous);
+        }
+    }
+
+    uint8_t* under = NULL;
+    if (blend || disposal == WUFFS_BASE__ANIMATION_DISPOSAL__RESTORE_PREVIOUS) {
+        const uint64_t area = (uint64_t) wuffs_base__rect_ie_u32__width(&bounds) * wuffs_base__rect_ie_u32__height(&bounds);
+
+        under = reserve(&context->staging, area);
+        if (!under && area != 0) {
+            LOG("%s\n", "Could not allocate staging buffer");
+            unlock_bitmap(env, out_image);
+            return fail(ERROR_ALLOCATION);
+        }
+
+        plane_save_rect(under, &plane, bounds);
+    }
+
+    uint32_t palette[256];
+
+    if (!decode_pixels(context, src, pixcfg, &plane, palette)) {
+        unlock_bitmap(env, out_image);
+        return 0;
+    }
+
+    if (index == 0) {
+        anim->background = 0;
+
+        if (is_grey) {
+            anim->is_opaque = 1;
+        } else {
+            anim->is_opaque = publish_palette(env, out_palette, palette);
+
+            make_alpha_table(anim->alpha, palette);
+
+            for (int i = 0; i < 256; i++) {
+                if (anim->alpha[i] == 0) {
+                    anim->background = (uint8_t) i;
+                    break;
+                }
+            }
+        }
+
+        plane_fill_outside(&plane, bounds, anim->background);
+    } else if (blend) {
+        plane_blend_rect(&plane, bounds, under, anim->alpha);
+    }
+
+    unlock_bitmap(env, out_image);
+
+    anim->position = src->buffer.meta.ri;
+    anim->previous = bounds;
+    anim->previous_disposal = disposal;
+    anim->has_previous = 1;
+
+    frame_info[FRAME_DURATION] = (jint) (wuffs_base__frame_config__duration(&frameconfig) / WUFFS_BASE__FLICKS_PER_MILLISECOND);
+    frame_info[FRAME_DIRTY_LEFT] = (jint) dirty.min_incl_x;
+    frame_info[FRAME_DIRTY_TOP] = (jint) dirty.min_incl_y;
+    frame_info[FRAME_DIRTY_RIGHT] = (jint) dirty.max_excl_x;
+    frame_info[FRAME_DIRTY_BOTTOM] = (jint) dirty.max_excl_y;
+    frame_info[FRAME_INDEX] = index > INT32_MAX ? INT32_MAX : (jint) index;
+
+    jint result = 1;
+    if (is_grey) {
+        result |= FLAG_GREY;
+    }
+    if (anim->is_opaque) {
+        result |= FLAG_OPAQUE;
+    }
+
+    return result | anim->bit_depth << FLAG_DEPTH_SHIFT;
+}
+
+JNIEXPORT jlong JNICALL Java_org_bitmapdecoder_PngDecoder_openAnimation(
+        JNIEnv* env,
+        jclass type,
+        jobject buffer,
+        jbyteArray out_palette,
+        jint position,
+        jint limit,
+        jintArray out_info
+) {
+    // opening is not counted as decoding, the reason of failure is not reported
+    image_source src;
+    if (!map_source(env, buffer, position, limit, &src)) {
+        take_error();
+        return 0;
+    }
+
+    animation_context* anim = calloc(1, sizeof(animation_context));
+    if (anim == NULL) {
+        return 0;
+    }
+
+    reset_buffers(&anim->context);
+
+    // precompiled images hold a single frame
+    if (!decode_config(&anim->context, &src, &anim->imageconfig) || src.container_rows != NULL ||
+        !select_indexed_format(&anim->imageconfig, out_palette)) {
+        take_error();
+        free(anim);
+        return 0;
+    }
+
+    anim->position = src.buffer.meta.ri;
+    anim->bit_depth = src.bit_depth;
+
+    const jint info[ANIMATION_FIELDS] = {
+        [ANIMATION_WIDTH] = (jint) wuffs_base__pixel_config__width(&anim->imageconfig.pixcfg),
+        [ANIMATION_HEIGHT] = (jint) wuffs_base__pixel_config__height(&anim->imageconfig.pixcfg),
+        [ANIMATION_LOOPS] = (jint) wuffs_png__decoder__num_animation_loops(&anim->context.decoder),
+        [ANIMATION_FRAMES] = (jint) count_frames(src.buffer.data.ptr, src.buffer.data.len)
+    };
+
+    (*env)->SetIntArrayRegion(env, out_info, 0, ANIMATION_FIELDS, info);
+
+    return (jlong) (intptr_t) anim;
+}
+
+JNIEXPORT jint JNICALL Java_org_bitmapdecoder_PngDecoder_decodeFrame(
+        JNIEnv* env,
+        jclass type,
+        jlong handle,
+        jobject buffer,
+        jobject out_image,
+        jbyteArray out_palette,
+        jint position,
+        jint limit,
+        jintArray out_info
+) {
+    image_source src;
+    if (!map_source(env, buffer, position, limit, &src)) {
+        return count_decode(0);
+    }
+
+    jint info[FRAME_FIELDS] = {0};
+
+    const jint result = count_decode(decode_next_frame(env, (animation_context*) (intptr_t) handle, &src,
+                                                       out_image, out_palette, info));
+
+    (*env)->SetIntArrayRegion(env, out_info, 0, FRAME_FIELDS, info);
+
+    return result;
+}
+
+JNIEXPORT void JNICALL Java_org_bitmapdecoder_PngDecoder_closeAnimation(
+        JNIEnv* env,
+        jclass type,
+        jlong handle
+) {
+    animation_context* anim = (animation_context*) (intptr_t) handle;
+
+    release_buffers(&anim->context);
+
+    free(anim);
+}
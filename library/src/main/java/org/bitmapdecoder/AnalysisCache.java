@@ -0,0 +1,200 @@
+/*
+ * Copyright 2023 Alexander Rvachev.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+package org.bitmapdecoder;
+
+import android.util.Log;
+import androidx.annotation.NonNull;
+import androidx.annotation.Nullable;
+
+import java.io.*;
+import java.nio.ByteBuffer;
+import java.nio.ByteOrder;
+import java.util.LinkedHashMap;
+import java.util.Map;
+
+/**
+ * Process-wide record of mask analysis: whether all visible colors of indexed image have the same hue, so that
+ * it can be decoded as mask (see {@link PngDecoder#OPTION_DECODE_AS_MASK}). Finding that out takes a pass over all
+ * pixels of image, while the answer only depends on the image itself, so it is remembered by image content.
+ *
+ * <p>The content key is made of CRCs of all PNG chunks, that are already stored in the file, so computing it
+ * only costs a walk over chunk headers. The record can be kept between launches in a file, see
+ * {@link PngSupport#setAnalysisCacheFile}.
+ */
+final class AnalysisCache {
+    static final int UNKNOWN  = 0;
+    static final int MASK     = 1;
+    static final int NOT_MASK = 2;
+
+    private static final String TAG = "pngs";
+
+    private static final int MAX_ENTRIES = 4096;
+
+    // "PNGA" followed by format version
+    private static final int FILE_MAGIC = 0x504e4741;
+    private static final int FILE_VERSION = 1;
+
+    private static final LinkedHashMap<Long, Boolean> entries = new LinkedHashMap<Long, Boolean>(64, 0.75f, true) {
+        @Override
+        protected boolean removeEldestEntry(Map.Entry<Long, Boolean> eldest) {
+            return size() > MAX_ENTRIES;
+        }
+    };
+
+    private static File file;
+    private static boolean modified;
+
+    private AnalysisCache() {}
+
+    /**
+     * @return content key of PNG image in buffer (between position and limit) or 0 if it is malformed
+     */
+    static long contentKey(@NonNull ByteBuffer image) {
+        final int start = image.position();
+        final int end = image.limit();
+
+        // precompiled images (see PngDecoder#getImageInfo) have no chunks to make the key from
+        if (end - start < 8 || readInt(image, start) != 0x89504E47) {
+            return 0;
+        }
+
+        long key = end - start;
+
+        int pos = start + 8;
+
+        while (end - pos >= 12) {
+            final long length = readInt(image, pos) & 0xFFFFFFFFL;
+            if (length > end - pos - 12) {
+                return 0;
+            }
+
+            final int type = readInt(image, pos + 4);
+            final long crc = readInt(image, pos + 8 + (int) length) & 0xFFFFFFFFL;
+
+            key = (key ^ crc) * 0x9E3779B97F4A7C15L;
+
+            pos += 12 + (int) length;
+
+            if (type == 0x49454E44) { // IEND
+                return key == 0 ? 1 : key;
+            }
+        }
+
+        return 0;
+    }
+
+    private static int readInt(ByteBuffer buffer, int index) {
+        final int value = buffer.getInt(index);
+        return buffer.order() == ByteOrder.BIG_ENDIAN ? value : Integer.reverseBytes(value);
+    }
+
+    static synchronized int get(long key) {
+        final Boolean mask = entries.get(key);
+        if (mask == null) {
+            return UNKNOWN;
+        }
+        return mask ? MASK : NOT_MASK;
+    }
+
+    static synchronized void put(long key, boolean mask) {
+        final Boolean old = entries.put(key, mask);
+        if (old == null || old != mask) {
+            modified = true;
+        }
+    }
+
+    /**
+     * Start keeping the record in file (or stop, if null), reading the entries, already stored in it.
+     */
+    static void setFile(@Nullable File newFile) {
+        final LinkedHashMap<Long, Boolean> loaded = new LinkedHashMap<>();
+
+        if (newFile != null && newFile.exists()) {
+            try (DataInputStream in = new DataInputStream(new BufferedInputStream(new FileInputStream(newFile)))) {
+                if (in.readInt() == FILE_MAGIC && in.readInt() == FILE_VERSION) {
+                    final int count = Math.min(in.readInt(), MAX_ENTRIES);
+                    for (int i = 0; i < count; ++i) {
+                        final long key = in.readLong();
+                        loaded.put(key, in.readBoolean());
+                    }
+                }
+            } catch (IOException ioe) {
+                Log.w(TAG, "Failed to read " + newFile, ioe);
+            }
+        }
+
+        synchronized (AnalysisCache.class) {
+            file = newFile;
+
+            for (Map.Entry<Long, Boolean> entry : loaded.entrySet()) {
+                if (!entries.containsKey(entry.getKey())) {
+                    entries.put(entry.getKey(), entry.getValue());
+                }
+            }
+        }
+    }
+
+    /**
+     * Write the record to file, if there is one and new entries have been added since it was read.
+     */
+    static void save() {
+        final File target;
+        final long[] keys;
+        final boolean[] values;
+
+        synchronized (AnalysisCache.class) {
+            if (file == null || !modified) {
+                return;
+            }
+
+            target = file;
+            keys = new long[entries.size()];
+            values = new boolean[entries.size()];
+
+            int i = 0;
+            for (Map.Entry<Long, Boolean> entry : entries.entrySet()) {
+                keys[i] = entry.getKey();
+                values[i] = entry.getValue();
+                ++i;
+            }
+
+            modified = false;
+        }
+
+        // replace the file at once, so that a concurrent reader never sees half-written one
+        final File temp = new File(target.getPath() + ".tmp");
+
+        try (DataOutputStream out = new DataOutputStream(new BufferedOutputStream(new FileOutputStream(temp)))) {
+            out.writeInt(FILE_MAGIC);
+            out.writeInt(FILE_VERSION);
+            out.writeInt(keys.length);
+            for (int i = 0; i < keys.length; ++i) {
+                out.writeLong(keys[i]);
+                out.writeBoolean(values[i]);
+            }
+        } catch (IOException ioe) {
+            Log.w(TAG, "Failed to write " + target, ioe);
+            synchronized (AnalysisCache.class) {
+                modified = true;
+            }
+            return;
+        }
+
+        if (!temp.renameTo(target)) {
+            Log.w(TAG, "Failed to replace " + target);
+        }
+    }
+}
@@ -0,0 +1,157 @@
+/*
+ * Copyright 2023 Alexander Rvachev.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+package org.bitmapdecoder;
+
+import android.graphics.Bitmap;
+import android.util.SparseArray;
+import androidx.annotation.NonNull;
+
+import java.util.ArrayDeque;
+import java.util.Iterator;
+
+/**
+ * A pool of reusable software Bitmaps, used for temporary ALPHA_8 images and ARGB_8888 palette strips, that are
+ * discarded once uploaded to GPU. Reusing them reduces GC pressure when lots of images are decoded, e.g. in lists.
+ *
+ * <p>Bitmaps are grouped by Config and power-of-two size buckets and handed out via {@link Bitmap#reconfigure}.
+ * Only Bitmaps, that are at most 1/8 bigger than requested, are reused: some of them end up retained by drawables
+ * and their caches, which should not hold on to memory, that is never drawn.
+ * The pool is opt-in, see {@link PngSupport#setBitmapPool}.
+ *
+ * <p>This class is thread-safe.
+ */
+public final class BitmapPool {
+    // reused Bitmap may exceed requested size by (size >> SLACK_SHIFT) bytes
+    private static final int SLACK_SHIFT = 3;
+
+    private final SparseArray<ArrayDeque<Bitmap>> buckets = new SparseArray<>();
+
+    private final int maxBytes;
+
+    private int currentBytes;
+
+    /**
+     * @param maxBytes maximum total size of Bitmaps, retained by the pool
+     */
+    public BitmapPool(int maxBytes) {
+        this.maxBytes = maxBytes;
+    }
+
+    /**
+     * @return a mutable Bitmap with requested dimensions and Config, either reused or newly created.
+     * Contents of reused Bitmaps are undefined.
+     */
+    public @NonNull Bitmap acquire(int width, int height, @NonNull Bitmap.Config config) {
+        final int byteCount = width * height * bytesPerPixel(config);
+        final int maxByteCount = byteCount + (byteCount >> SLACK_SHIFT);
+
+        synchronized (this) {
+            // Bitmaps, that fit, are in the bucket of requested size or the next one
+            for (int n = floorLog2(byteCount); n <= floorLog2(maxByteCount); ++n) {
+                final ArrayDeque<Bitmap> bucket = buckets.get(bucketKey(config, n));
+                if (bucket == null) {
+                    continue;
+                }
+
+                final Iterator<Bitmap> iterator = bucket.iterator();
+                while (iterator.hasNext()) {
+                    final Bitmap bitmap = iterator.next();
+                    final int size = bitmap.getAllocationByteCount();
+                    if (size < byteCount || size > maxByteCount) {
+                        continue;
+                    }
+
+                    iterator.remove();
+                    currentBytes -= size;
+
+                    try {
+                        bitmap.reconfigure(width, height, config);
+                        return bitmap;
+                    } catch (IllegalArgumentException e) {
+                        // row alignment might not allow this
+                    }
+
+                    bitmap.recycle();
+                }
+            }
+        }
+
+        return Bitmap.createBitmap(width, height, config);
+    }
+
+    /**
+     * Return a Bitmap to the pool. The caller must not use the Bitmap afterwards. Bitmaps, that can not be reused,
+     * as well as Bitmaps in excess of pool capacity, are recycled.
+     */
+    public void release(@NonNull Bitmap bitmap) {
+        final Bitmap.Config config = bitmap.getConfig();
+
+        if (bitmap.isRecycled() || !bitmap.isMutable() || !isPooled(config)) {
+            bitmap.recycle();
+            return;
+        }
+
+        final int size = bitmap.getAllocationByteCount();
+
+        synchronized (this) {
+            if (currentBytes + size <= maxBytes) {
+                final int key = bucketKey(config, floorLog2(size));
+
+                ArrayDeque<Bitmap> bucket = buckets.get(key);
+                if (bucket == null) {
+                    bucket = new ArrayDeque<>();
+                    buckets.put(key, bucket);
+                }
+
+                bucket.push(bitmap);
+                currentBytes += size;
+                return;
+            }
+        }
+
+        bitmap.recycle();
+    }
+
+    /**
+     * Recycle all Bitmaps, retained by the pool.
+     */
+    public synchronized void clear() {
+        for (int i = 0; i < buckets.size(); ++i) {
+            for (Bitmap bitmap : buckets.valueAt(i)) {
+                bitmap.recycle();
+            }
+        }
+        buckets.clear();
+        currentBytes = 0;
+    }
+
+    private static boolean isPooled(Bitmap.Config config) {
+        return config == Bitmap.Config.ALPHA_8 || config == Bitmap.Config.ARGB_8888;
+    }
+
+    private static int bytesPerPixel(Bitmap.Config config) {
+        return config == Bitmap.Config.ALPHA_8 ? 1 : 4;
+    }
+
+    // Bitmaps with allocation size between 2^n (inclusive) and 2^(n+1) (exclusive) are kept in bucket n
+    private static int bucketKey(Bitmap.Config config, int bucket) {
+        return (config.ordinal() << 6) | bucket;
+    }
+
+    private static int floorLog2(int x) {
+        return 31 - Integer.numberOfLeadingZeros(Math.max(x, 1));
+    }
+}
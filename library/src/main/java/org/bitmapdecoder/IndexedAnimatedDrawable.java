@@ -0,0 +1,318 @@
+/*
+ * Copyright 2023 Alexander Rvachev.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+package org.bitmapdecoder;
+
+import android.graphics.*;
+import android.graphics.drawable.Animatable;
+import android.graphics.drawable.Drawable;
+import android.os.Build;
+import android.os.SystemClock;
+import androidx.annotation.NonNull;
+import androidx.annotation.Nullable;
+import org.bitmapdecoder.PngDecoder.Animation;
+
+import java.io.Closeable;
+import java.nio.ByteBuffer;
+import java.util.Objects;
+
+/**
+ * Plays animated PNG (APNG) images with indexed color or greyscale, keeping only one frame in memory at 1 byte
+ * per pixel (instead of ARGB frames, cached by {@link android.graphics.drawable.AnimationDrawable} and most APNG players).
+ *
+ * <p>Frames are composed in the same ALPHA_8 Bitmap by {@link Animation}, which only decodes the area of each frame
+ * and applies dispose and blend operations in place. Indexed images are drawn with {@link PaletteShader}
+ * (Android 13 and above), greyscale ones with a color filter.
+ *
+ * <p>The next frame is decoded on main thread, when it is due. The Bitmap is re-uploaded to GPU entirely
+ * after each frame, so this class is best suited for small animations, such as stickers and animated icons.
+ *
+ * <p>Native decoder state is released whenever the animation stops (including when the Drawable is hidden or
+ * detached from it's callback), the last shown frame stays in the Bitmap. Starting the animation again plays it
+ * from the first frame. Call {@link #close} once the Drawable is no longer needed to release it for good.
+ *
+ * <p>Like {@link ShaderDrawable}, this Drawable scales the image to fill it's bounds without changing aspect ratio
+ * and always performs nearest neighbor filtering.
+ */
+public class IndexedAnimatedDrawable extends Drawable implements Animatable, Runnable, Closeable {
+    // browsers show frames with delay of 10 ms or less for 100 ms, lest such animations hog the CPU
+    private static final int MIN_FRAME_DURATION = 11;
+    private static final int DEFAULT_FRAME_DURATION = 100;
+
+    private final ByteBuffer image;
+    private final Bitmap canvas;
+    private final Paint paint;
+
+    // closed, when the animation is not running
+    private Animation animation;
+
+    private boolean running;
+    private boolean closed;
+    // animation, stopped by hiding the Drawable, is started again when it is shown
+    private boolean resumeWhenVisible;
+    private int loopsPlayed;
+
+    private IndexedAnimatedDrawable(ByteBuffer image, Animation animation, Bitmap canvas, Paint paint) {
+        this.image = image;
+        this.animation = animation;
+        this.canvas = canvas;
+        this.paint = paint;
+    }
+
+    /**
+     * Decode the first frame of animation. Non-animated images are accepted as well, but are better served
+     * by {@link IndexedDrawable}.
+     *
+     * @param image buffer with image data, that must be kept unchanged for the lifetime of Drawable
+     *
+     * @return new Drawable or null if the image is not an indexed or greyscale PNG, is indexed, but
+     * {@link PaletteShader} is not supported, or can not be decoded
+     */
+    public static @Nullable IndexedAnimatedDrawable create(@NonNull ByteBuffer image) {
+        final Animation animation = Animation.open(image);
+        if (animation == null) {
+            return null;
+        }
+
+        final Bitmap canvas = Bitmap.createBitmap(animation.getWidth(), animation.getHeight(), Bitmap.Config.ALPHA_8);
+
+        if (!animation.decodeNextFrame(canvas)) {
+            animation.close();
+            return null;
+        }
+
+        final Paint paint = createPaint(animation, canvas);
+        if (paint == null) {
+            animation.close();
+            return null;
+        }
+
+        // single frame needs nothing more from decoder
+        if (animation.getFrameCount() < 2) {
+            animation.close();
+        }
+
+        return new IndexedAnimatedDrawable(image, animation, canvas, paint);
+    }
+
+    // the Bitmap is drawn as is (not copied to HARDWARE one) to see the changes of each frame
+    private static Paint createPaint(Animation animation, Bitmap canvas) {
+        final BitmapShader imageShader = new BitmapShader(canvas, Shader.TileMode.CLAMP, Shader.TileMode.CLAMP);
+
+        final Paint paint = new Paint();
+
+        if (animation.decodedAsGreyscale()) {
+            paint.setColorFilter(new ColorMatrixColorFilter(PngSupport.alphaToGrayFilter()));
+            paint.setShader(imageShader);
+            return paint;
+        }
+
+        if (Build.VERSION.SDK_INT < 33) {
+            return null;
+        }
+
+        final ByteBuffer palette = animation.getPalette();
+        final Bitmap paletteBitmap = Bitmap.createBitmap(palette.limit() / 4, 1, Bitmap.Config.ARGB_8888);
+        paletteBitmap.copyPixelsFromBuffer(palette);
+
+        final BitmapShader paletteShader = new BitmapShader(paletteBitmap, Shader.TileMode.CLAMP, Shader.TileMode.CLAMP);
+
+        imageShader.setFilterMode(BitmapShader.FILTER_MODE_NEAREST);
+        paletteShader.setFilterMode(BitmapShader.FILTER_MODE_NEAREST);
+
+        final PaletteShader shader = PaletteShader.obtain();
+        shader.setBitmap(paletteShader, imageShader);
+
+        paint.setShader(shader);
+        return paint;
+    }
+
+    @Override
+    public void draw(@NonNull Canvas canvas) {
+        final Rect bounds = getBounds();
+
+        final float scale = Math.max(bounds.width() / (float) getIntrinsicWidth(), bounds.height() / (float) getIntrinsicHeight());
+
+        canvas.save();
+        canvas.clipRect(bounds);
+        canvas.translate(bounds.left, bounds.top);
+        canvas.scale(scale, scale);
+        canvas.drawRect(0, 0, getIntrinsicWidth(), getIntrinsicHeight(), paint);
+        canvas.restore();
+    }
+
+    @Override
+    public void start() {
+        if (running || closed || animation.getFrameCount() < 2) {
+            return;
+        }
+
+        if (animation.isClosed() && !restartAnimation()) {
+            return;
+        }
+
+        running = true;
+        loopsPlayed = 0;
+        scheduleNextFrame();
+    }
+
+    @Override
+    public void stop() {
+        if (running) {
+            running = false;
+            unscheduleSelf(this);
+        }
+
+        animation.close();
+    }
+
+    /**
+     * Stop the animation and release native decoder state. The Drawable keeps showing the last frame,
+     * but can not be started again.
+     */
+    @Override
+    public void close() {
+        closed = true;
+        stop();
+    }
+
+    // decode the first frame again with new decoder
+    private boolean restartAnimation() {
+        final Animation restarted = Animation.open(image);
+        if (restarted == null) {
+            return false;
+        }
+
+        // the first frame is composed over transparent canvas, same as in a new Bitmap
+        canvas.eraseColor(Color.TRANSPARENT);
+
+        if (!restarted.decodeNextFrame(canvas)) {
+            restarted.close();
+            return false;
+        }
+
+        animation = restarted;
+        invalidateSelf();
+        return true;
+    }
+
+    @Override
+    public boolean isRunning() {
+        return running;
+    }
+
+    /**
+     * Show the next frame. Called by {@link #scheduleSelf}, when the current frame is over.
+     */
+    @Override
+    public void run() {
+        if (!running) {
+            return;
+        }
+
+        // nobody would draw the next frame
+        if (getCallback() == null) {
+            stop();
+            return;
+        }
+
+        final boolean lastFrame = animation.getFrameIndex() == animation.getFrameCount() - 1;
+
+        // the last frame of the last loop stays on screen
+        if (lastFrame && animation.getLoopCount() != 0 && ++loopsPlayed >= animation.getLoopCount()) {
+            stop();
+            return;
+        }
+
+        if (!animation.decodeNextFrame(canvas)) {
+            stop();
+            return;
+        }
+
+        invalidateSelf();
+        scheduleNextFrame();
+    }
+
+    private void scheduleNextFrame() {
+        int duration = animation.getFrameDuration();
+        if (duration < MIN_FRAME_DURATION) {
+            duration = DEFAULT_FRAME_DURATION;
+        }
+
+        scheduleSelf(this, SystemClock.uptimeMillis() + duration);
+    }
+
+    @Override
+    public boolean setVisible(boolean visible, boolean restart) {
+        final boolean changed = super.setVisible(visible, restart);
+
+        if (!visible) {
+            resumeWhenVisible |= running;
+            stop();
+        } else if (restart || resumeWhenVisible) {
+            resumeWhenVisible = false;
+            start();
+        }
+
+        return changed;
+    }
+
+    @Override
+    public int getIntrinsicWidth() {
+        return animation.getWidth();
+    }
+
+    @Override
+    public int getIntrinsicHeight() {
+        return animation.getHeight();
+    }
+
+    @Override
+    public int getOpacity() {
+        return animation.isOpaque() ? PixelFormat.OPAQUE : PixelFormat.TRANSLUCENT;
+    }
+
+    @Override
+    public int getAlpha() {
+        return paint.getAlpha();
+    }
+
+    @Override
+    public void setAlpha(int alpha) {
+        if (alpha == paint.getAlpha()) {
+            return;
+        }
+        paint.setAlpha(alpha);
+        invalidateSelf();
+    }
+
+    @Override
+    public ColorFilter getColorFilter() {
+        return paint.getColorFilter();
+    }
+
+    @Override
+    public void setColorFilter(@Nullable ColorFilter colorFilter) {
+        if (Objects.equals(colorFilter, paint.getColorFilter())) {
+            return;
+        }
+        // greyscale images need their own filter to be drawn at all
+        if (colorFilter == null && animation.decodedAsGreyscale()) {
+            colorFilter = new ColorMatrixColorFilter(PngSupport.alphaToGrayFilter());
+        }
+        paint.setColorFilter(colorFilter);
+        invalidateSelf();
+    }
+}
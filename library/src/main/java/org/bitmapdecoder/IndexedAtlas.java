@@ -0,0 +1,280 @@
+/*
+ * Copyright 2023 Alexander Rvachev.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+package org.bitmapdecoder;
+
+import android.annotation.TargetApi;
+import android.graphics.Bitmap;
+import android.graphics.BitmapShader;
+import android.graphics.Paint;
+import android.graphics.Rect;
+import android.graphics.Shader;
+import android.graphics.drawable.Drawable;
+import androidx.annotation.NonNull;
+import androidx.annotation.Nullable;
+import org.bitmapdecoder.PngDecoder.DecodingResult;
+import org.bitmapdecoder.PngDecoder.PngHeaderInfo;
+
+import java.nio.ByteBuffer;
+import java.util.ArrayList;
+import java.util.Arrays;
+import java.util.Comparator;
+import java.util.List;
+
+/**
+ * Many small indexed images (e.g. icons of a toolbar), packed into one ALPHA_8 texture, with their palettes
+ * stored in rows of one ARGB_8888 palette texture. Compared to separate images this means 2 texture uploads
+ * instead of 2 per image and lets the renderer keep the same textures bound between consecutive images.
+ *
+ * <p>Each image is drawn by its own {@link PaletteShader}, that reads only its part of shared textures.
+ * Images are placed on shelves (rows of images, sorted by height), without any padding between them.
+ *
+ * <p>Use {@link Builder} to create an atlas.
+ */
+@TargetApi(33)
+public final class IndexedAtlas {
+    // guaranteed texture size limit of OpenGL ES 3 and Vulkan devices
+    private static final int MAX_SIZE = 4096;
+
+    private static final int PALETTE_SIZE = 256;
+
+    private final BitmapShader storageTexture;
+    private final BitmapShader paletteTexture;
+    private final Rect[] regions;
+    private final boolean[] opaque;
+
+    private IndexedAtlas(BitmapShader storageTexture, BitmapShader paletteTexture, Rect[] regions, boolean[] opaque) {
+        this.storageTexture = storageTexture;
+        this.paletteTexture = paletteTexture;
+        this.regions = regions;
+        this.opaque = opaque;
+    }
+
+    /**
+     * @return number of images in atlas
+     */
+    public int size() {
+        return regions.length;
+    }
+
+    /**
+     * @return location of image within the storage texture
+     */
+    public @NonNull Rect getRegion(int index) {
+        return new Rect(regions[index]);
+    }
+
+    /**
+     * @return new Paint, that draws the image at {@code (0, 0)} of local coordinate space (its shader comes from
+     * {@link PaletteShader#obtain(Rect, int)} and can be returned with {@link PaletteShader#recycle})
+     */
+    public @NonNull Paint getPaint(int index) {
+        final PaletteShader shader = PaletteShader.obtain(regions[index], index);
+        shader.setBitmap(paletteTexture, storageTexture);
+
+        final Paint paint = new Paint();
+        paint.setShader(shader);
+        return paint;
+    }
+
+    /**
+     * @return new Drawable with the image at given index (in order, in which images were added to the Builder)
+     */
+    public @NonNull Drawable getDrawable(int index) {
+        final Rect region = regions[index];
+        return new ShaderDrawable(getPaint(index), region.width(), region.height(), opaque[index]);
+    }
+
+    /**
+     * Decodes images one by one and composes them into atlas. Only indexed and greyscale images can be
+     * added. This class is not thread-safe, but the atlas can be built on background thread.
+     */
+    public static final class Builder {
+        private final List<DecodingResult> images = new ArrayList<>();
+
+        private long area;
+
+        /**
+         * Decode an image and add it to atlas.
+         *
+         * @param image buffer with image data
+         *
+         * @return index of image in atlas or -1 if it can not be added (not an indexed or greyscale PNG,
+         * too big or failed to decode)
+         */
+        public int add(@NonNull ByteBuffer image) {
+            final PngHeaderInfo headerInfo = PngDecoder.getImageInfo(image);
+            if (headerInfo == null || !headerInfo.isPaletteOrGreyscale()
+                    || headerInfo.width > MAX_SIZE || headerInfo.height > MAX_SIZE) {
+                return -1;
+            }
+
+            final Bitmap bitmap = PngSupport.obtainBitmap(headerInfo.width, headerInfo.height, Bitmap.Config.ALPHA_8);
+
+            final DecodingResult result = PngDecoder.decodeIndexed(PngDecoder.getThreadContext(), image, bitmap, 0);
+            if (result == null) {
+                PngSupport.releaseBitmap(bitmap);
+                return -1;
+            }
+
+            area += (long) headerInfo.width * headerInfo.height;
+            images.add(result);
+            return images.size() - 1;
+        }
+
+        /**
+         * Compose added images into atlas and upload it to GPU. The Builder can not be used afterwards.
+         *
+         * @return new atlas or null if no images were added or they don't fit into single texture
+         */
+        public @Nullable IndexedAtlas build() {
+            try {
+                return images.isEmpty() || images.size() > MAX_SIZE ? null : compose();
+            } finally {
+                for (DecodingResult result : images) {
+                    PngSupport.releaseBitmap(result.bitmap);
+                }
+                images.clear();
+            }
+        }
+
+        private IndexedAtlas compose() {
+            final int count = images.size();
+
+            final Rect[] regions = layout(count);
+            if (regions == null) {
+                return null;
+            }
+
+            int width = 0, height = 0;
+            for (Rect region : regions) {
+                width = Math.max(width, region.right);
+                height = Math.max(height, region.bottom);
+            }
+
+            final Bitmap storage = Bitmap.createBitmap(width, height, Bitmap.Config.ALPHA_8);
+            final ByteBuffer storagePixels = ByteBuffer.allocate(storage.getRowBytes() * height);
+
+            final Bitmap palette = Bitmap.createBitmap(PALETTE_SIZE, count, Bitmap.Config.ARGB_8888);
+            final ByteBuffer palettePixels = ByteBuffer.allocate(palette.getRowBytes() * count);
+
+            final boolean[] opaque = new boolean[count];
+
+            for (int i = 0; i < count; ++i) {
+                final DecodingResult result = images.get(i);
+
+                copyImage(result.bitmap, regions[i], storagePixels, storage.getRowBytes());
+                copyPalette(result, palettePixels, i * palette.getRowBytes());
+
+                opaque[i] = result.isOpaque();
+            }
+
+            storagePixels.rewind();
+            storage.copyPixelsFromBuffer(storagePixels);
+            palettePixels.rewind();
+            palette.copyPixelsFromBuffer(palettePixels);
+
+            final BitmapShader storageTexture = toTexture(storage);
+            final BitmapShader paletteTexture = toTexture(palette);
+
+            return new IndexedAtlas(storageTexture, paletteTexture, regions, opaque);
+        }
+
+        // shelf packing: the tallest images go first, each shelf is as tall as its first image
+        private Rect[] layout(int count) {
+            final Integer[] order = new Integer[count];
+            int maxWidth = 0;
+            for (int i = 0; i < count; ++i) {
+                order[i] = i;
+                maxWidth = Math.max(maxWidth, images.get(i).bitmap.getWidth());
+            }
+
+            Arrays.sort(order, new Comparator<Integer>() {
+                @Override
+                public int compare(Integer a, Integer b) {
+                    return images.get(b).bitmap.getHeight() - images.get(a).bitmap.getHeight();
+                }
+            });
+
+            // roughly square texture, but not narrower than the widest image
+            final int atlasWidth = Math.min(MAX_SIZE, Math.max(maxWidth, (int) Math.ceil(Math.sqrt(area))));
+
+            final Rect[] regions = new Rect[count];
+
+            int x = 0, y = 0, shelfHeight = 0;
+
+            for (Integer index : order) {
+                final Bitmap bitmap = images.get(index).bitmap;
+
+                if (x + bitmap.getWidth() > atlasWidth) {
+                    x = 0;
+                    y += shelfHeight;
+                    shelfHeight = 0;
+                }
+
+                if (y + bitmap.getHeight() > MAX_SIZE) {
+                    return null;
+                }
+
+                regions[index] = new Rect(x, y, x + bitmap.getWidth(), y + bitmap.getHeight());
+
+                x += bitmap.getWidth();
+                shelfHeight = Math.max(shelfHeight, bitmap.getHeight());
+            }
+
+            return regions;
+        }
+
+        private static void copyImage(Bitmap image, Rect region, ByteBuffer dest, int destStride) {
+            final ByteBuffer pixels = ByteBuffer.allocate(image.getRowBytes() * image.getHeight());
+            image.copyPixelsToBuffer(pixels);
+
+            final byte[] source = pixels.array();
+            final int stride = image.getRowBytes();
+
+            for (int row = 0; row < region.height(); ++row) {
+                dest.position((region.top + row) * destStride + region.left);
+                dest.put(source, row * stride, region.width());
+            }
+        }
+
+        // greyscale images get a grey ramp, so that the shader does not need to know about them
+        private static void copyPalette(DecodingResult result, ByteBuffer dest, int offset) {
+            dest.position(offset);
+
+            if (result.decodedAsGreyscale()) {
+                for (int i = 0; i < PALETTE_SIZE; ++i) {
+                    final byte value = (byte) i;
+                    dest.put(value).put(value).put(value).put((byte) 0xFF);
+                }
+            } else {
+                dest.put(result.palette.array(), 0, result.palette.limit());
+            }
+        }
+
+        private static BitmapShader toTexture(Bitmap bitmap) {
+            Bitmap texture = bitmap.copy(Bitmap.Config.HARDWARE, false);
+            if (texture != null) {
+                bitmap.recycle();
+            } else {
+                texture = bitmap;
+            }
+
+            final BitmapShader shader = new BitmapShader(texture, Shader.TileMode.CLAMP, Shader.TileMode.CLAMP);
+            shader.setFilterMode(BitmapShader.FILTER_MODE_NEAREST);
+            return shader;
+        }
+    }
+}
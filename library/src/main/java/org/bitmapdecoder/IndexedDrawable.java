@@ -18,7 +18,6 @@ package org.bitmapdecoder;
 import android.annotation.TargetApi;
 import android.content.res.*;
 import android.graphics.*;
-import android.graphics.Bitmap.Config;
 import android.graphics.drawable.BitmapDrawable;
 import android.graphics.drawable.Drawable;
 import android.os.Build;
@@ -57,7 +56,15 @@ import static org.bitmapdecoder.PngSupport.makeStateSpec;
  * that IndexedDrawable takes roughly 1/2 of memory used by identical BitmapDrawable with {@code HARDWARE} Config
  * and 1/4 of memory when compared to {@code ARGB_8888} BitmapDrawable.
  *
- * <p>IndexedDrawable supports tiling, tinting, density scaling and configuration-aware caching.
+ * <p>IndexedDrawable supports tiling, tinting, density scaling and configuration-aware caching. Colors of indexed
+ * image can be replaced at runtime with {@link #setPalette}, e.g. to recolor it for dark theme.
+ * Non-repeating images with density at least twice as high as the screen density are decoded subsampled by
+ * a power of 2 (without filtering), so e.g. an xxhdpi-only image on mdpi screen only takes 1/4 of full-size texture.
+ *
+ * <p>Drawables, that may never be shown (e.g. hidden states of selector or off-screen pages), can be inflated
+ * lazily by adding {@code app:lazy="true"} (with {@code xmlns:app="http://schemas.android.com/apk/res-auto"}).
+ * Inflating such drawable only reads the header of PNG to learn it's size; the image itself is decoded on the
+ * first {@link #draw} or earlier, by {@link PngSupport#prefetch}.
  *
  * <p>Unlike BitmapDrawable, this class has hardcoded gravity behavior: it always positions itself at the top left
  * of container and, depending on tiling setting, either repeats/mirrors in both directions, or scales up to fill all
@@ -67,9 +74,9 @@ import static org.bitmapdecoder.PngSupport.makeStateSpec;
  * regardless of Paint settings.
  *
  * <p>Note, that despite it's name this class is able to handle non-indexed and non-PNG images just fine. However, it
- * will fall back to using {@link BitmapFactory} and {@link BitmapShader} for such images, resulting in no memory gains
- * compared to BitmapDrawable. Only 8-bit colormap (color type 0) and 8/16-bit greyscale (color type 4) PNGs will be
- * decoded to the more efficient representation.
+ * will decode truecolor PNGs to ARGB_8888 Bitmap and fall back to using {@link BitmapFactory} for non-PNG images,
+ * resulting in no memory gains compared to BitmapDrawable. Only 8-bit colormap (color type 0) and 8/16-bit greyscale
+ * (color type 4) PNGs will be decoded to the more efficient representation.
  *
  * @see <a href="http://www.libpng.org/pub/png/spec/1.2/PNG-Chunks.html">PNG specification</a>
  */
@@ -82,6 +89,9 @@ public class IndexedDrawable extends ShaderDrawable {
 
     private static final int DISABLE_TILING = 0xffffffff;
 
+    // allocation size of the image Bitmap of state, set by the last successful decode (for StateCache)
+    private int stateBytes;
+
     public IndexedDrawable(@NonNull Resources resources, @DrawableRes int resourceId) {
         this();
 
@@ -113,6 +123,44 @@ public class IndexedDrawable extends ShaderDrawable {
         return state.canApplyTheme();
     }
 
+    @Override
+    public void draw(@NonNull Canvas canvas) {
+        decodePending();
+
+        super.draw(canvas);
+    }
+
+    /**
+     * Decode the image of lazily inflated drawable, unless it is already decoded.
+     *
+     * @return false if the image could not be decoded
+     */
+    boolean decodePending() {
+        final PendingDecode pending = getPending();
+        if (pending == null) {
+            return true;
+        }
+
+        final State decoded = pending.get();
+        if (decoded == null) {
+            return false;
+        }
+
+        final IndexedDrawableState current = (IndexedDrawableState) state;
+
+        // keep alpha and tint, applied so far, but take the color filter for mask or greyscale image, if there is none
+        final Paint paint = new Paint(current.paint);
+        paint.setShader(decoded.paint.getShader());
+        if (paint.getColorFilter() == null) {
+            paint.setColorFilter(decoded.paint.getColorFilter());
+        }
+
+        state = new IndexedDrawableState(paint, current, current.tint, current.tintResId,
+                current.getChangingConfigurations(), current.getScale(), current.flags | decoded.flags, null);
+
+        return true;
+    }
+
     @Override
     public void applyTheme(@NonNull Resources.Theme theme) {
         ColorStateList currentTint = getTint();
@@ -220,14 +268,21 @@ public class IndexedDrawable extends ShaderDrawable {
                     tint = tv.resourceId;
             }
 
+            final boolean lazy = typedArray.getBoolean(R.styleable.IndexedDrawable_lazy, false);
+
             final int resourceId = typedArray.getResourceId(R.styleable.IndexedDrawable_android_src, 0);
             if (resourceId != 0) {
                 final DisplayMetrics displayMetrics = r.getDisplayMetrics();
                 r.getValueForDensity(resourceId, displayMetrics.densityDpi, tv, true);
 
-                final boolean decoded = PngSupport.isPreview(typedArray)
-                        ? decodePreview(r, tv, tileMode)
-                        : decode(r, tv, tileMode, tintList != null);
+                final boolean decoded;
+                if (PngSupport.isPreview(typedArray)) {
+                    decoded = decodePreview(r, tv, tileMode);
+                } else if (lazy) {
+                    decoded = decodeLazily(r, tv, tileMode, tintList != null);
+                } else {
+                    decoded = decode(r, tv, tileMode, tintList != null);
+                }
 
                 if (decoded) {
                     float scale = applyDensity(r.getDisplayMetrics(), tv.density);
@@ -272,6 +327,44 @@ public class IndexedDrawable extends ShaderDrawable {
         applyTint(getState(), getState(), tint, true);
     }
 
+    /**
+     * Replace colors of indexed image without decoding it again: the image texture is kept and only the palette
+     * texture is replaced (palette textures are cached by {@link PaletteShader#getPaletteTexture}, so switching
+     * back and forth between themes does not upload anything). Other drawables, that share the state of this one,
+     * are not affected.
+     *
+     * @param colors non-premultiplied colors, the same as index of each color in image
+     *
+     * @return false if the image is not drawn by {@link PaletteShader} (greyscale, mask and truecolor images,
+     * Android below 13) or could not be decoded
+     */
+    public boolean setPalette(@NonNull @ColorInt int[] colors) {
+        if (Build.VERSION.SDK_INT < 33 || !decodePending()) {
+            return false;
+        }
+
+        final Shader shader = state.paint.getShader();
+        if (!(shader instanceof PaletteShader)) {
+            return false;
+        }
+
+        final Paint paint = new Paint(state.paint);
+        paint.setShader(((PaletteShader) shader).withPalette(colors));
+
+        boolean opaque = true;
+        for (int color : colors) {
+            opaque &= Color.alpha(color) == 0xFF;
+        }
+
+        final int flags = opaque ? state.flags | ShaderDrawable.OPAQUE_MASK : state.flags & ~ShaderDrawable.OPAQUE_MASK;
+
+        state = new IndexedDrawableState(paint, state, getTint(), getTintResId(), state.getChangingConfigurations(),
+                state.getScale(), flags);
+
+        invalidateSelf();
+        return true;
+    }
+
     @Override
     public boolean isStateful() {
         final ColorStateList tint = getTint();
@@ -332,7 +425,10 @@ public class IndexedDrawable extends ShaderDrawable {
         int w = state.width;
         int h = state.height;
 
-        state = new State(state.paint, scale(w, sDensity, tDensity), scale(h, sDensity, tDensity), state.flags);
+        final State scaled = new State(state.paint, scale(w, sDensity, tDensity), scale(h, sDensity, tDensity), state.flags);
+
+        final PendingDecode pending = getPending();
+        state = pending == null ? scaled : new IndexedDrawableState(scaled, pending);
 
         return state.width / (float) w;
     }
@@ -357,6 +453,14 @@ public class IndexedDrawable extends ShaderDrawable {
         return ((IndexedDrawableState) state).tintResId;
     }
 
+    private PendingDecode getPending() {
+        if (!(state instanceof IndexedDrawableState)) {
+            return null;
+        }
+
+        return ((IndexedDrawableState) state).pending;
+    }
+
     private void decode(Resources r, TypedValue tv) throws IOException {
         if (!decode(r, tv, 0, false)) {
             throw new IOException(PngSupport.ERROR_CODE_DECODING_FAILED);
@@ -369,23 +473,99 @@ public class IndexedDrawable extends ShaderDrawable {
         }
     }
 
+    // only reads the header to learn the size of image, unless it has already been decoded and cached
+    private boolean decodeLazily(Resources r, TypedValue tv, int tileMode, boolean forceMask) throws IOException {
+        final int sampleSize = getSampleSize(r.getDisplayMetrics(), tv.density, tileMode);
+
+        final State cached = StateCache.get(cacheKey(r, tv, tileMode, forceMask, sampleSize));
+        if (cached != null) {
+            state = cached;
+            return true;
+        }
+
+        final PngDecoder.PngHeaderInfo headerInfo;
+        try (AssetFileDescriptor stream = r.getAssets().openNonAssetFd(tv.assetCookie, tv.string.toString())) {
+            headerInfo = PngDecoder.getImageInfo(stream);
+        }
+
+        if (headerInfo == null) {
+            // not a PNG, BitmapFactory has to decode it to learn the size anyway
+            return decode(r, tv, tileMode, forceMask);
+        }
+
+        final State placeholder = new State(new Paint(), headerInfo.width, headerInfo.height, 0);
+
+        state = new IndexedDrawableState(placeholder, new PendingDecode(r, tv, tileMode, forceMask));
+        return true;
+    }
+
     private boolean decode(Resources r, TypedValue tv, int tileMode, boolean forceMask) throws IOException {
+        final int sampleSize = getSampleSize(r.getDisplayMetrics(), tv.density, tileMode);
+
+        final StateCache.Key key = cacheKey(r, tv, tileMode, forceMask, sampleSize);
+
+        final State cached = StateCache.get(key);
+        if (cached != null) {
+            state = cached;
+            return true;
+        }
+
+        final int bitmapSize = decodeResource(r, tv, tileMode, forceMask, sampleSize);
+        if (bitmapSize == 0) {
+            return false;
+        }
+
+        StateCache.put(key, state, bitmapSize);
+        return true;
+    }
+
+    private static StateCache.Key cacheKey(Resources r, TypedValue tv, int tileMode, boolean forceMask, int sampleSize) {
+        return new StateCache.Key(r.getAssets(), tv.assetCookie, tv.string.toString(), tv.density, tileMode, forceMask,
+                sampleSize);
+    }
+
+    // returns allocation size of decoded Bitmap in bytes or 0 if decoding fails
+    private int decodeResource(Resources r, TypedValue tv, int tileMode, boolean forceMask, int sampleSize) throws IOException {
         final AssetManager am = r.getAssets();
 
         try (AssetFileDescriptor stream = am.openNonAssetFd(tv.assetCookie, tv.string.toString())) {
             final ByteBuffer buffer = PngSupport.loadIndexedPng(stream);
             final PngDecoder.PngHeaderInfo headerInfo = PngDecoder.getImageInfo(buffer);
-            if (headerInfo != null && headerInfo.isPaletteOrGreyscale()) {
-                int decodingFlags = tileMode;
-                if (forceMask) {
-                    decodingFlags |= PngDecoder.OPTION_EXTRACT_MASK;
+            final String image = tv.string.toString();
+
+            int error = PngDecoder.ERROR_UNSUPPORTED;
+
+            if (headerInfo != null) {
+                error = PngDecoder.ERROR_NOT_INDEXED;
+
+                // resources are protected by signature of APK, checking them again is a waste
+                if (headerInfo.isPaletteOrGreyscale()) {
+                    int decodingFlags = tileMode | PngDecoder.OPTION_TRUSTED_SOURCE;
+                    if (forceMask) {
+                        decodingFlags |= PngDecoder.OPTION_EXTRACT_MASK;
+                    }
+
+                    if (decode(buffer, headerInfo, decodingFlags, sampleSize)) {
+                        return stateBytes;
+                    }
+
+                    error = PngDecoder.getLastError();
                 }
 
-                if (decode(buffer, headerInfo, decodingFlags)) {
-                    return true;
+                if (decodeRgba(buffer, headerInfo, tileMode, PngDecoder.OPTION_TRUSTED_SOURCE)) {
+                    PngSupport.reportFallback(image, error, false);
+                    return stateBytes;
                 }
+
+                error = PngDecoder.getLastError();
             }
-            return decodeFallback(r, tv, tileMode);
+
+            if (!decodeFallback(r, tv, tileMode)) {
+                return 0;
+            }
+
+            PngSupport.reportFallback(image, error, true);
+            return stateBytes;
         }
     }
 
@@ -394,23 +574,69 @@ public class IndexedDrawable extends ShaderDrawable {
         if (headerInfo == null) {
             return false;
         }
-        return decode(buffer, headerInfo, 0);
+        if (headerInfo.isPaletteOrGreyscale() && decode(buffer, headerInfo, 0, 1)) {
+            return true;
+        }
+        return decodeRgba(buffer, headerInfo, 0, 0);
     }
 
-    private boolean decode(ByteBuffer buffer, PngDecoder.PngHeaderInfo headerInfo, @Options int options) {
+    // same memory cost as BitmapFactory, but reuses already mapped buffer
+    private boolean decodeRgba(ByteBuffer buffer, PngDecoder.PngHeaderInfo headerInfo, int tileMode, int options) {
+        final PngDecoder.DecodingResult result = PngSupport.decodeRgba(buffer, headerInfo, options);
+        if (result == null) {
+            return false;
+        }
+        setShaderFallback(result.bitmap, tileMode);
+        return true;
+    }
+
+    private boolean decode(ByteBuffer buffer, PngDecoder.PngHeaderInfo headerInfo, @Options int options, int sampleSize) {
         final int decoderFlags = getFlags(headerInfo) | options;
-        final Bitmap imageBitmap = Bitmap.createBitmap(headerInfo.width, headerInfo.height, Config.ALPHA_8);
-        final PngDecoder.DecodingResult result = PngDecoder.decodeIndexed(buffer, imageBitmap, decoderFlags);
-        final Paint paint = result == null ? null : PngSupport.createPaint(result, imageBitmap, decoderFlags);
+        final PngDecoder.DecodingResult result = PngSupport.decodeIndexed(buffer, headerInfo, decoderFlags, sampleSize);
+        if (result == null) {
+            return false;
+        }
+        // pooled Bitmap may be bigger than image, and it is released once its contents are uploaded
+        final int byteCount = result.bitmap.getAllocationByteCount();
+        final Paint paint = PngSupport.createPaint(result, result.bitmap, decoderFlags);
         if (paint != null) {
+            if (sampleSize != 1) {
+                // stretch subsampled image back to full size, so density scaling stays the same
+                final Matrix matrix = new Matrix();
+                matrix.setScale(sampleSize, sampleSize);
+                paint.getShader().setLocalMatrix(matrix);
+            }
             state = new State(paint, headerInfo.width, headerInfo.height, makeStateSpec(result));
+            stateBytes = byteCount;
             return true;
         }
         // fall back to ARGB_8888 Bitmap
-        imageBitmap.recycle();
+        PngSupport.releaseBitmap(result.bitmap);
+        PngDecoder.setLastError(PngDecoder.ERROR_NOT_INDEXED);
         return false;
     }
 
+    // Largest power of 2, that does not make the image smaller than it is going to be drawn.
+    // Repeated images are never subsampled, because rounding would change the size of tile
+    private static int getSampleSize(DisplayMetrics metrics, int sDensity, int tileMode) {
+        final int tDensity = metrics.densityDpi;
+
+        if (sDensity == 0) {
+            sDensity = DisplayMetrics.DENSITY_MEDIUM;
+        }
+
+        if (tileMode != 0 || sDensity == TypedValue.DENSITY_NONE || tDensity == TypedValue.DENSITY_NONE || tDensity <= 0) {
+            return 1;
+        }
+
+        int sampleSize = 1;
+        while (tDensity * sampleSize * 2 <= sDensity) {
+            sampleSize *= 2;
+        }
+
+        return sampleSize;
+    }
+
     private static int getFlags(PngDecoder.PngHeaderInfo image) {
         if (image.width * image.height <= MASK_USAGE_THRESHOLD) {
             return PngDecoder.OPTION_DECODE_AS_MASK;
@@ -450,6 +676,46 @@ public class IndexedDrawable extends ShaderDrawable {
         final Shader.TileMode tiled = toTileMode(tileMode);
         fallback.setShader(new BitmapShader(bitmap, tiled, tiled));
         state = new State(fallback, bitmap.getWidth(), bitmap.getHeight(), !bitmap.hasAlpha());
+        stateBytes = bitmap.getAllocationByteCount();
+    }
+
+    // Image of lazily inflated drawable. It is decoded once and shared by all copies of drawable state
+    private static final class PendingDecode {
+        private final Resources resources;
+        private final TypedValue value;
+        private final int tileMode;
+        private final boolean forceMask;
+
+        private State decoded;
+        private boolean failed;
+
+        PendingDecode(Resources resources, TypedValue value, int tileMode, boolean forceMask) {
+            this.resources = resources;
+            this.value = new TypedValue();
+            this.value.setTo(value);
+            this.tileMode = tileMode;
+            this.forceMask = forceMask;
+        }
+
+        // decode on the calling thread (or wait for another thread to finish doing so)
+        synchronized @Nullable State get() {
+            if (decoded == null && !failed) {
+                final IndexedDrawable decoder = new IndexedDrawable();
+                try {
+                    if (decoder.decode(resources, value, tileMode, forceMask)) {
+                        decoded = decoder.state;
+                    } else {
+                        Log.e(TAG, PngSupport.ERROR_CODE_DECODING_FAILED + ": " + value.string);
+                        failed = true;
+                    }
+                } catch (IOException ioe) {
+                    Log.e(TAG, PngSupport.ERROR_CODE_DECODING_FAILED + ": " + value.string, ioe);
+                    failed = true;
+                }
+            }
+
+            return decoded;
+        }
     }
 
     private static class IndexedDrawableState extends State {
@@ -459,19 +725,39 @@ public class IndexedDrawable extends ShaderDrawable {
         private final int configurations;
         private final float scale;
 
+        // non-null until image of lazily inflated drawable is decoded
+        private final PendingDecode pending;
+
         private IndexedDrawableState(@NonNull Paint paint,
                                      @NonNull State state,
                                      ColorStateList tint,
                                      int tintResId,
                                      int configurations,
                                      float scale,
-                                     int newFlags) {
+                                     int newFlags,
+                                     PendingDecode pending) {
             super(paint, state.width, state.height, newFlags);
 
             this.tint = tint;
             this.tintResId = tintResId;
             this.scale = scale;
             this.configurations = configurations | getConfigurations(tint);
+            this.pending = pending;
+        }
+
+        private IndexedDrawableState(@NonNull Paint paint,
+                                     @NonNull State state,
+                                     ColorStateList tint,
+                                     int tintResId,
+                                     int configurations,
+                                     float scale,
+                                     int newFlags) {
+            this(paint, state, tint, tintResId, configurations, scale, newFlags,
+                    state instanceof IndexedDrawableState ? ((IndexedDrawableState) state).pending : null);
+        }
+
+        private IndexedDrawableState(@NonNull State placeholder, @NonNull PendingDecode pending) {
+            this(placeholder.paint, placeholder, null, 0, 0, 1.0f, placeholder.flags, pending);
         }
 
         private IndexedDrawableState(@NonNull State state,
@@ -16,16 +16,98 @@
 package org.bitmapdecoder;
 
 import android.annotation.TargetApi;
+import android.graphics.Bitmap;
 import android.graphics.BitmapShader;
+import android.graphics.Matrix;
+import android.graphics.Rect;
 import android.graphics.RuntimeShader;
 import android.graphics.Shader;
+import android.os.Trace;
+import androidx.annotation.ColorInt;
 import androidx.annotation.NonNull;
 
+import java.util.ArrayDeque;
+import java.util.Arrays;
+import java.util.LinkedHashMap;
+import java.util.Map;
+
 /**
  * Simple shader for rendering images with 8-bit indexed color.
+ *
+ * <p>There is also a variant for packed images, that store several 1, 2 or 4-bit indices in each byte of
+ * storage texture (see {@link PngDecoder#OPTION_PACK_INDICES}), most significant bits first.
+ * It takes the width of image in pixels, because the storage texture is narrower than image.
+ *
+ * <p>The third variant draws a part of shared textures, see {@link IndexedAtlas}.
+ *
+ * <p>Each constructor call compiles the shader source into new {@code SkRuntimeEffect}: Android does not cache
+ * them and has no API for sharing one between several RuntimeShaders (GPU programs, made from the effect, are
+ * cached by Skia regardless). When many images are shown at once, use {@link #obtain} instead: it hands out
+ * shaders, compiled in advance by {@link #prewarm} or returned with {@link #recycle}, so that the compilation
+ * does not happen on the main thread during the first frame.
+ *
+ * <p>Colors of image can be replaced without decoding it again: {@link #updatePalette} only binds another palette
+ * texture, and {@link #withPalette} makes a shader with new palette for the same image texture. Palette textures,
+ * made from color arrays, are cached (by contents of array), so switching between a couple of themes does not
+ * upload anything after the first switch.
  */
 @TargetApi(33)
 public class PaletteShader extends RuntimeShader {
+    private static final int MAX_POOLED = 16;
+
+    private static final int MAX_PALETTES = 32;
+
+    private static final int VARIANT_INDEXED = 0;
+    private static final int VARIANT_PACKED = 1;
+    private static final int VARIANT_ATLAS = 2;
+
+    // one per variant: 8-bit, packed indices and atlas regions
+    private static final ArrayDeque<PaletteShader> indexedPool = new ArrayDeque<>();
+    private static final ArrayDeque<PaletteShader> packedPool = new ArrayDeque<>();
+    private static final ArrayDeque<PaletteShader> atlasPool = new ArrayDeque<>();
+
+    // replaces inputs of pooled shaders, so that they don't keep recycled images alive
+    private static BitmapShader emptyTexture;
+
+    // palette textures by colors, least recently used are evicted first
+    private static final LinkedHashMap<PaletteKey, BitmapShader> palettes =
+            new LinkedHashMap<PaletteKey, BitmapShader>(MAX_PALETTES, 0.75f, true) {
+                @Override
+                protected boolean removeEldestEntry(Map.Entry<PaletteKey, BitmapShader> eldest) {
+                    return size() > MAX_PALETTES;
+                }
+            };
+
+    private static final String PACKED_SHADER = "uniform shader t;" +
+            "uniform shader p;" +
+            "uniform float w;" +
+            "uniform float b;" +
+            "vec4 main(vec2 c){" +
+            "float n=8.0/b;" +
+            "float x=clamp(floor(c.x),0.0,w-1.0);" +
+            "float i=floor(x/n);" +
+            "float v=floor(t.eval(vec2(i+0.5,c.y)).a*255.0+0.5);" +
+            "float s=exp2(b*(n-1.0-(x-i*n)));" +
+            "return p.eval(vec2(mod(floor(v/s),exp2(b))+0.5,0.5));" +
+            "}";
+
+    // coordinates are clamped to the region, so that neighbours never bleed in
+    private static final String ATLAS_SHADER = "uniform shader t;" +
+            "uniform shader p;" +
+            "uniform float4 r;" +
+            "uniform float y;" +
+            "vec4 main(vec2 c){" +
+            "vec2 q=clamp(floor(c),vec2(0.0),r.zw-1.0)+r.xy+0.5;" +
+            "return p.eval(vec2(floor(t.eval(q).a*255.0+0.5)+0.5,y+0.5));" +
+            "}";
+
+    private final int variant;
+
+    // current inputs and layout, kept for withPalette()
+    private BitmapShader storageTexture;
+    private Rect region;
+    private int bitsPerIndex = 8, width;
+
     /**
      * Create a shader without initializing it with image data (you must call {@link #setBitmap} to do so).
      */
@@ -35,6 +117,37 @@ public class PaletteShader extends RuntimeShader {
                 "vec4 main(vec2 c){" +
                 "return p.eval(vec2(t.eval(c).a*255,0));" +
                 "}");
+
+        variant = VARIANT_INDEXED;
+    }
+
+    /**
+     * Create a shader for packed image (you must call {@link #setBitmap} to initialize it with image data).
+     *
+     * @param bitsPerIndex 1, 2 or 4, as reported by {@link PngDecoder.DecodingResult#getBitsPerIndex}
+     * @param width width of image in pixels (not the width of storage texture)
+     */
+    public PaletteShader(int bitsPerIndex, int width) {
+        super(PACKED_SHADER);
+
+        variant = VARIANT_PACKED;
+
+        setPackedLayout(bitsPerIndex, width);
+    }
+
+    /**
+     * Create a shader for image, that occupies part of shared storage texture and uses one row of shared palette
+     * (you must call {@link #setBitmap} to initialize it with textures).
+     *
+     * @param region location of image within storage texture
+     * @param paletteRow row of palette texture with colors of image
+     */
+    public PaletteShader(@NonNull Rect region, int paletteRow) {
+        super(ATLAS_SHADER);
+
+        variant = VARIANT_ATLAS;
+
+        setAtlasLayout(region, paletteRow);
     }
 
     public PaletteShader(@NonNull Shader palette, @NonNull BitmapShader storageTexture) {
@@ -47,13 +160,260 @@ public class PaletteShader extends RuntimeShader {
      * Initialize a shader with image and palette.
      * <p/>
      * This method allows reusing existing {@link PaletteShader} object and the associated
-     * {@code SkRuntimeEffect} (such reuse might or might not be beneficial for performance).
+     * {@code SkRuntimeEffect}, which saves compiling the shader again (see {@link #obtain}).
      *
-     * @param palette single-row colormap, assumed to contain up to 256 pixels
-     * @param storageTexture ALPHA_8 allocation (value of each pixel is index of color in palette)
+     * @param palette single-row colormap, assumed to contain up to 256 pixels (or one row per image for atlas)
+     * @param storageTexture ALPHA_8 allocation (value of each pixel is index of color in palette or several packed
+     *                       indices for packed variant, which requires nearest-neighbor filtering)
      */
     public void setBitmap(@NonNull Shader palette, @NonNull BitmapShader storageTexture) {
         setInputShader("p", palette);
         setInputBuffer("t", storageTexture);
+
+        this.storageTexture = storageTexture;
+    }
+
+    /**
+     * Replace the palette, keeping the image texture. Frames, that have already been drawn, are not affected.
+     * For shaders of {@link IndexedAtlas} the palette must have the same layout as the shared one.
+     *
+     * @param palette single-row colormap, see {@link #setBitmap}
+     */
+    public void updatePalette(@NonNull Shader palette) {
+        setInputShader("p", palette);
+    }
+
+    /**
+     * Same as {@link #updatePalette(Shader)}, but takes the colors (the same as index of each color in image)
+     * and uses cached texture for them, see {@link #getPaletteTexture}.
+     */
+    public void updatePalette(@NonNull @ColorInt int[] colors) {
+        updatePalette(getPaletteTexture(colors));
+    }
+
+    /**
+     * Make a shader for the same image texture (and the same local matrix), but with another palette.
+     * Use it instead of {@link #updatePalette} if this shader is shared by several Paints.
+     *
+     * @param colors non-premultiplied colors, the same as index of each color in image
+     */
+    public @NonNull PaletteShader withPalette(@NonNull @ColorInt int[] colors) {
+        if (storageTexture == null) {
+            throw new IllegalStateException("Shader has no image texture");
+        }
+
+        final PaletteShader copy;
+        switch (variant) {
+            case VARIANT_PACKED:
+                copy = obtain(bitsPerIndex, width);
+                break;
+            case VARIANT_ATLAS:
+                // the new palette is a texture of it's own, with single row
+                copy = obtain(region, 0);
+                break;
+            default:
+                copy = obtain();
+        }
+
+        copy.setBitmap(getPaletteTexture(colors), storageTexture);
+
+        final Matrix matrix = new Matrix();
+        if (getLocalMatrix(matrix)) {
+            copy.setLocalMatrix(matrix);
+        }
+
+        return copy;
+    }
+
+    /**
+     * Get a palette texture for given colors, creating and uploading it if it is not cached yet.
+     * The cache holds 32 most recently used palettes.
+     *
+     * @param colors non-premultiplied colors (up to 256), index of each color is the index of palette entry
+     */
+    public static @NonNull BitmapShader getPaletteTexture(@NonNull @ColorInt int[] colors) {
+        if (colors.length == 0 || colors.length > 256) {
+            throw new IllegalArgumentException("Unsupported palette size: " + colors.length);
+        }
+
+        final PaletteKey key = new PaletteKey(colors);
+
+        synchronized (palettes) {
+            final BitmapShader cached = palettes.get(key);
+            if (cached != null) {
+                return cached;
+            }
+        }
+
+        Trace.beginSection("PaletteShader.getPaletteTexture");
+        try {
+            Bitmap bitmap = Bitmap.createBitmap(key.colors, colors.length, 1, Bitmap.Config.ARGB_8888);
+
+            final Bitmap hardware = bitmap.copy(Bitmap.Config.HARDWARE, false);
+            if (hardware != null) {
+                bitmap.recycle();
+                bitmap = hardware;
+            }
+
+            final BitmapShader texture = new BitmapShader(bitmap, Shader.TileMode.CLAMP, Shader.TileMode.CLAMP);
+            texture.setFilterMode(BitmapShader.FILTER_MODE_NEAREST);
+
+            synchronized (palettes) {
+                palettes.put(key, texture);
+            }
+
+            return texture;
+        } finally {
+            Trace.endSection();
+        }
+    }
+
+    private void setPackedLayout(int bitsPerIndex, int width) {
+        if (bitsPerIndex != 1 && bitsPerIndex != 2 && bitsPerIndex != 4) {
+            throw new IllegalArgumentException("Unsupported index size: " + bitsPerIndex);
+        }
+
+        setFloatUniform("b", bitsPerIndex);
+        setFloatUniform("w", width);
+
+        this.bitsPerIndex = bitsPerIndex;
+        this.width = width;
+    }
+
+    private void setAtlasLayout(Rect region, int paletteRow) {
+        setFloatUniform("r", region.left, region.top, region.width(), region.height());
+        setFloatUniform("y", paletteRow);
+
+        this.region = new Rect(region);
+    }
+
+    /**
+     * Get a shader for 8-bit indices, same as {@link #PaletteShader()}, reusing already compiled one if possible.
+     */
+    public static @NonNull PaletteShader obtain() {
+        final PaletteShader pooled = poll(indexedPool);
+        return pooled != null ? pooled : compile(8, 0);
+    }
+
+    /**
+     * Get a shader for packed indices, same as {@link #PaletteShader(int, int)}, reusing already compiled one
+     * if possible.
+     */
+    public static @NonNull PaletteShader obtain(int bitsPerIndex, int width) {
+        final PaletteShader pooled = poll(packedPool);
+        if (pooled == null) {
+            return compile(bitsPerIndex, width);
+        }
+
+        pooled.setPackedLayout(bitsPerIndex, width);
+        return pooled;
+    }
+
+    /**
+     * Get a shader for part of atlas, same as {@link #PaletteShader(Rect, int)}, reusing already compiled one
+     * if possible.
+     */
+    public static @NonNull PaletteShader obtain(@NonNull Rect region, int paletteRow) {
+        final PaletteShader pooled = poll(atlasPool);
+        if (pooled == null) {
+            Trace.beginSection("PaletteShader.compile");
+            try {
+                return new PaletteShader(region, paletteRow);
+            } finally {
+                Trace.endSection();
+            }
+        }
+
+        pooled.setAtlasLayout(region, paletteRow);
+        return pooled;
+    }
+
+    /**
+     * Compile shaders in advance, so that subsequent calls to {@link #obtain} don't have to. This takes a couple
+     * of milliseconds per shader and is meant to be called from background thread, e.g. during app startup.
+     *
+     * @param bitsPerIndex 8 for normal shaders, 1, 2 or 4 for packed ones (all packed variants are the same effect)
+     * @param count number of shaders to compile, the pool keeps at most 16 of each kind
+     */
+    public static void prewarm(int bitsPerIndex, int count) {
+        final ArrayDeque<PaletteShader> pool = bitsPerIndex == 8 ? indexedPool : packedPool;
+
+        for (int i = 0; i < count; ++i) {
+            synchronized (PaletteShader.class) {
+                if (pool.size() >= MAX_POOLED) {
+                    return;
+                }
+            }
+
+            recycle(compile(bitsPerIndex, 1));
+        }
+    }
+
+    /**
+     * Return shader to the pool of {@link #obtain}. The caller must not use it afterwards, but the frames, that
+     * have already been drawn with it, are not affected.
+     */
+    public static void recycle(@NonNull PaletteShader shader) {
+        final BitmapShader empty = getEmptyTexture();
+        shader.setBitmap(empty, empty);
+        shader.setLocalMatrix(null);
+
+        synchronized (PaletteShader.class) {
+            final ArrayDeque<PaletteShader> pool;
+            switch (shader.variant) {
+                case VARIANT_PACKED:
+                    pool = packedPool;
+                    break;
+                case VARIANT_ATLAS:
+                    pool = atlasPool;
+                    break;
+                default:
+                    pool = indexedPool;
+            }
+            if (pool.size() < MAX_POOLED) {
+                pool.push(shader);
+            }
+        }
+    }
+
+    private static PaletteShader compile(int bitsPerIndex, int width) {
+        Trace.beginSection("PaletteShader.compile");
+        try {
+            return bitsPerIndex == 8 ? new PaletteShader() : new PaletteShader(bitsPerIndex, width);
+        } finally {
+            Trace.endSection();
+        }
+    }
+
+    private static synchronized PaletteShader poll(ArrayDeque<PaletteShader> pool) {
+        return pool.poll();
+    }
+
+    private static synchronized BitmapShader getEmptyTexture() {
+        if (emptyTexture == null) {
+            final Bitmap empty = Bitmap.createBitmap(1, 1, Bitmap.Config.ALPHA_8);
+            emptyTexture = new BitmapShader(empty, Shader.TileMode.CLAMP, Shader.TileMode.CLAMP);
+        }
+        return emptyTexture;
+    }
+
+    private static final class PaletteKey {
+        final int[] colors;
+        private final int hash;
+
+        PaletteKey(int[] colors) {
+            this.colors = colors.clone();
+            this.hash = Arrays.hashCode(this.colors);
+        }
+
+        @Override
+        public boolean equals(Object o) {
+            return o instanceof PaletteKey && Arrays.equals(colors, ((PaletteKey) o).colors);
+        }
+
+        @Override
+        public int hashCode() {
+            return hash;
+        }
     }
 }
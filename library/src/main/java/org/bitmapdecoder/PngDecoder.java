@@ -15,15 +15,39 @@
  */
 package org.bitmapdecoder;
 
+import android.annotation.TargetApi;
+import android.content.res.AssetFileDescriptor;
 import android.graphics.Bitmap;
+import android.graphics.Rect;
+import android.hardware.HardwareBuffer;
 import android.os.Build;
 import android.os.Trace;
+import android.system.ErrnoException;
+import android.system.Os;
+import androidx.annotation.IntDef;
 import androidx.annotation.NonNull;
 import androidx.annotation.Nullable;
 
+import java.io.Closeable;
+import java.io.IOException;
+import java.lang.annotation.Retention;
+import java.lang.annotation.RetentionPolicy;
 import java.nio.ByteBuffer;
 import java.nio.IntBuffer;
+import java.nio.channels.ReadableByteChannel;
+import java.util.ArrayList;
+import java.util.Arrays;
+import java.util.List;
+import java.util.concurrent.Callable;
+import java.util.concurrent.Executor;
+import java.util.concurrent.Future;
+import java.util.concurrent.FutureTask;
+import java.util.concurrent.LinkedBlockingQueue;
+import java.util.concurrent.ThreadFactory;
+import java.util.concurrent.ThreadPoolExecutor;
+import java.util.concurrent.TimeUnit;
 import java.util.concurrent.atomic.AtomicBoolean;
+import java.util.concurrent.atomic.AtomicInteger;
 
 /**
  * An interface for accessing decoder, internally used by the library
@@ -45,23 +69,133 @@ public final class PngDecoder {
     public static final int OPTION_DECODE_AS_MASK = 0b0100;
     public static final int OPTION_EXTRACT_MASK   = 0b1000;
 
+    /**
+     * Keep palette indices of images with bit depth below 8 packed, several pixels per byte of output
+     * (see {@link #getPackedWidth}). Such images need {@link PaletteShader#PaletteShader(int, int) packed PaletteShader}
+     * to be displayed, but take 2-8 times less memory. Packed images are never converted to alpha mask.
+     * Only supported for images in ByteBuffer.
+     */
+    public static final int OPTION_PACK_INDICES   = 0b10000;
+
+    /**
+     * Decode image with several threads, if it has been split into independently compressed bands by
+     * {@code splitIndexedImages} Gradle task of the library. Other images are decoded as usual. Only worth it
+     * for big images, such as backgrounds, and only supported for images in ByteBuffer, decoded at full size
+     * (without {@link #OPTION_PACK_INDICES}).
+     */
+    public static final int OPTION_PARALLEL       = 0b100000;
+
+    /**
+     * Do not verify CRC-32 of PNG chunks and Adler-32 of image data. Corrupted images are then decoded
+     * with garbled pixels instead of being rejected, so this is only meant for images, that are already protected
+     * against corruption, such as resources in signed APK. Used by {@link IndexedDrawable} for resources.
+     * Without this option all decoders verify both checksums, except that decoding a region, which ends above
+     * the last row, only verifies chunks it reads (the rest of image data is never inflated).
+     */
+    public static final int OPTION_TRUSTED_SOURCE = 0b1000000;
+
     public static final int FLAG_IS_INDEXED    = 0b00100;
     public static final int FLAG_IS_GREYSCALE  = 0b01000;
     public static final int FLAG_IS_RGB        = 0b10000;
     public static final int FLAGS_8BIT = FLAG_IS_INDEXED | FLAG_IS_GREYSCALE;
 
+    /**
+     * Reasons of decoding failure, see {@link #getLastError()} and {@link Stats#getFailures}.
+     */
+    public static final int ERROR_NONE        = 0;
+    /**
+     * Image data is corrupted or truncated.
+     */
+    public static final int ERROR_MALFORMED   = 1;
+    /**
+     * Image or request is valid, but not supported by decoder (or device), e.g. the data is not PNG
+     * or 8-bit hardware buffers are missing.
+     */
+    public static final int ERROR_UNSUPPORTED = 2;
+    /**
+     * Image has colors (RGB or RGBA image, or indexed one, that needs {@link PaletteShader} before Android 13)
+     * and has to be decoded to ARGB_8888 Bitmap.
+     */
+    public static final int ERROR_NOT_INDEXED = 3;
+    /**
+     * Output Bitmap is too small or has wrong config, or requested region is outside of image.
+     */
+    public static final int ERROR_OUTPUT      = 4;
+    public static final int ERROR_ALLOCATION  = 5;
+    /**
+     * Pixels of output Bitmap or hardware buffer could not be locked.
+     */
+    public static final int ERROR_LOCK        = 6;
+    /**
+     * Reading from file descriptor or channel failed.
+     */
+    public static final int ERROR_IO          = 7;
+
+    @IntDef({ ERROR_NONE, ERROR_MALFORMED, ERROR_UNSUPPORTED, ERROR_NOT_INDEXED, ERROR_OUTPUT, ERROR_ALLOCATION,
+            ERROR_LOCK, ERROR_IO })
+    @Retention(RetentionPolicy.SOURCE)
+    public @interface DecodingError {
+    }
+
     private static final int SUCCESS_MASK           = 0b0001;
     private static final int FLAG_CONVERTED_TO_MASK = 0b0010;
     private static final int FLAG_CONVERTED_TO_GREY = 0b0100;
     private static final int FLAG_OPAQUE            = 0b1000;
+    private static final int FLAG_CONVERTED_TO_RGBA = 0b10000;
+    private static final int PACKED_BITS_SHIFT = 8;
+    private static final int SOURCE_DEPTH_SHIFT = 16;
+    private static final int ERROR_SHIFT = 24;
+    private static final int ERROR_COUNT = 8;
 
     private static final long PNG_SIGNATURE_LONG = -8552249625308161526L;
+    private static final int PNG_HEADER_SIZE = 28;
+
+    // precompiled image, made by convertIndexedImages task, see read_container() in native code
+    private static final long CONTAINER_SIGNATURE_LONG = -8554230872246969846L;
+
+    // see probe_image() in native code
+    private static final int PROBE_FIELDS = 7;
+    private static final int PROBE_FLAG_TRANSPARENCY = 0x1;
+    private static final int PROBE_FLAG_INTERLACED   = 0x2;
+    private static final int PROBE_FLAG_DECODABLE    = 0x4;
     private static final int PNG_COLOR_GREYSCALE = 0;
     private static final int PNG_COLOR_RGB = 2;
     private static final int PNG_COLOR_INDEXED = 3;
+    private static final int PNG_COLOR_RGBA = 6;
+
+    // see openAnimation() and decodeFrame() in native code
+    private static final int ANIMATION_FIELDS = 4;
+    private static final int FRAME_FIELDS = 6;
+
+    // see getStats() in native code
+    private static final int STATS_STAGES = 10;
+    private static final int STATS_FIELDS = STATS_STAGES + ERROR_COUNT;
+
+    // HardwareBuffer.R_8, not available in public SDK until API 34
+    private static final int HARDWARE_BUFFER_R8 = 0x38;
+    private static final long HARDWARE_BUFFER_USAGE = HardwareBuffer.USAGE_CPU_WRITE_RARELY | HardwareBuffer.USAGE_GPU_SAMPLED_IMAGE;
+
+    private static volatile boolean noHardwareR8;
+
+    private static final ByteBuffer EMPTY_PALETTE = ByteBuffer.allocate(0);
 
     static final int DEFAULT_DECODER_FLAGS = Build.VERSION.SDK_INT >= 33 ? 0 : OPTION_DECODE_AS_MASK;
 
+    private static final ThreadLocal<Context> threadContext = new ThreadLocal<Context>() {
+        @Override
+        protected Context initialValue() {
+            return new Context();
+        }
+    };
+
+    // reason of the latest failure on each thread, kept in array to avoid boxing
+    private static final ThreadLocal<int[]> lastError = new ThreadLocal<int[]>() {
+        @Override
+        protected int[] initialValue() {
+            return new int[1];
+        }
+    };
+
     /**
      * Load native libraries, required by decoder.
      * <p>
@@ -75,6 +209,11 @@ public final class PngDecoder {
     }
 
     /**
+     * Images, precompiled at build time by {@code convertIndexedImages} task of the library, are recognized as well:
+     * they are reported with the color type and bit depth of PNG image, they were made from, and can be passed to
+     * methods, that decode indexed and greyscale images from {@link ByteBuffer} (but not to {@link #decodeRgba}
+     * or {@link Animation}).
+     *
      * @param image buffer with image data
      *
      * @return some information about image or {@code null} if supplied buffer does not contain PNG image
@@ -82,43 +221,128 @@ public final class PngDecoder {
     public static @Nullable PngHeaderInfo getImageInfo(@NonNull ByteBuffer image) {
         Trace.beginSection("peek");
         try {
-            image.mark();
+            final int start = image.position();
 
-            final long signature = image.getLong();
-            if (signature != PNG_SIGNATURE_LONG) {
+            if (image.limit() - start < PNG_HEADER_SIZE) {
                 return null;
             }
 
-            image.getLong();
-
-            final int width = image.getInt();
-            final int height = image.getInt();
-            final int colorType = (image.getInt() & 0x00ff0000) >>> 16;
+            final long signature = image.getLong(start);
+            if (signature == CONTAINER_SIGNATURE_LONG) {
+                final int width = image.getInt(start + 8);
+                final int height = image.getInt(start + 12);
+                final int bitDepth = image.get(start + 20) & 0xff;
+                final int colorType = image.get(start + 21) & 0xff;
 
-            final int flags;
+                return new PngHeaderInfo(width, height, toFlags(colorType), bitDepth, 0, 0, 0);
+            }
 
-            switch (colorType) {
-                case PNG_COLOR_INDEXED:
-                    flags = FLAG_IS_INDEXED;
-                    break;
-                case PNG_COLOR_GREYSCALE:
-                    flags = FLAG_IS_GREYSCALE;
-                    break;
-                case PNG_COLOR_RGB:
-                    flags = FLAG_IS_RGB;
-                    break;
-                default:
-                    flags = 0;
+            if (signature != PNG_SIGNATURE_LONG) {
+                return null;
             }
 
-            return new PngHeaderInfo(width, height, flags);
+            final int width = image.getInt(start + 16);
+            final int height = image.getInt(start + 20);
+            final int depthAndColorType = image.getInt(start + 24);
+            final int bitDepth = depthAndColorType >>> 24;
+            final int colorType = (depthAndColorType & 0x00ff0000) >>> 16;
+
+            return new PngHeaderInfo(width, height, toFlags(colorType), bitDepth, 0, 0, 0);
         } finally {
-            image.reset();
+            Trace.endSection();
+        }
+    }
 
+    /**
+     * Parse header chunks of image, without decoding it. This is more thorough than
+     * {@link #getImageInfo(ByteBuffer)}, but also more expensive.
+     *
+     * @param image direct buffer with image data
+     *
+     * @return information about image, including extended fields of {@link PngHeaderInfo},
+     * or {@code null} if supplied buffer does not contain PNG image
+     */
+    public static @Nullable PngHeaderInfo probe(@NonNull ByteBuffer image) {
+        return probe(new ByteBuffer[] { image })[0];
+    }
+
+    /**
+     * Same as {@link #probe(ByteBuffer)}, but processes multiple images at once (in a single native call).
+     *
+     * @param images direct buffers with image data
+     *
+     * @return array of the same length as input, with {@code null} for each buffer without PNG image
+     */
+    public static @NonNull PngHeaderInfo[] probe(@NonNull ByteBuffer... images) {
+        final int count = images.length;
+
+        final int[] ranges = new int[count * 2];
+        for (int i = 0; i < count; ++i) {
+            ranges[i * 2] = images[i].position();
+            ranges[i * 2 + 1] = images[i].limit();
+        }
+
+        final int[] info = new int[count * PROBE_FIELDS];
+
+        final Context context = getThreadContext();
+
+        Trace.beginSection("probe");
+        try {
+            probe(context.getHandle(), images, ranges, info);
+        } finally {
             Trace.endSection();
+            reachabilityFence(context);
+        }
+
+        final PngHeaderInfo[] result = new PngHeaderInfo[count];
+        for (int i = 0; i < count; ++i) {
+            final int offset = i * PROBE_FIELDS;
+            final int width = info[offset];
+            if (width == 0) {
+                continue;
+            }
+            result[i] = new PngHeaderInfo(width, info[offset + 1], toFlags(info[offset + 3]),
+                    info[offset + 2], info[offset + 4], info[offset + 5], info[offset + 6]);
+        }
+        return result;
+    }
+
+    private static int toFlags(int colorType) {
+        switch (colorType) {
+            case PNG_COLOR_INDEXED:
+                return FLAG_IS_INDEXED;
+            case PNG_COLOR_GREYSCALE:
+                return FLAG_IS_GREYSCALE;
+            case PNG_COLOR_RGB:
+            case PNG_COLOR_RGBA:
+                return FLAG_IS_RGB;
+            default:
+                return 0;
         }
     }
 
+    /**
+     * @param image file descriptor, positioned at the start of PNG image
+     *
+     * @return some information about image or {@code null} if the file does not contain PNG image
+     */
+    public static @Nullable PngHeaderInfo getImageInfo(@NonNull AssetFileDescriptor image) throws IOException {
+        final byte[] header = new byte[PNG_HEADER_SIZE];
+
+        final int bytesRead;
+        try {
+            bytesRead = Os.pread(image.getFileDescriptor(), header, 0, header.length, image.getStartOffset());
+        } catch (ErrnoException e) {
+            throw e.rethrowAsIOException();
+        }
+
+        if (bytesRead < header.length) {
+            return null;
+        }
+
+        return getImageInfo(ByteBuffer.wrap(header));
+    }
+
     /**
      * @param image buffer with image data
      * @param output Bitmap object that will be populated with decoded image contents
@@ -126,9 +350,101 @@ public final class PngDecoder {
      * @return {@link DecodingResult}, describing outcome of decoding or null in case of failure
      */
     public static @Nullable DecodingResult decodeIndexed(@NonNull ByteBuffer image, @NonNull Bitmap output, int options) {
-        if (output.getConfig() != Bitmap.Config.ALPHA_8 || !output.isMutable()) {
-            throw new IllegalArgumentException();
+        return decodeIndexed(0, image, output, options);
+    }
+
+    /**
+     * Same as {@link #decodeIndexed(ByteBuffer, Bitmap, int)}, but reuses decoder state and native buffers,
+     * owned by supplied {@link Context}.
+     *
+     * @param context decoder context, that must not be concurrently used by other threads
+     * @param image buffer with image data
+     * @param output Bitmap object that will be populated with decoded image contents
+     *
+     * @return {@link DecodingResult}, describing outcome of decoding or null in case of failure
+     */
+    public static @Nullable DecodingResult decodeIndexed(@NonNull Context context, @NonNull ByteBuffer image, @NonNull Bitmap output, int options) {
+        try {
+            return decodeIndexed(context.getHandle(), image, output, options);
+        } finally {
+            reachabilityFence(context);
         }
+    }
+
+    /**
+     * Same as {@link #decodeIndexed(Context, ByteBuffer, Bitmap, int)}, but reads the image from file descriptor
+     * in small chunks instead of requiring all of it to be loaded or mapped into memory.
+     *
+     * <p>The file descriptor is read with positioned reads and it's offset is not changed.
+     *
+     * @param context decoder context, that must not be concurrently used by other threads
+     * @param image file descriptor with image data (between start offset and declared length, if any)
+     * @param output Bitmap object that will be populated with decoded image contents
+     *
+     * @return {@link DecodingResult}, describing outcome of decoding or null in case of failure
+     *
+     * @see #getImageInfo(AssetFileDescriptor)
+     */
+    public static @Nullable DecodingResult decodeIndexed(@NonNull Context context, @NonNull AssetFileDescriptor image, @NonNull Bitmap output, int options) {
+        checkIndexedOutput(output);
+
+        final byte[] palette = new byte[256 * 4];
+
+        final int fd = image.getParcelFileDescriptor().getFd();
+
+        final int returnCode;
+
+        Trace.beginSection("decodeFd");
+        try {
+            returnCode = decodeFd(context.getHandle(), fd, image.getStartOffset(), image.getDeclaredLength(), output, palette, options);
+        } finally {
+            Trace.endSection();
+            reachabilityFence(context);
+        }
+
+        return toIndexedResult(returnCode, output, palette, 0);
+    }
+
+    /**
+     * Same as {@link #decodeIndexed(Context, ByteBuffer, Bitmap, int)}, but reads the image from channel
+     * in small chunks instead of requiring all of it to be loaded into memory.
+     *
+     * <p>Channel must be in blocking mode. It is read until the end of PNG image and is not closed.
+     *
+     * @param context decoder context, that must not be concurrently used by other threads
+     * @param image channel with image data
+     * @param output Bitmap object that will be populated with decoded image contents
+     *
+     * @return {@link DecodingResult}, describing outcome of decoding or null in case of failure
+     *
+     * @throws IOException if reading from channel fails
+     */
+    public static @Nullable DecodingResult decodeIndexed(@NonNull Context context, @NonNull ReadableByteChannel image, @NonNull Bitmap output, int options) throws IOException {
+        checkIndexedOutput(output);
+
+        final byte[] palette = new byte[256 * 4];
+
+        final int returnCode;
+
+        Trace.beginSection("decodeChannel");
+        try {
+            returnCode = decodeChannel(context.getHandle(), image, output, palette, options);
+        } finally {
+            Trace.endSection();
+            reachabilityFence(context);
+        }
+
+        return toIndexedResult(returnCode, output, palette, 0);
+    }
+
+    private static @Nullable DecodingResult decodeIndexed(long context, ByteBuffer image, Bitmap output, int options) {
+        if ((options & OPTION_PACK_INDICES) != 0) {
+            // only the row decoder knows how to pack indices
+            return decodeRegion(context, image, 0, 0, 0, 0, output, options, 1);
+        }
+
+        checkIndexedOutput(output);
+
         if (!image.isDirect() || !image.hasRemaining()) {
             throw new IllegalArgumentException();
         }
@@ -139,37 +455,543 @@ public final class PngDecoder {
 
         Trace.beginSection("decode");
         try {
-            returnCode = decode(image, output, palette, image.position(), image.limit(), options);
-            if ((returnCode & SUCCESS_MASK) == 0) {
+            returnCode = decode(context, image, output, palette, image.position(), image.limit(), options);
+        } finally {
+            Trace.endSection();
+        }
+
+        return toIndexedResult(returnCode, output, palette, 0);
+    }
+
+    /**
+     * Same as {@link #decodeIndexed(Context, ByteBuffer, Bitmap, int)}, but only keeps every {@code sampleSize}-th
+     * pixel of every {@code sampleSize}-th row, like {@link android.graphics.BitmapFactory.Options#inSampleSize}.
+     * Pixels are picked as-is (without filtering), so the palette indices stay valid.
+     *
+     * <p>The output is {@link #getSampledSize ceil(width / sampleSize) x ceil(height / sampleSize)}. Most indexed
+     * and greyscale images are inflated one row at time, so the native memory use is proportional to the output and
+     * not to the image size. Interlaced images are first decoded in full.
+     *
+     * @param context decoder context, that must not be concurrently used by other threads
+     * @param image buffer with image data
+     * @param output Bitmap object that will be populated with decoded image contents
+     * @param sampleSize positive sampling step, 1 decodes the image in full
+     *
+     * @return {@link DecodingResult}, describing outcome of decoding or null in case of failure
+     *
+     * @see #calculateSampleSize
+     */
+    public static @Nullable DecodingResult decodeIndexed(@NonNull Context context, @NonNull ByteBuffer image, @NonNull Bitmap output, int options, int sampleSize) {
+        try {
+            return decodeRegion(context.getHandle(), image, 0, 0, 0, 0, output, options, sampleSize);
+        } finally {
+            reachabilityFence(context);
+        }
+    }
+
+    /**
+     * Decode rectangular part of indexed or greyscale image into ALPHA_8 Bitmap. The output Bitmap only needs
+     * to be as big as the region. This allows displaying images, that are too big to be decoded in their entirety.
+     *
+     * @param image buffer with image data
+     * @param region part of image to decode, must be within image bounds
+     * @param output Bitmap object that will be populated with decoded image contents
+     *
+     * @return {@link DecodingResult}, describing outcome of decoding or null in case of failure
+     *
+     * @see #decodeRegion(Context, ByteBuffer, Rect, Bitmap, int, int)
+     */
+    public static @Nullable DecodingResult decodeRegion(@NonNull ByteBuffer image, @NonNull Rect region, @NonNull Bitmap output) {
+        if (region.isEmpty()) {
+            throw new IllegalArgumentException();
+        }
+
+        return decodeRegion(0, image, region.left, region.top, region.right, region.bottom, output, 0, 1);
+    }
+
+    /**
+     * Same as {@link #decodeRegion(ByteBuffer, Rect, Bitmap)}, but reuses decoder state and native buffers,
+     * owned by supplied {@link Context} and optionally subsamples the region like
+     * {@link #decodeIndexed(Context, ByteBuffer, Bitmap, int, int)}.
+     *
+     * <p>Rows of non-interlaced images are inflated one by one and only the ones within region are kept, so
+     * native memory use does not depend on image size. But all rows above the region still have to be inflated,
+     * which makes regions near the bottom of big image slower to decode than the ones near the top. Interlaced
+     * images are decoded in full.
+     *
+     * @param context decoder context, that must not be concurrently used by other threads
+     * @param image buffer with image data
+     * @param region part of image to decode, must be within image bounds
+     * @param output Bitmap object that will be populated with decoded image contents
+     * @param sampleSize positive sampling step, 1 decodes the region in full
+     *
+     * @return {@link DecodingResult}, describing outcome of decoding or null in case of failure
+     */
+    public static @Nullable DecodingResult decodeRegion(@NonNull Context context, @NonNull ByteBuffer image, @NonNull Rect region,
+                                                        @NonNull Bitmap output, int options, int sampleSize) {
+        if (region.isEmpty()) {
+            throw new IllegalArgumentException();
+        }
+
+        try {
+            return decodeRegion(context.getHandle(), image, region.left, region.top, region.right, region.bottom, output, options, sampleSize);
+        } finally {
+            reachabilityFence(context);
+        }
+    }
+
+    private static @Nullable DecodingResult decodeRegion(long context, ByteBuffer image, int left, int top, int right, int bottom,
+                                                         Bitmap output, int options, int sampleSize) {
+        checkIndexedOutput(output);
+
+        if (!image.isDirect() || !image.hasRemaining() || sampleSize < 1) {
+            throw new IllegalArgumentException();
+        }
+
+        final byte[] palette = new byte[256 * 4];
+
+        final int returnCode;
+
+        Trace.beginSection("decodeRegion");
+        try {
+            returnCode = decodeRegion(context, image, output, palette, image.position(), image.limit(), options,
+                    left, top, right, bottom, sampleSize);
+        } finally {
+            Trace.endSection();
+        }
+
+        if ((returnCode >>> PACKED_BITS_SHIFT & 0xF) != 0) {
+            // packed Bitmap is narrower than the image, so its width has to be recorded separately
+            final int width = right > left ? right - left : getImageInfo(image).width;
+            return toIndexedResult(returnCode, output, palette, getSampledSize(width, sampleSize));
+        }
+
+        return toIndexedResult(returnCode, output, palette, 0);
+    }
+
+    /**
+     * @return the largest power of 2, that keeps subsampled image at least as big as requested
+     * in both dimensions (or 1 if the image is already smaller)
+     */
+    public static int calculateSampleSize(@NonNull PngHeaderInfo headerInfo, int requestedWidth, int requestedHeight) {
+        final int minWidth = Math.max(requestedWidth, 1);
+        final int minHeight = Math.max(requestedHeight, 1);
+
+        int sampleSize = 1;
+
+        while (headerInfo.width / (sampleSize * 2) >= minWidth
+                && headerInfo.height / (sampleSize * 2) >= minHeight) {
+            sampleSize *= 2;
+        }
+
+        return sampleSize;
+    }
+
+    /**
+     * @return width of ALPHA_8 Bitmap, needed to decode the image with {@link #OPTION_PACK_INDICES}
+     * (same as width of image, if its indices can not be packed)
+     */
+    public static int getPackedWidth(@NonNull PngHeaderInfo headerInfo) {
+        if (!headerInfo.isIndexed() || headerInfo.bitDepth == 0 || headerInfo.bitDepth >= 8) {
+            return headerInfo.width;
+        }
+
+        return (int) (((long) headerInfo.width * headerInfo.bitDepth + 7) / 8);
+    }
+
+    /**
+     * @return width or height of image, decoded with given sample size
+     */
+    public static int getSampledSize(int size, int sampleSize) {
+        return (size + sampleSize - 1) / sampleSize;
+    }
+
+    /**
+     * Same as {@link #decodeIndexed(Context, ByteBuffer, Bitmap, int)}, but decodes the image straight into
+     * GPU-accessible hardware buffer and returns it as {@code HARDWARE} Bitmap. This avoids allocating
+     * intermediate ALPHA_8 Bitmap and copying it with {@code Bitmap.copy(Bitmap.Config.HARDWARE, false)}.
+     *
+     * <p>Requires support for 8-bit hardware buffers, which is absent on many devices. Once the allocation of such
+     * buffer fails, this method keeps returning null without trying again.
+     *
+     * @param context decoder context, that must not be concurrently used by other threads
+     * @param image buffer with image data
+     *
+     * @return {@link DecodingResult} with HARDWARE Bitmap or null in case of failure
+     */
+    @TargetApi(29)
+    public static @Nullable DecodingResult decodeIndexedHardware(@NonNull Context context, @NonNull ByteBuffer image, int options) {
+        if (!image.isDirect() || !image.hasRemaining()) {
+            throw new IllegalArgumentException();
+        }
+
+        if (noHardwareR8) {
+            return failure(ERROR_UNSUPPORTED);
+        }
+
+        final PngHeaderInfo headerInfo = getImageInfo(image);
+        if (headerInfo == null) {
+            return failure(ERROR_UNSUPPORTED);
+        }
+        if (!headerInfo.isPaletteOrGreyscale()) {
+            return failure(ERROR_NOT_INDEXED);
+        }
+
+        final int width = headerInfo.width, height = headerInfo.height;
+
+        if (!HardwareBuffer.isSupported(width, height, HARDWARE_BUFFER_R8, 1, HARDWARE_BUFFER_USAGE)) {
+            noHardwareR8 = true;
+            return failure(ERROR_UNSUPPORTED);
+        }
+
+        final byte[] palette = new byte[256 * 4];
+
+        Trace.beginSection("decodeHardware");
+        try (HardwareBuffer buffer = HardwareBuffer.create(width, height, HARDWARE_BUFFER_R8, 1, HARDWARE_BUFFER_USAGE)) {
+            final int returnCode = decodeHardware(context.getHandle(), image, buffer, palette, image.position(), image.limit(), options);
+            if (!isSuccess(returnCode)) {
                 return null;
             }
+
+            final Bitmap output = Bitmap.wrapHardwareBuffer(buffer, null);
+            if (output == null) {
+                noHardwareR8 = true;
+                return failure(ERROR_UNSUPPORTED);
+            }
+
+            return toIndexedResult(returnCode, output, palette, 0);
+        } catch (IllegalArgumentException e) {
+            noHardwareR8 = true;
+            return failure(ERROR_UNSUPPORTED);
         } finally {
             Trace.endSection();
+            reachabilityFence(context);
+        }
+    }
+
+    private static void checkIndexedOutput(Bitmap output) {
+        if (output.getConfig() != Bitmap.Config.ALPHA_8 || !output.isMutable()) {
+            throw new IllegalArgumentException();
         }
+    }
 
+    private static @Nullable DecodingResult toIndexedResult(int returnCode, Bitmap output, byte[] palette, int packedWidth) {
+        if (!isSuccess(returnCode)) {
+            return null;
+        }
 
-        output.setPremultiplied(false);
+        // HARDWARE Bitmaps are immutable, they are created with correct flags
+        if (output.isMutable()) {
+            output.setPremultiplied(false);
+        }
 
         final ByteBuffer wrapped = ByteBuffer.wrap(palette);
         final int count = ceilingPowerOf2(getPaletteSize(wrapped));
         wrapped.limit(count * 4);
 
-        return new DecodingResult(output, wrapped, returnCode);
+        return new DecodingResult(output, wrapped, returnCode, packedWidth);
+    }
+
+    /**
+     * Decode PNG image of any color type to ARGB_8888 Bitmap (with premultiplied alpha).
+     *
+     * <p>This is slower and uses more memory than {@link #decodeIndexed}, but still avoids the overhead of
+     * {@link android.graphics.BitmapFactory} for images, that can not be represented by ALPHA_8 Bitmap.
+     *
+     * @param image buffer with image data
+     * @param output mutable ARGB_8888 Bitmap object that will be populated with decoded image contents
+     *
+     * @return {@link DecodingResult} with empty palette or null in case of failure
+     */
+    public static @Nullable DecodingResult decodeRgba(@NonNull ByteBuffer image, @NonNull Bitmap output) {
+        return decodeRgba(0, image, output, 0);
+    }
+
+    /**
+     * Same as {@link #decodeRgba(ByteBuffer, Bitmap)}, but reuses decoder state and native buffers,
+     * owned by supplied {@link Context}.
+     *
+     * @param context decoder context, that must not be concurrently used by other threads
+     * @param image buffer with image data
+     * @param output mutable ARGB_8888 Bitmap object that will be populated with decoded image contents
+     *
+     * @return {@link DecodingResult} with empty palette or null in case of failure
+     */
+    public static @Nullable DecodingResult decodeRgba(@NonNull Context context, @NonNull ByteBuffer image, @NonNull Bitmap output) {
+        return decodeRgba(context, image, output, 0);
+    }
+
+    /**
+     * Same as {@link #decodeRgba(Context, ByteBuffer, Bitmap)}, with decoding options. Only
+     * {@link #OPTION_TRUSTED_SOURCE} applies to ARGB output.
+     *
+     * @param context decoder context, that must not be concurrently used by other threads
+     * @param image buffer with image data
+     * @param output mutable ARGB_8888 Bitmap object that will be populated with decoded image contents
+     * @param options decoding options
+     *
+     * @return {@link DecodingResult} with empty palette or null in case of failure
+     */
+    public static @Nullable DecodingResult decodeRgba(@NonNull Context context, @NonNull ByteBuffer image, @NonNull Bitmap output, int options) {
+        try {
+            return decodeRgba(context.getHandle(), image, output, options);
+        } finally {
+            reachabilityFence(context);
+        }
+    }
+
+    private static @Nullable DecodingResult decodeRgba(long context, ByteBuffer image, Bitmap output, int options) {
+        if (output.getConfig() != Bitmap.Config.ARGB_8888 || !output.isMutable()) {
+            throw new IllegalArgumentException();
+        }
+        if (!image.isDirect() || !image.hasRemaining()) {
+            throw new IllegalArgumentException();
+        }
+
+        final int returnCode;
+
+        Trace.beginSection("decodeRgba");
+        try {
+            returnCode = decodeRgba(context, image, output, image.position(), image.limit(), options);
+            if (!isSuccess(returnCode)) {
+                return null;
+            }
+        } finally {
+            Trace.endSection();
+        }
+
+        output.setHasAlpha((returnCode & FLAG_OPAQUE) == 0);
+
+        return new DecodingResult(output, EMPTY_PALETTE, returnCode, 0);
+    }
+
+    /**
+     * Decode multiple images in parallel on library's own thread pool.
+     *
+     * @see #decodeBatch(List, int, Executor)
+     */
+    public static @NonNull List<Future<DecodingResult>> decodeBatch(@NonNull List<ByteBuffer> images, int options) {
+        return decodeBatch(images, options, BatchExecutor.INSTANCE);
+    }
+
+    /**
+     * Decode multiple images in parallel, for example to prefetch all icons of a screen before it is shown.
+     *
+     * <p>Each image is decoded by a separate task, submitted to supplied Executor. Every thread uses it's own
+     * {@link Context}, so the decoder state is never shared between threads. The buffers themselves are not
+     * modified and may be reused by caller once corresponding Future completes.
+     *
+     * @param images buffers with image data, one per image
+     * @param options decoding options, same as for {@link #decodeIndexed(ByteBuffer, Bitmap, int)}
+     * @param executor Executor for running decoding tasks
+     *
+     * @return Futures in the same order as images, each yielding {@link DecodingResult} with new ALPHA_8 Bitmap
+     * or null if the image could not be decoded to it
+     */
+    public static @NonNull List<Future<DecodingResult>> decodeBatch(@NonNull List<ByteBuffer> images, int options, @NonNull Executor executor) {
+        final List<Future<DecodingResult>> results = new ArrayList<>(images.size());
+
+        for (ByteBuffer image : images) {
+            final FutureTask<DecodingResult> task = new FutureTask<>(new BatchTask(image.duplicate(), options));
+            results.add(task);
+            executor.execute(task);
+        }
+
+        return results;
+    }
+
+    /**
+     * Reason of the latest failed decoding on calling thread. Methods of this class only return null (or false)
+     * in case of failure, this is how to find out why, e.g. to tell, which images end up decoded by platform decoders.
+     * Not reset by successful decoding.
+     *
+     * @return one of {@code ERROR_*} constants, {@link #ERROR_NONE} if no decoding has failed on this thread yet
+     */
+    public static @DecodingError int getLastError() {
+        return lastError.get()[0];
+    }
+
+    static void setLastError(@DecodingError int error) {
+        lastError.get()[0] = error;
+    }
+
+    private static @Nullable DecodingResult failure(@DecodingError int error) {
+        setLastError(error);
+        return null;
+    }
+
+    // failures are reported by native code as ERROR_* code in the highest byte
+    private static boolean isSuccess(int returnCode) {
+        if ((returnCode & SUCCESS_MASK) != 0) {
+            return true;
+        }
+        setLastError(returnCode >>> ERROR_SHIFT);
+        return false;
+    }
+
+    /**
+     * @return snapshot of process-wide decoding statistics, accumulated since the library was loaded
+     */
+    public static @NonNull Stats getStats() {
+        load();
+
+        final long[] values = new long[STATS_FIELDS];
+        getStats(values);
+        return new Stats(values);
+    }
+
+    /**
+     * @return library's own thread pool, used by {@link #decodeBatch(List, int)}
+     */
+    static @NonNull Executor getBatchExecutor() {
+        return BatchExecutor.INSTANCE;
+    }
+
+    /**
+     * @return {@link Context}, that belongs to the calling thread (used by the library itself)
+     */
+    /**
+     * Keep object, that owns native memory, reachable until this point. Without it, the object may become
+     * unreachable (and be finalized, freeing the memory) as soon as it's handle has been read, while
+     * native code is still using it. {@code Reference.reachabilityFence} only exists since API 28,
+     * this relies on finalizers of {@link Context} and {@link Animation} synchronizing on the same object.
+     */
+    static void reachabilityFence(@NonNull Object owner) {
+        synchronized (owner) {
+            // nothing to do, the lock itself is the fence
+        }
+    }
+
+    static @NonNull Context getThreadContext() {
+        return threadContext.get();
     }
 
     private static int ceilingPowerOf2(int x) {
         return 1 << -Integer.numberOfLeadingZeros(x - 1);
     }
 
+    private static final class BatchTask implements Callable<DecodingResult> {
+        private final ByteBuffer image;
+        private final int options;
+
+        BatchTask(ByteBuffer image, int options) {
+            this.image = image;
+            this.options = options;
+        }
+
+        @Override
+        public DecodingResult call() {
+            final PngHeaderInfo headerInfo = getImageInfo(image);
+            if (headerInfo == null || !headerInfo.isPaletteOrGreyscale()) {
+                return null;
+            }
+
+            final Bitmap bitmap = Bitmap.createBitmap(headerInfo.width, headerInfo.height, Bitmap.Config.ALPHA_8);
+
+            final DecodingResult result = decodeIndexed(getThreadContext(), image, bitmap, options);
+            if (result == null) {
+                bitmap.recycle();
+            }
+            return result;
+        }
+    }
+
+    // Decoding is CPU-bound, so there is no point in having more threads than there are fast cores.
+    // Most devices have 2-4 "big" cores, the rest of them are too slow to help much
+    private static final class BatchExecutor {
+        private static final int POOL_SIZE = Math.max(2, Math.min(4, Runtime.getRuntime().availableProcessors() / 2));
+
+        static final ThreadPoolExecutor INSTANCE = new ThreadPoolExecutor(POOL_SIZE, POOL_SIZE,
+                5, TimeUnit.SECONDS, new LinkedBlockingQueue<Runnable>(), new BatchThreadFactory());
+
+        static {
+            // idle threads exit along with their decoder contexts
+            INSTANCE.allowCoreThreadTimeOut(true);
+        }
+    }
+
+    private static final class BatchThreadFactory implements ThreadFactory {
+        private final AtomicInteger counter = new AtomicInteger();
+
+        @Override
+        public Thread newThread(Runnable r) {
+            final Thread thread = new Thread(r, "png-decoder-" + counter.incrementAndGet());
+            thread.setDaemon(true);
+            return thread;
+        }
+    }
+
+    /**
+     * Reusable decoder state: an instance of Wuffs decoder along with work and staging buffers.
+     *
+     * <p>The buffers grow to accommodate the biggest image decoded so far and are never shrunk
+     * automatically, so decoding many images with the same Context does not cause repeated native
+     * allocations. Use {@link #trim} to release them.
+     *
+     * <p>Context is not thread-safe: create one per thread and don't share it between threads.
+     */
+    public static final class Context implements Closeable {
+        private long handle;
+
+        public Context() {
+            load();
+
+            handle = createContext();
+            if (handle == 0) {
+                throw new OutOfMemoryError();
+            }
+        }
+
+        /**
+         * Release native buffers, owned by this Context, without destroying it.
+         */
+        public void trim() {
+            try {
+                trimContext(getHandle());
+            } finally {
+                reachabilityFence(this);
+            }
+        }
+
+        @Override
+        public void close() {
+            if (handle != 0) {
+                destroyContext(handle);
+                handle = 0;
+            }
+        }
+
+        long getHandle() {
+            if (handle == 0) {
+                throw new IllegalStateException("Context is closed");
+            }
+            return handle;
+        }
+
+        @Override
+        protected void finalize() throws Throwable {
+            try {
+                // pairs with reachabilityFence
+                synchronized (this) {
+                    close();
+                }
+            } finally {
+                super.finalize();
+            }
+        }
+    }
+
     public static final class DecodingResult {
         public final Bitmap bitmap;
         public final ByteBuffer palette;
         private final int flags;
+        private final int packedWidth;
 
-        DecodingResult(Bitmap bitmap, ByteBuffer palette, int flags) {
+        DecodingResult(Bitmap bitmap, ByteBuffer palette, int flags, int packedWidth) {
             this.bitmap = bitmap;
             this.palette = palette;
             this.flags = flags;
+            this.packedWidth = packedWidth;
         }
 
         public boolean decodedAsMask() {
@@ -180,6 +1002,44 @@ public final class PngDecoder {
             return (flags & FLAG_CONVERTED_TO_GREY) != 0;
         }
 
+        public boolean decodedAsRgba() {
+            return (flags & FLAG_CONVERTED_TO_RGBA) != 0;
+        }
+
+        /**
+         * @return true if several pixels are packed in each byte of Bitmap (see {@link #OPTION_PACK_INDICES})
+         */
+        public boolean isPacked() {
+            return getBitsPerIndex() != 8;
+        }
+
+        /**
+         * @return size of palette index in bits: 1, 2 or 4 for packed images and 8 otherwise
+         */
+        public int getBitsPerIndex() {
+            final int bits = (flags >> PACKED_BITS_SHIFT) & 0xF;
+            return bits == 0 ? 8 : bits;
+        }
+
+        /**
+         * Bits per sample of the PNG image itself. 1, 2 and 4-bit images are widened to 8-bit Bitmap unless
+         * packed, and 16-bit greyscale images are narrowed to 8 bits, so this is how much precision the Bitmap
+         * actually carries. Callers can use it to e.g. choose {@link #OPTION_PACK_INDICES} for later decodes
+         * of the same image.
+         *
+         * @return bit depth of source image or 0 if it is unknown
+         */
+        public int getSourceBitDepth() {
+            return (flags >> SOURCE_DEPTH_SHIFT) & 0xFF;
+        }
+
+        /**
+         * @return width of decoded image in pixels, which is bigger than the width of Bitmap for packed images
+         */
+        public int getWidth() {
+            return packedWidth != 0 ? packedWidth : bitmap.getWidth();
+        }
+
         public boolean isOpaque() {
             return (flags & FLAG_OPAQUE) != 0;
         }
@@ -189,13 +1049,294 @@ public final class PngDecoder {
         }
     }
 
+    /**
+     * Frame-by-frame decoder of animated PNG (APNG) images with indexed color or greyscale, that backs
+     * {@link IndexedAnimatedDrawable}. Each frame is composed over the previous ones right in the output
+     * Bitmap (dispose and blend operations are applied in place), so only the area of the frame is decoded
+     * and the Bitmap keeps 1 byte per pixel. Non-animated images are treated as single-frame animations.
+     *
+     * <p>Frames are decoded in order, the first one also fills the palette. After the last frame the animation
+     * loops back to the first one, it is up to the caller to count loops (see {@link #getLoopCount}).
+     *
+     * <p>Native decoder reads the image buffer for the lifetime of the Animation, so it's contents must not
+     * be changed. Animation is not thread-safe.
+     */
+    public static final class Animation implements Closeable {
+        private final ByteBuffer image;
+        private final int width, height, loopCount, frameCount;
+        private final byte[] palette;
+        private final int[] frameInfo = new int[FRAME_FIELDS];
+
+        private long handle;
+        private int flags;
+
+        private Animation(ByteBuffer image, long handle, byte[] palette, int[] info) {
+            this.image = image;
+            this.handle = handle;
+            this.palette = palette;
+            this.width = info[0];
+            this.height = info[1];
+            this.loopCount = info[2];
+            this.frameCount = info[3];
+        }
+
+        /**
+         * @param image buffer with image data, that must be kept unchanged while the Animation is in use
+         *
+         * @return new Animation or null if the image is not an indexed or greyscale PNG or can not be decoded
+         */
+        public static @Nullable Animation open(@NonNull ByteBuffer image) {
+            if (!image.isDirect() || !image.hasRemaining()) {
+                throw new IllegalArgumentException();
+            }
+
+            load();
+
+            final byte[] palette = new byte[256 * 4];
+            final int[] info = new int[ANIMATION_FIELDS];
+
+            final long handle = openAnimation(image, palette, image.position(), image.limit(), info);
+
+            return handle == 0 ? null : new Animation(image, handle, palette, info);
+        }
+
+        /**
+         * Compose the next frame over the current contents of canvas. Use the same (mutable ALPHA_8) Bitmap
+         * for all frames of the image.
+         *
+         * @return true if the frame was decoded, in which case {@link #getDirtyRect} returns the changed area
+         */
+        public boolean decodeNextFrame(@NonNull Bitmap canvas) {
+            checkIndexedOutput(canvas);
+
+            final int returnCode;
+
+            Trace.beginSection("decodeFrame");
+            try {
+                returnCode = decodeFrame(getHandle(), image, canvas, palette, image.position(), image.limit(), frameInfo);
+            } finally {
+                Trace.endSection();
+                reachabilityFence(this);
+            }
+
+            if (!isSuccess(returnCode)) {
+                return false;
+            }
+
+            flags = returnCode;
+            return true;
+        }
+
+        public int getWidth() {
+            return width;
+        }
+
+        public int getHeight() {
+            return height;
+        }
+
+        /**
+         * @return number of frames, declared by the image (1 for images, that are not animated)
+         */
+        public int getFrameCount() {
+            return frameCount;
+        }
+
+        /**
+         * @return how many times the animation should be played, 0 for infinite
+         */
+        public int getLoopCount() {
+            return loopCount;
+        }
+
+        /**
+         * @return index of the last decoded frame
+         */
+        public int getFrameIndex() {
+            return frameInfo[5];
+        }
+
+        /**
+         * @return how long the last decoded frame should be shown, in milliseconds
+         */
+        public int getFrameDuration() {
+            return frameInfo[0];
+        }
+
+        /**
+         * @param out receives the area of canvas, changed by the last decoded frame (including disposal of
+         *            the previous one); the whole canvas for the first frame
+         */
+        public void getDirtyRect(@NonNull Rect out) {
+            out.set(frameInfo[1], frameInfo[2], frameInfo[3], frameInfo[4]);
+        }
+
+        public boolean decodedAsGreyscale() {
+            return (flags & FLAG_CONVERTED_TO_GREY) != 0;
+        }
+
+        public boolean isOpaque() {
+            return (flags & FLAG_OPAQUE) != 0;
+        }
+
+        /**
+         * @return premultiplied RGBA palette (empty for greyscale images), filled by the first frame
+         */
+        public @NonNull ByteBuffer getPalette() {
+            if (decodedAsGreyscale()) {
+                return EMPTY_PALETTE;
+            }
+
+            final ByteBuffer wrapped = ByteBuffer.wrap(palette);
+            wrapped.limit(ceilingPowerOf2(getPaletteSize(wrapped)) * 4);
+            return wrapped;
+        }
+
+        @Override
+        public void close() {
+            if (handle != 0) {
+                closeAnimation(handle);
+                handle = 0;
+            }
+        }
+
+        /**
+         * @return true if {@link #close} has been called, after which frames can not be decoded
+         */
+        public boolean isClosed() {
+            return handle == 0;
+        }
+
+        private long getHandle() {
+            if (handle == 0) {
+                throw new IllegalStateException("Animation is closed");
+            }
+            return handle;
+        }
+
+        @Override
+        protected void finalize() throws Throwable {
+            try {
+                // pairs with reachabilityFence
+                synchronized (this) {
+                    close();
+                }
+            } finally {
+                super.finalize();
+            }
+        }
+    }
+
+    /**
+     * Counters of native decoder, shared by all threads and Contexts.
+     *
+     * <p>Time of each decoding stage is also visible as separate trace section (see {@link android.os.Trace}),
+     * and the number of decoded bytes along with size of native buffers are published as trace counters
+     * on Android 10 and above, so the same data can be seen in system traces.
+     */
+    public static final class Stats {
+        /**
+         * Number of successful and failed decoding attempts. Callers, such as {@link PngSupport}, fall back
+         * to platform decoders after failure, so the latter is effectively the number of fallbacks.
+         */
+        public final long decodes, fallbacks;
+
+        /**
+         * Total size of decoded pixels and current size of native buffers, owned by all {@link Context}s
+         */
+        public final long bytesDecoded, bufferBytes;
+
+        /**
+         * Cumulative time of decoding stages in nanoseconds: parsing of image header, allocation of native buffers,
+         * decompression, handing the palette to Java, conversion to alpha mask and Bitmap locking/unlocking
+         */
+        public final long configNanos, allocationNanos, inflateNanos, paletteNanos, maskNanos, lockNanos;
+
+        private final long[] failures;
+
+        Stats(long[] values) {
+            decodes = values[0];
+            fallbacks = values[1];
+            bytesDecoded = values[2];
+            bufferBytes = values[3];
+            configNanos = values[4];
+            allocationNanos = values[5];
+            inflateNanos = values[6];
+            paletteNanos = values[7];
+            maskNanos = values[8];
+            lockNanos = values[9];
+            failures = Arrays.copyOfRange(values, STATS_STAGES, STATS_FIELDS);
+        }
+
+        /**
+         * @return number of failed decoding attempts with given reason, all of them add up to {@link #fallbacks}
+         */
+        public long getFailures(@DecodingError int error) {
+            return failures[error];
+        }
+
+        @Override
+        public String toString() {
+            return "Stats{decodes=" + decodes + ", fallbacks=" + fallbacks
+                    + ", bytesDecoded=" + bytesDecoded + ", bufferBytes=" + bufferBytes
+                    + ", configNanos=" + configNanos + ", allocationNanos=" + allocationNanos
+                    + ", inflateNanos=" + inflateNanos + ", paletteNanos=" + paletteNanos
+                    + ", maskNanos=" + maskNanos + ", lockNanos=" + lockNanos
+                    + ", failures=" + Arrays.toString(failures) + '}';
+        }
+    }
+
     public static final class PngHeaderInfo {
         public final int width, height, flags;
 
+        /**
+         * Bit depth of image samples, as stated in PNG header (0 if PngHeaderInfo was created by user).
+         */
+        public final int bitDepth;
+
+        /**
+         * Extended information, only available from {@link #probe}. These fields are 0 otherwise.
+         * The size of work buffer is the amount of native memory, needed to decode the image
+         * (besides the memory for decoded image itself).
+         */
+        public final int paletteSize, workBufferSize;
+
+        private final int probeFlags;
+
         public PngHeaderInfo(int width, int height, int flags) {
+            this(width, height, flags, 0, 0, 0, 0);
+        }
+
+        PngHeaderInfo(int width, int height, int flags, int bitDepth, int paletteSize, int probeFlags, int workBufferSize) {
             this.width = width;
             this.height = height;
             this.flags = flags;
+            this.bitDepth = bitDepth;
+            this.paletteSize = paletteSize;
+            this.probeFlags = probeFlags;
+            this.workBufferSize = workBufferSize;
+        }
+
+        /**
+         * @return true if the image has tRNS chunk (only available from {@link #probe})
+         */
+        public boolean hasTransparencyChunk() {
+            return (probeFlags & PROBE_FLAG_TRANSPARENCY) != 0;
+        }
+
+        /**
+         * @return true if the image is interlaced (only available from {@link #probe})
+         */
+        public boolean isInterlaced() {
+            return (probeFlags & PROBE_FLAG_INTERLACED) != 0;
+        }
+
+        /**
+         * @return false if the image can not be decoded by this library, for example because it's IHDR chunk
+         * is not the first one (only available from {@link #probe})
+         */
+        public boolean isDecodable() {
+            return (probeFlags & PROBE_FLAG_DECODABLE) != 0;
         }
 
         public boolean isIndexed() {
@@ -230,5 +1371,39 @@ public final class PngDecoder {
         return 1;
     }
 
-    private static native int decode(ByteBuffer buffer, Bitmap imageBitmap, byte[] palette, int pos, int end, int options);
+    private static native int probe(long context, ByteBuffer[] buffers, int[] ranges, int[] info);
+
+    private static native void getStats(long[] stats);
+
+    private static native long createContext();
+
+    private static native void trimContext(long context);
+
+    private static native void destroyContext(long context);
+
+    private static native int decode(long context, ByteBuffer buffer, Bitmap imageBitmap, byte[] palette, int pos, int end, int options);
+
+    private static native int decodeRegion(long context, ByteBuffer buffer, Bitmap imageBitmap, byte[] palette, int pos, int end, int options,
+                                           int left, int top, int right, int bottom, int sampleSize);
+
+    private static native int decodeRgba(long context, ByteBuffer buffer, Bitmap imageBitmap, int pos, int end, int options);
+
+    private static native int decodeHardware(long context, ByteBuffer buffer, HardwareBuffer hardwareBuffer, byte[] palette, int pos, int end, int options);
+
+    private static native int decodeFd(long context, int fd, long offset, long length, Bitmap imageBitmap, byte[] palette, int options);
+
+    private static native int decodeChannel(long context, ReadableByteChannel channel, Bitmap imageBitmap, byte[] palette, int options) throws IOException;
+
+    private static native long openAnimation(ByteBuffer buffer, byte[] palette, int pos, int end, int[] info);
+
+    private static native int decodeFrame(long animation, ByteBuffer buffer, Bitmap imageBitmap, byte[] palette, int pos, int end, int[] info);
+
+    private static native void closeAnimation(long animation);
+
+    // called from native code to fill the input buffer of decodeChannel
+    private static int readChannel(ReadableByteChannel channel, ByteBuffer buffer, int position, int limit) throws IOException {
+        buffer.limit(limit);
+        buffer.position(position);
+        return channel.read(buffer);
+    }
 }
@@ -15,9 +15,12 @@
  */
 package org.bitmapdecoder;
 
+import android.content.ComponentCallbacks2;
 import android.content.Context;
 import android.content.res.*;
 import android.graphics.Canvas;
+import android.graphics.Matrix;
+import android.graphics.Paint;
 import android.graphics.drawable.Drawable;
 import android.os.Build;
 import android.util.AttributeSet;
@@ -26,6 +29,8 @@ import android.util.TypedValue;
 import android.widget.ImageView;
 import androidx.annotation.NonNull;
 import androidx.annotation.Nullable;
+import org.bitmapdecoder.PngDecoder.DecodingResult;
+import org.bitmapdecoder.PngDecoder.PngHeaderInfo;
 
 import java.io.IOException;
 import java.nio.ByteBuffer;
@@ -43,13 +48,56 @@ import java.nio.ByteBuffer;
  *
  * In addition, PngImageView will fall back to ordinary Drawables if the supplied drawable does not belong to one of
  * supported formats.
+ *
+ * <p>Large indexed and greyscale images are first shown as subsampled preview, which is decoded right away,
+ * and replaced once the image is decoded in background at the coarsest sample size, that still covers the size
+ * of the view, so that the view never holds more pixels than it can show (the image is decoded in full only when
+ * the view is as big as it). While the window is not visible, the fitted image is given up under memory pressure
+ * (keeping the preview) and decoded again when it becomes visible.
  */
 public class PngImageView extends ImageView {
     private static final String TAG = "pngs";
 
+    // images with more pixels are shown as preview until decoded to fit the view
+    private static final int LARGE_IMAGE_PIXELS = 1024 * 1024;
+
+    // longest side of preview
+    private static final int PREVIEW_SIZE = 256;
+
+    private final ComponentCallbacks2 memoryCallbacks = new ComponentCallbacks2() {
+        @Override
+        public void onTrimMemory(int level) {
+            if (level >= TRIM_MEMORY_RUNNING_LOW && getWindowVisibility() != VISIBLE) {
+                dropFittedImage();
+            }
+        }
+
+        @Override
+        public void onConfigurationChanged(@NonNull Configuration newConfig) {
+        }
+
+        @Override
+        public void onLowMemory() {
+            onTrimMemory(TRIM_MEMORY_COMPLETE);
+        }
+    };
+
     private int pendingResId;
     private boolean swCanvasWarned;
 
+    // large image, currently shown as preview or fitted to the view, null otherwise
+    private ByteBuffer largeImage;
+    private PngHeaderInfo largeImageInfo;
+    private Drawable preview;
+    private int previewSampleSize;
+    private boolean decodingFittedImage;
+
+    // sample size of the shown fitted image, 0 if the preview is shown
+    private int fittedSampleSize;
+
+    // changed with every new image, so that decoding of replaced one is ignored
+    private int generation;
+
     public PngImageView(@NonNull Context context) {
         super(context);
     }
@@ -83,10 +131,19 @@ public class PngImageView extends ImageView {
         }
     }
 
+    @Override
+    public void setImageDrawable(@Nullable Drawable drawable) {
+        forgetLargeImage();
+
+        super.setImageDrawable(drawable);
+    }
+
     @Override
     protected void onAttachedToWindow() {
         super.onAttachedToWindow();
 
+        getContext().getApplicationContext().registerComponentCallbacks(memoryCallbacks);
+
         final int pendingResId = this.pendingResId;
         if (pendingResId != 0) {
             this.pendingResId = 0;
@@ -94,6 +151,29 @@ public class PngImageView extends ImageView {
         }
     }
 
+    @Override
+    protected void onDetachedFromWindow() {
+        super.onDetachedFromWindow();
+
+        getContext().getApplicationContext().unregisterComponentCallbacks(memoryCallbacks);
+    }
+
+    @Override
+    protected void onWindowVisibilityChanged(int visibility) {
+        super.onWindowVisibilityChanged(visibility);
+
+        if (visibility == VISIBLE) {
+            decodeFittedImage();
+        }
+    }
+
+    @Override
+    protected void onSizeChanged(int w, int h, int oldw, int oldh) {
+        super.onSizeChanged(w, h, oldw, oldh);
+
+        decodeFittedImage();
+    }
+
     @Override
     protected void onDraw(Canvas canvas) {
         if (!swCanvasWarned && !canvas.isHardwareAccelerated()) {
@@ -105,6 +185,8 @@ public class PngImageView extends ImageView {
     }
 
     protected void resolveResource(int resId) {
+        forgetLargeImage();
+
         if (isInEditMode() || !isHardwareAccelerated()) {
             super.setImageResource(resId);
             return;
@@ -132,6 +214,17 @@ public class PngImageView extends ImageView {
 
         try (AssetFileDescriptor stream = am.openNonAssetFd(value.assetCookie, imageFile)) {
             final ByteBuffer buffer = PngSupport.loadIndexedPng(stream);
+
+            final PngHeaderInfo headerInfo = getLargeImageInfo(buffer);
+            if (headerInfo != null) {
+                final int previewSampleSize = getPreviewSampleSize(headerInfo);
+                final Drawable preview = decodeSampled(buffer, headerInfo, previewSampleSize);
+                if (preview != null) {
+                    showPreview(buffer, headerInfo, previewSampleSize, preview);
+                    return;
+                }
+            }
+
             final Drawable decoded = PngSupport.getDrawable(buffer, 0);
             if (decoded != null) {
                 super.setImageDrawable(decoded);
@@ -148,4 +241,153 @@ public class PngImageView extends ImageView {
         return !filename.endsWith(".9.png");
     }
 
+    // header of indexed or greyscale image, big enough to be shown as preview first, null otherwise
+    private static @Nullable PngHeaderInfo getLargeImageInfo(ByteBuffer buffer) {
+        final PngHeaderInfo headerInfo = PngDecoder.getImageInfo(buffer);
+        if (headerInfo == null || !headerInfo.isPaletteOrGreyscale()
+                || (long) headerInfo.width * headerInfo.height <= LARGE_IMAGE_PIXELS) {
+            return null;
+        }
+        return headerInfo;
+    }
+
+    private static int getPreviewSampleSize(PngHeaderInfo headerInfo) {
+        int sampleSize = 1;
+        while (Math.max(headerInfo.width, headerInfo.height) > PREVIEW_SIZE * sampleSize) {
+            sampleSize *= 2;
+        }
+        return sampleSize;
+    }
+
+    // largest sample size, at which the image is still at least as big as the view in both dimensions
+    private static int getFittedSampleSize(PngHeaderInfo headerInfo, int width, int height) {
+        int sampleSize = 1;
+        while (headerInfo.width / (sampleSize * 2) >= width && headerInfo.height / (sampleSize * 2) >= height) {
+            sampleSize *= 2;
+        }
+        return sampleSize;
+    }
+
+    // subsampled version of large indexed or greyscale image, stretched back to it's full size
+    private static @Nullable Drawable decodeSampled(ByteBuffer buffer, PngHeaderInfo headerInfo, int sampleSize) {
+        if (sampleSize == 1) {
+            return PngSupport.getDrawable(buffer, PngDecoder.OPTION_TRUSTED_SOURCE);
+        }
+
+        final int options = PngDecoder.OPTION_TRUSTED_SOURCE | PngDecoder.DEFAULT_DECODER_FLAGS;
+
+        final DecodingResult result = PngSupport.decodeIndexed(buffer, headerInfo, options, sampleSize);
+        if (result == null) {
+            return null;
+        }
+
+        final Paint paint = PngSupport.createPaint(result, result.bitmap, options);
+        if (paint == null) {
+            PngSupport.releaseBitmap(result.bitmap);
+            return null;
+        }
+
+        final Matrix matrix = new Matrix();
+        matrix.setScale(sampleSize, sampleSize);
+        paint.getShader().setLocalMatrix(matrix);
+
+        return new ShaderDrawable(paint, headerInfo.width, headerInfo.height, result);
+    }
+
+    private void showPreview(ByteBuffer buffer, PngHeaderInfo headerInfo, int previewSampleSize, Drawable preview) {
+        super.setImageDrawable(preview);
+
+        this.largeImage = buffer;
+        this.largeImageInfo = headerInfo;
+        this.preview = preview;
+        this.previewSampleSize = previewSampleSize;
+
+        decodeFittedImage();
+    }
+
+    private void forgetLargeImage() {
+        ++generation;
+
+        largeImage = null;
+        largeImageInfo = null;
+        preview = null;
+        fittedSampleSize = 0;
+        decodingFittedImage = false;
+    }
+
+    private void decodeFittedImage() {
+        if (largeImage == null || decodingFittedImage || getWindowVisibility() != VISIBLE) {
+            return;
+        }
+
+        final int width = getWidth() - getPaddingLeft() - getPaddingRight();
+        final int height = getHeight() - getPaddingTop() - getPaddingBottom();
+        if (width <= 0 || height <= 0) {
+            // not laid out yet, onSizeChanged comes later
+            return;
+        }
+
+        final int sampleSize = getFittedSampleSize(largeImageInfo, width, height);
+        if (sampleSize >= previewSampleSize) {
+            // the view is small enough for the preview
+            dropFittedImage();
+            return;
+        }
+
+        if (sampleSize == fittedSampleSize) {
+            return;
+        }
+
+        decodingFittedImage = true;
+
+        final ByteBuffer image = largeImage.duplicate();
+        final PngHeaderInfo headerInfo = largeImageInfo;
+        final int requested = generation;
+
+        PngDecoder.getBatchExecutor().execute(new Runnable() {
+            @Override
+            public void run() {
+                final Drawable decoded = decodeSampled(image, headerInfo, sampleSize);
+
+                post(new Runnable() {
+                    @Override
+                    public void run() {
+                        onFittedImageDecoded(requested, sampleSize, decoded);
+                    }
+                });
+            }
+        });
+    }
+
+    void onFittedImageDecoded(int requested, int sampleSize, @Nullable Drawable decoded) {
+        if (requested != generation) {
+            return;
+        }
+
+        decodingFittedImage = false;
+
+        if (decoded == null) {
+            // stay with the preview, instead of decoding the image over and over
+            Log.w(TAG, PngSupport.ERROR_CODE_DECODING_FAILED);
+            largeImage = null;
+            return;
+        }
+
+        fittedSampleSize = sampleSize;
+        super.setImageDrawable(decoded);
+
+        // the view may have been resized while decoding
+        decodeFittedImage();
+    }
+
+    // the preview remains, the fitted image is decoded again once the window becomes visible
+    void dropFittedImage() {
+        if (fittedSampleSize == 0) {
+            return;
+        }
+
+        fittedSampleSize = 0;
+        super.setImageDrawable(preview);
+    }
+
 }
@@ -0,0 +1,416 @@
+/*
+ * Copyright 2023 Alexander Rvachev.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+package org.bitmapdecoder;
+
+import android.content.Context;
+import android.content.res.*;
+import android.graphics.*;
+import android.os.Build;
+import android.util.AttributeSet;
+import android.util.Log;
+import android.util.SparseArray;
+import android.util.TypedValue;
+import android.view.GestureDetector;
+import android.view.MotionEvent;
+import android.view.View;
+import android.widget.OverScroller;
+import androidx.annotation.NonNull;
+import androidx.annotation.Nullable;
+import org.bitmapdecoder.PngDecoder.DecodingResult;
+import org.bitmapdecoder.PngDecoder.PngHeaderInfo;
+
+import java.io.IOException;
+import java.nio.ByteBuffer;
+import java.util.concurrent.Executor;
+import java.util.concurrent.LinkedBlockingQueue;
+import java.util.concurrent.ThreadFactory;
+import java.util.concurrent.ThreadPoolExecutor;
+import java.util.concurrent.TimeUnit;
+
+/**
+ * A scrollable View for indexed and greyscale PNG images, that are too big to be decoded at once, such as maps
+ * and tile sheets. The image is split into square tiles, that are decoded in background with
+ * {@link PngDecoder#decodeRegion} when they scroll into view and dropped once they scroll out of it,
+ * so only the visible part of image is kept in memory.
+ *
+ * <p>The image is drawn at 1:1 scale and can be scrolled by dragging and flinging. Set it with {@code app:src}
+ * attribute (referring to raw or drawable resource) or {@link #setImage}.
+ *
+ * <p>Tiles are drawn with {@link PaletteShader} where available. On older Android versions tiles of images, that
+ * can not be drawn as alpha mask or greyscale, are expanded to ARGB_8888 Bitmaps.
+ */
+public class PngRegionView extends View {
+    private static final String TAG = "pngs";
+
+    private static final int TILE_SIZE = 512;
+
+    private static final Executor tileExecutor = createExecutor();
+
+    private final SparseArray<Tile> tiles = new SparseArray<>();
+
+    private final Rect visibleTiles = new Rect();
+
+    private final OverScroller scroller;
+    private final GestureDetector gestureDetector;
+
+    private ByteBuffer image;
+    private int imageWidth, imageHeight, columns;
+
+    public PngRegionView(@NonNull Context context) {
+        this(context, null);
+    }
+
+    public PngRegionView(@NonNull Context context, @Nullable AttributeSet attrs) {
+        this(context, attrs, 0);
+    }
+
+    public PngRegionView(@NonNull Context context, @Nullable AttributeSet attrs, int defStyleAttr) {
+        super(context, attrs, defStyleAttr);
+
+        scroller = new OverScroller(context);
+        gestureDetector = new GestureDetector(context, new ScrollListener());
+
+        TypedArray ta = context.obtainStyledAttributes(attrs, R.styleable.PngRegionView, defStyleAttr, 0);
+        try {
+            int srcResId = ta.getResourceId(R.styleable.PngRegionView_src, 0);
+            if (srcResId != 0 && !isInEditMode()) {
+                setImageResource(srcResId);
+            }
+        } finally {
+            ta.recycle();
+        }
+    }
+
+    /**
+     * Display PNG image from resources, see {@link #setImage}.
+     */
+    public void setImageResource(int resId) {
+        final Resources resources = getResources();
+
+        final TypedValue value = PngSupport.loadValue(resources, resId);
+        if (value.string == null) {
+            throw new IllegalArgumentException(PngSupport.ERROR_CODE_BAD_ATTRIBUTE);
+        }
+
+        try (AssetFileDescriptor stream = resources.getAssets().openNonAssetFd(value.assetCookie, value.string.toString())) {
+            setImage(PngSupport.loadIndexedPng(stream));
+        } catch (IOException e) {
+            throw new IllegalArgumentException(PngSupport.ERROR_CODE_DECODING_FAILED, e);
+        }
+    }
+
+    /**
+     * Display indexed or greyscale PNG image. The buffer is read from background threads for as long as the image
+     * remains displayed, so it's contents must not be changed.
+     *
+     * @param image direct buffer with image data or null to clear the View
+     */
+    public void setImage(@Nullable ByteBuffer image) {
+        releaseTiles();
+
+        if (image != null) {
+            final PngHeaderInfo headerInfo = PngDecoder.getImageInfo(image);
+            if (headerInfo == null || !headerInfo.isPaletteOrGreyscale() || !image.isDirect()) {
+                throw new IllegalArgumentException(PngSupport.ERROR_CODE_DECODING_FAILED);
+            }
+
+            this.imageWidth = headerInfo.width;
+            this.imageHeight = headerInfo.height;
+            this.columns = (imageWidth + TILE_SIZE - 1) / TILE_SIZE;
+        } else {
+            this.imageWidth = 0;
+            this.imageHeight = 0;
+            this.columns = 0;
+        }
+
+        this.image = image;
+
+        scroller.forceFinished(true);
+        scrollTo(0, 0);
+        requestLayout();
+        invalidate();
+    }
+
+    public int getImageWidth() {
+        return imageWidth;
+    }
+
+    public int getImageHeight() {
+        return imageHeight;
+    }
+
+    @Override
+    protected void onMeasure(int widthMeasureSpec, int heightMeasureSpec) {
+        setMeasuredDimension(resolveSize(imageWidth, widthMeasureSpec), resolveSize(imageHeight, heightMeasureSpec));
+    }
+
+    @Override
+    protected void onSizeChanged(int w, int h, int oldw, int oldh) {
+        super.onSizeChanged(w, h, oldw, oldh);
+
+        scrollTo(getScrollX(), getScrollY());
+    }
+
+    @Override
+    public void scrollTo(int x, int y) {
+        super.scrollTo(clamp(x, getMaxScrollX()), clamp(y, getMaxScrollY()));
+    }
+
+    @Override
+    public void computeScroll() {
+        if (scroller.computeScrollOffset()) {
+            scrollTo(scroller.getCurrX(), scroller.getCurrY());
+            postInvalidateOnAnimation();
+        }
+    }
+
+    @Override
+    public boolean onTouchEvent(MotionEvent event) {
+        return gestureDetector.onTouchEvent(event) || super.onTouchEvent(event);
+    }
+
+    @Override
+    protected void onDetachedFromWindow() {
+        super.onDetachedFromWindow();
+
+        scroller.forceFinished(true);
+        releaseTiles();
+    }
+
+    @Override
+    protected void onDraw(@NonNull Canvas canvas) {
+        if (image == null) {
+            return;
+        }
+
+        final int scrollX = getScrollX(), scrollY = getScrollY();
+
+        // the canvas is already translated by scroll offset, so tiles are drawn at their image coordinates
+        visibleTiles.set(
+                scrollX / TILE_SIZE,
+                scrollY / TILE_SIZE,
+                Math.min((scrollX + getWidth() + TILE_SIZE - 1) / TILE_SIZE, columns),
+                Math.min((scrollY + getHeight() + TILE_SIZE - 1) / TILE_SIZE, (imageHeight + TILE_SIZE - 1) / TILE_SIZE));
+
+        releaseTiles(visibleTiles);
+
+        for (int row = visibleTiles.top; row < visibleTiles.bottom; ++row) {
+            for (int column = visibleTiles.left; column < visibleTiles.right; ++column) {
+                final int key = row * columns + column;
+
+                Tile tile = tiles.get(key);
+                if (tile == null) {
+                    tile = new Tile(column, row, imageWidth, imageHeight);
+                    tiles.put(key, tile);
+                    tileExecutor.execute(new DecodeTask(this, image, tile));
+                } else if (tile.paint != null) {
+                    canvas.save();
+                    canvas.translate(tile.region.left, tile.region.top);
+                    canvas.drawRect(0, 0, tile.region.width(), tile.region.height(), tile.paint);
+                    canvas.restore();
+                }
+            }
+        }
+    }
+
+    private Tile getTile(Tile decoded) {
+        return tiles.get(decoded.row * columns + decoded.column);
+    }
+
+    void onTileDecoded(@NonNull Tile tile, @Nullable Paint paint) {
+        if (getTile(tile) != tile) {
+            recycle(paint);
+            return;
+        }
+
+        if (paint == null) {
+            // keep the failed tile around, so that it isn't decoded over and over
+            Log.w(TAG, PngSupport.ERROR_CODE_DECODING_FAILED);
+            return;
+        }
+
+        tile.paint = paint;
+
+        invalidate();
+    }
+
+    private void releaseTiles(@NonNull Rect keep) {
+        for (int i = tiles.size() - 1; i >= 0; --i) {
+            final Tile tile = tiles.valueAt(i);
+            if (!keep.contains(tile.column, tile.row)) {
+                tile.cancelled = true;
+                tiles.removeAt(i);
+                recycle(tile.paint);
+            }
+        }
+    }
+
+    private void releaseTiles() {
+        for (int i = 0; i < tiles.size(); ++i) {
+            final Tile tile = tiles.valueAt(i);
+            tile.cancelled = true;
+            recycle(tile.paint);
+        }
+        tiles.clear();
+    }
+
+    // tiles come and go during scrolling, so their shaders are reused instead of being compiled over and over
+    private static void recycle(@Nullable Paint paint) {
+        if (Build.VERSION.SDK_INT >= 33 && paint != null && paint.getShader() instanceof PaletteShader) {
+            PaletteShader.recycle((PaletteShader) paint.getShader());
+        }
+    }
+
+    private int getMaxScrollX() {
+        return Math.max(0, imageWidth - getWidth());
+    }
+
+    private int getMaxScrollY() {
+        return Math.max(0, imageHeight - getHeight());
+    }
+
+    private static int clamp(int value, int max) {
+        return Math.max(0, Math.min(value, max));
+    }
+
+    static @Nullable Paint decodeTile(@NonNull ByteBuffer image, @NonNull Rect region) {
+        final Bitmap bitmap = PngSupport.obtainBitmap(region.width(), region.height(), Bitmap.Config.ALPHA_8);
+
+        final DecodingResult result = PngDecoder.decodeRegion(PngDecoder.getThreadContext(), image, region, bitmap,
+                PngDecoder.DEFAULT_DECODER_FLAGS, 1);
+        if (result == null) {
+            PngSupport.releaseBitmap(bitmap);
+            return null;
+        }
+
+        final Paint paint = PngSupport.createPaint(result, bitmap, 0);
+        if (paint != null) {
+            return paint;
+        }
+
+        // no PaletteShader: expand palette in Java
+        final Bitmap expanded = expandPalette(result);
+        PngSupport.releaseBitmap(bitmap);
+
+        final Paint fallback = new Paint();
+        fallback.setShader(new BitmapShader(expanded, Shader.TileMode.CLAMP, Shader.TileMode.CLAMP));
+        return fallback;
+    }
+
+    private static Bitmap expandPalette(DecodingResult result) {
+        final Bitmap indices = result.bitmap;
+        final int width = indices.getWidth(), height = indices.getHeight(), rowBytes = indices.getRowBytes();
+
+        final ByteBuffer source = ByteBuffer.allocate(indices.getByteCount());
+        indices.copyPixelsToBuffer(source);
+
+        final byte[] src = source.array();
+        // all 256 entries of premultiplied RGBA, which is also the memory layout of ARGB_8888 Bitmap
+        final byte[] palette = result.palette.array();
+
+        final byte[] dest = new byte[width * height * 4];
+        for (int y = 0, d = 0; y < height; ++y) {
+            for (int x = 0, s = y * rowBytes; x < width; ++x, ++s, d += 4) {
+                System.arraycopy(palette, (src[s] & 0xff) * 4, dest, d, 4);
+            }
+        }
+
+        final Bitmap expanded = Bitmap.createBitmap(width, height, Bitmap.Config.ARGB_8888);
+        expanded.copyPixelsFromBuffer(ByteBuffer.wrap(dest));
+        return expanded;
+    }
+
+    private static Executor createExecutor() {
+        final ThreadPoolExecutor executor = new ThreadPoolExecutor(1, 1, 5, TimeUnit.SECONDS,
+                new LinkedBlockingQueue<Runnable>(), new ThreadFactory() {
+                    @Override
+                    public Thread newThread(@NonNull Runnable r) {
+                        final Thread thread = new Thread(r, "png-region");
+                        thread.setDaemon(true);
+                        return thread;
+                    }
+                });
+        executor.allowCoreThreadTimeOut(true);
+        return executor;
+    }
+
+    static final class Tile {
+        final int column, row;
+        final Rect region;
+
+        volatile boolean cancelled;
+
+        // only accessed on main thread
+        Paint paint;
+
+        Tile(int column, int row, int imageWidth, int imageHeight) {
+            this.column = column;
+            this.row = row;
+            this.region = new Rect(column * TILE_SIZE, row * TILE_SIZE,
+                    Math.min((column + 1) * TILE_SIZE, imageWidth), Math.min((row + 1) * TILE_SIZE, imageHeight));
+        }
+    }
+
+    private static final class DecodeTask implements Runnable {
+        private final PngRegionView view;
+        private final ByteBuffer image;
+        private final Tile tile;
+
+        DecodeTask(PngRegionView view, ByteBuffer image, Tile tile) {
+            this.view = view;
+            this.image = image;
+            this.tile = tile;
+        }
+
+        @Override
+        public void run() {
+            if (tile.cancelled) {
+                return;
+            }
+
+            final Paint paint = decodeTile(image, tile.region);
+
+            view.post(new Runnable() {
+                @Override
+                public void run() {
+                    view.onTileDecoded(tile, paint);
+                }
+            });
+        }
+    }
+
+    private final class ScrollListener extends GestureDetector.SimpleOnGestureListener {
+        @Override
+        public boolean onDown(@NonNull MotionEvent e) {
+            scroller.forceFinished(true);
+            return true;
+        }
+
+        @Override
+        public boolean onScroll(@NonNull MotionEvent e1, @NonNull MotionEvent e2, float distanceX, float distanceY) {
+            scrollBy((int) distanceX, (int) distanceY);
+            return true;
+        }
+
+        @Override
+        public boolean onFling(@NonNull MotionEvent e1, @NonNull MotionEvent e2, float velocityX, float velocityY) {
+            scroller.fling(getScrollX(), getScrollY(), (int) -velocityX, (int) -velocityY,
+                    0, getMaxScrollX(), 0, getMaxScrollY());
+            postInvalidateOnAnimation();
+            return true;
+        }
+    }
+}
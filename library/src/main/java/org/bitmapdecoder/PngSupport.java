@@ -16,15 +16,18 @@
 package org.bitmapdecoder;
 
 import android.annotation.TargetApi;
+import android.content.ComponentCallbacks2;
 import android.content.res.*;
 import android.graphics.*;
 import android.graphics.drawable.Drawable;
 import android.os.Build;
+import android.os.Trace;
 import android.util.*;
 import androidx.annotation.*;
 import org.bitmapdecoder.PngDecoder.DecodingResult;
 import org.bitmapdecoder.PngDecoder.PngHeaderInfo;
 
+import java.io.File;
 import java.io.FileInputStream;
 import java.io.IOException;
 import java.lang.annotation.Retention;
@@ -32,9 +35,18 @@ import java.lang.annotation.RetentionPolicy;
 import java.nio.ByteBuffer;
 import java.nio.ByteOrder;
 import java.nio.channels.FileChannel;
+import java.util.ArrayList;
+import java.util.List;
+import java.util.concurrent.Callable;
+import java.util.concurrent.Executor;
+import java.util.concurrent.Future;
+import java.util.concurrent.FutureTask;
 
 import static org.bitmapdecoder.PngDecoder.OPTION_DECODE_AS_MASK;
 import static org.bitmapdecoder.PngDecoder.OPTION_EXTRACT_MASK;
+import static org.bitmapdecoder.PngDecoder.OPTION_PACK_INDICES;
+import static org.bitmapdecoder.PngDecoder.OPTION_PARALLEL;
+import static org.bitmapdecoder.PngDecoder.OPTION_TRUSTED_SOURCE;
 
 public final class PngSupport {
     private static final String TAG = "pngs";
@@ -50,24 +62,32 @@ public final class PngSupport {
     public static final int FLAG_TILED    = 0b001;
     public static final int FLAG_MIRRORED = 0b010;
 
-    @IntDef(value = { FLAG_TILED, FLAG_MIRRORED, OPTION_DECODE_AS_MASK, OPTION_EXTRACT_MASK }, flag = true)
+    @IntDef(value = { FLAG_TILED, FLAG_MIRRORED, OPTION_DECODE_AS_MASK, OPTION_EXTRACT_MASK, OPTION_PACK_INDICES, OPTION_PARALLEL,
+            OPTION_TRUSTED_SOURCE }, flag = true)
     @Retention(RetentionPolicy.SOURCE)
     public static @interface Options {
     }
 
     public static @Nullable Drawable getDrawable(@NonNull ByteBuffer source, @Options int options) {
         PngHeaderInfo headerInfo = PngDecoder.getImageInfo(source);
-        if (headerInfo == null || !headerInfo.isPaletteOrGreyscale()) {
+        if (headerInfo == null) {
             return null;
         }
+        if (!headerInfo.isPaletteOrGreyscale()) {
+            return createRgbaDrawable(source, headerInfo, options);
+        }
         return createDrawable(source, headerInfo, options);
     }
 
     public static @Nullable Paint getPaint(@NonNull ByteBuffer source, @Options int options) {
         PngHeaderInfo headerInfo = PngDecoder.getImageInfo(source);
-        if (headerInfo == null || !headerInfo.isPaletteOrGreyscale()) {
+        if (headerInfo == null) {
             return null;
         }
+        if (!headerInfo.isPaletteOrGreyscale()) {
+            final DecodingResult result = decodeRgba(source, headerInfo);
+            return result == null ? null : createPaint(result, result.bitmap, options);
+        }
         return createPaint(source, headerInfo, options);
     }
 
@@ -81,29 +101,155 @@ public final class PngSupport {
     }
 
     private static Paint createPaint(ByteBuffer source, PngHeaderInfo headerInfo, @Options int options) {
-        final Bitmap rawImageBitmap = Bitmap.createBitmap(headerInfo.width, headerInfo.height, Bitmap.Config.ALPHA_8);
-
-        final DecodingResult result = PngDecoder.decodeIndexed(source, rawImageBitmap, options | PngDecoder.DEFAULT_DECODER_FLAGS);
+        final DecodingResult result = decodeIndexed(source, headerInfo, options | PngDecoder.DEFAULT_DECODER_FLAGS);
         if (result == null) {
             return null;
         }
-        return createPaint(result, rawImageBitmap, options);
+        return createPaint(result, result.bitmap, options);
     }
 
     private static Drawable createDrawable(ByteBuffer source, PngHeaderInfo headerInfo, @Options int options) {
-        final Bitmap rawImageBitmap = Bitmap.createBitmap(headerInfo.width, headerInfo.height, Bitmap.Config.ALPHA_8);
-
-        final DecodingResult result = PngDecoder.decodeIndexed(source, rawImageBitmap, options | PngDecoder.DEFAULT_DECODER_FLAGS);
+        final DecodingResult result = decodeIndexed(source, headerInfo, options | PngDecoder.DEFAULT_DECODER_FLAGS);
         if (result == null) {
             return null;
         }
-        final Paint paint = createPaint(result, rawImageBitmap, options);
+        final Paint paint = createPaint(result, result.bitmap, options);
         if (paint == null) {
             return null;
         }
         return new ShaderDrawable(paint, headerInfo.width, headerInfo.height, result);
     }
 
+    private static Drawable createRgbaDrawable(ByteBuffer source, PngHeaderInfo headerInfo, @Options int options) {
+        final DecodingResult result = decodeRgba(source, headerInfo);
+        if (result == null) {
+            return null;
+        }
+        final Paint paint = createPaint(result, result.bitmap, options);
+        return new ShaderDrawable(paint, headerInfo.width, headerInfo.height, result);
+    }
+
+    // decode to HARDWARE Bitmap if possible, to ALPHA_8 Bitmap otherwise
+    static @Nullable DecodingResult decodeIndexed(ByteBuffer source, PngHeaderInfo headerInfo, int options) {
+        final long analysisKey = getAnalysisKey(source, options);
+
+        final DecodingResult result = decodeAnalysed(source, headerInfo, applyAnalysis(analysisKey, options));
+
+        recordAnalysis(analysisKey, options, result);
+
+        return result;
+    }
+
+    private static DecodingResult decodeAnalysed(ByteBuffer source, PngHeaderInfo headerInfo, int options) {
+        if (canPack(headerInfo, options)) {
+            final DecodingResult result = decodePacked(source, headerInfo, options);
+            if (result != null) {
+                return result;
+            }
+        }
+
+        options &= ~OPTION_PACK_INDICES;
+
+        if (Build.VERSION.SDK_INT >= 29 && !noHwAlpha8) {
+            final DecodingResult result = PngDecoder.decodeIndexedHardware(PngDecoder.getThreadContext(), source, options);
+            if (result != null) {
+                return result;
+            }
+        }
+
+        final Bitmap rawImageBitmap = obtainBitmap(headerInfo.width, headerInfo.height, Bitmap.Config.ALPHA_8);
+
+        final DecodingResult result = PngDecoder.decodeIndexed(PngDecoder.getThreadContext(), source, rawImageBitmap, options);
+        if (result == null) {
+            releaseBitmap(rawImageBitmap);
+        }
+        return result;
+    }
+
+    // packed indices are only unpacked by PaletteShader, which does not support tiling
+    private static boolean canPack(PngHeaderInfo headerInfo, int options) {
+        return Build.VERSION.SDK_INT >= 33
+                && (options & OPTION_PACK_INDICES) != 0
+                && (options & (FLAG_TILED | FLAG_MIRRORED)) == 0
+                && PngDecoder.getPackedWidth(headerInfo) != headerInfo.width;
+    }
+
+    private static @Nullable DecodingResult decodePacked(ByteBuffer source, PngHeaderInfo headerInfo, int options) {
+        final Bitmap packedBitmap = obtainBitmap(PngDecoder.getPackedWidth(headerInfo), headerInfo.height, Bitmap.Config.ALPHA_8);
+
+        final DecodingResult result = PngDecoder.decodeIndexed(PngDecoder.getThreadContext(), source, packedBitmap, options);
+        if (result == null) {
+            releaseBitmap(packedBitmap);
+        }
+        return result;
+    }
+
+    // subsampled images are only decoded to ALPHA_8 Bitmap
+    static @Nullable DecodingResult decodeIndexed(ByteBuffer source, PngHeaderInfo headerInfo, int options, int sampleSize) {
+        if (sampleSize == 1) {
+            return decodeIndexed(source, headerInfo, options);
+        }
+
+        options &= ~OPTION_PACK_INDICES;
+
+        // subsampled image may be single-hue, when the full one is not, so only the full decodes are recorded
+        options = applyAnalysis(getAnalysisKey(source, options), options);
+
+        final int width = PngDecoder.getSampledSize(headerInfo.width, sampleSize);
+        final int height = PngDecoder.getSampledSize(headerInfo.height, sampleSize);
+
+        final Bitmap rawImageBitmap = obtainBitmap(width, height, Bitmap.Config.ALPHA_8);
+
+        final DecodingResult result = PngDecoder.decodeIndexed(PngDecoder.getThreadContext(), source, rawImageBitmap, options, sampleSize);
+        if (result == null) {
+            releaseBitmap(rawImageBitmap);
+        }
+        return result;
+    }
+
+    // the mask analysis of OPTION_DECODE_AS_MASK scans the whole image, it's outcome is remembered by AnalysisCache
+    private static long getAnalysisKey(ByteBuffer source, int options) {
+        return (options & OPTION_DECODE_AS_MASK) != 0 ? AnalysisCache.contentKey(source) : 0;
+    }
+
+    private static int applyAnalysis(long analysisKey, int options) {
+        if (analysisKey == 0) {
+            return options;
+        }
+
+        switch (AnalysisCache.get(analysisKey)) {
+            case AnalysisCache.MASK:
+                return (options & ~OPTION_DECODE_AS_MASK) | OPTION_EXTRACT_MASK;
+            case AnalysisCache.NOT_MASK:
+                return options & ~OPTION_DECODE_AS_MASK;
+            default:
+                return options;
+        }
+    }
+
+    private static void recordAnalysis(long analysisKey, int options, DecodingResult result) {
+        if (analysisKey == 0 || result == null || result.decodedAsGreyscale() || result.decodedAsRgba()
+                || (options & OPTION_EXTRACT_MASK) != 0) {
+            return;
+        }
+
+        AnalysisCache.put(analysisKey, result.decodedAsMask());
+    }
+
+    static @Nullable DecodingResult decodeRgba(ByteBuffer source, PngHeaderInfo headerInfo) {
+        return decodeRgba(source, headerInfo, 0);
+    }
+
+    static @Nullable DecodingResult decodeRgba(ByteBuffer source, PngHeaderInfo headerInfo, int options) {
+        final Bitmap rgbaBitmap = obtainBitmap(headerInfo.width, headerInfo.height, Bitmap.Config.ARGB_8888);
+
+        final DecodingResult result = PngDecoder.decodeRgba(PngDecoder.getThreadContext(), source, rgbaBitmap, options);
+        if (result == null) {
+            releaseBitmap(rgbaBitmap);
+        }
+        return result;
+    }
+
     static int makeStateSpec(boolean isOpaque) {
         if (isOpaque) {
             return ShaderDrawable.OPAQUE_MASK;
@@ -126,7 +272,10 @@ public final class PngSupport {
     static Paint createPaint(@NonNull DecodingResult result, Bitmap rawImageBitmap, @Options int options) {
         final Paint paint = new Paint();
 
-        if (result.decodedAsMask()) {
+        if (result.decodedAsRgba()) {
+            final Shader.TileMode tileMode = toTileMode(options);
+            paint.setShader(newBitmapShader(rawImageBitmap, tileMode));
+        } else if (result.decodedAsMask()) {
             final byte[] palette = result.palette.array();
             final Shader.TileMode tileMode = toTileMode(options);
             paint.setColorFilter(new PorterDuffColorFilter(color(palette), PorterDuff.Mode.SRC_IN));
@@ -145,7 +294,7 @@ public final class PngSupport {
         return paint;
     }
 
-    private static float[] alphaToGrayFilter() {
+    static float[] alphaToGrayFilter() {
         return new float[] {
                 0, 0, 0, 1, 0,
                 0, 0, 0, 1, 0,
@@ -166,19 +315,17 @@ public final class PngSupport {
 
     @TargetApi(33)
     private static PaletteShader createShader(ByteBuffer source, PngHeaderInfo headerInfo, @Options int options) {
-        final Bitmap rawImageBitmap = Bitmap.createBitmap(headerInfo.width, headerInfo.height, Bitmap.Config.ALPHA_8);
-
-        final DecodingResult result = PngDecoder.decodeIndexed(source, rawImageBitmap, 0);
+        final DecodingResult result = decodeIndexed(source, headerInfo, options & (OPTION_PACK_INDICES | OPTION_PARALLEL | OPTION_TRUSTED_SOURCE | FLAG_TILED | FLAG_MIRRORED));
         if (result == null) {
             return null;
         }
-        return createShader(result, rawImageBitmap, options);
+        return createShader(result, result.bitmap, options);
     }
 
     @TargetApi(33)
     private static PaletteShader createShader(@NonNull DecodingResult result, Bitmap rawImageBitmap, @Options int options) {
         final int colorCount = result.palette.limit() / 4;
-        final Bitmap paletteBitmap = Bitmap.createBitmap(colorCount, 1, Bitmap.Config.ARGB_8888);
+        final Bitmap paletteBitmap = obtainBitmap(colorCount, 1, Bitmap.Config.ARGB_8888);
 
         paletteBitmap.copyPixelsFromBuffer(result.palette);
 
@@ -190,7 +337,152 @@ public final class PngSupport {
         rawImageShader.setFilterMode(BitmapShader.FILTER_MODE_NEAREST);
         paletteShader.setFilterMode(BitmapShader.FILTER_MODE_NEAREST);
 
-        return new PaletteShader(paletteShader, rawImageShader);
+        final PaletteShader shader = result.isPacked()
+                ? PaletteShader.obtain(result.getBitsPerIndex(), result.getWidth())
+                : PaletteShader.obtain();
+
+        shader.setBitmap(paletteShader, rawImageShader);
+        return shader;
+    }
+
+    /**
+     * Set the size of process-wide cache of images, decoded by {@link IndexedDrawable} from resources.
+     * The cache is enabled by default. Pass 0 to disable it.
+     *
+     * @param bytes maximum amount of memory, taken by cached images
+     */
+    public static void setCacheSize(int bytes) {
+        StateCache.setMaxSize(bytes);
+    }
+
+    /**
+     * Release some or all of cached images. Call this from {@link ComponentCallbacks2#onTrimMemory}
+     * of your Application.
+     *
+     * @param level the level, passed to onTrimMemory
+     */
+    public static void trimMemory(int level) {
+        StateCache.trimMemory(level);
+
+        if (level >= ComponentCallbacks2.TRIM_MEMORY_UI_HIDDEN) {
+            PngDecoder.getBatchExecutor().execute(new Runnable() {
+                @Override
+                public void run() {
+                    AnalysisCache.save();
+                }
+            });
+        }
+    }
+
+    /**
+     * Keep the outcome of mask analysis (see {@link PngDecoder#OPTION_DECODE_AS_MASK}) of decoded images between
+     * launches, so that later decodes of the same images skip the pass over their pixels. The file is read
+     * immediately (call this from background thread, e.g. during app startup) and written by {@link #trimMemory},
+     * when the app goes to background. A file in {@link android.content.Context#getCodeCacheDir} is a good choice.
+     *
+     * @param file where to keep the results or null to stop writing them
+     */
+    @WorkerThread
+    public static void setAnalysisCacheFile(@Nullable File file) {
+        AnalysisCache.setFile(file);
+    }
+
+    /**
+     * Decode drawable resources in background, to put them into the cache of {@link IndexedDrawable}
+     * (see {@link #setCacheSize}). Meant for images of the first screen, prefetched while the app is still
+     * starting: once a resource is prefetched, inflating it on main thread only copies cached state.
+     *
+     * @see #prefetch(Resources, int[], Executor)
+     */
+    public static @NonNull List<Future<Boolean>> prefetch(@NonNull Resources resources, @NonNull @DrawableRes int[] resIds) {
+        return prefetch(resources, resIds, PngDecoder.getBatchExecutor());
+    }
+
+    /**
+     * Decode drawable resources in background, to put them into the cache of {@link IndexedDrawable}.
+     *
+     * <p>Each resource may be either XML file with {@code <drawable class="org.bitmapdecoder.IndexedDrawable">}
+     * (inflated without Theme and decoded even if marked as lazy, skipped below Android 7, which can't inflate
+     * custom Drawable classes) or PNG image, later loaded with {@link IndexedDrawable#IndexedDrawable(Resources, int)}.
+     * Decoded images are uploaded to GPU right away, unless the device can't do so for ALPHA_8 Bitmaps. Resources
+     * are decoded for density of supplied Resources, so prefetching with Resources of a different Configuration
+     * fills the cache with entries, that will never be used.
+     *
+     * @param resources Resources, that will be used to inflate the drawables later
+     * @param resIds ids of drawable resources
+     * @param executor Executor for running decoding tasks
+     *
+     * @return Futures in the same order as resIds, each yielding whether the resource was decoded successfully
+     */
+    public static @NonNull List<Future<Boolean>> prefetch(@NonNull Resources resources, @NonNull @DrawableRes int[] resIds,
+                                                          @NonNull Executor executor) {
+        final List<Future<Boolean>> results = new ArrayList<>(resIds.length);
+
+        for (int resId : resIds) {
+            final FutureTask<Boolean> task = new FutureTask<>(new PrefetchTask(resources, resId));
+            results.add(task);
+            executor.execute(task);
+        }
+
+        return results;
+    }
+
+    /**
+     * Reuse temporary Bitmaps, that are discarded once decoded image is uploaded to GPU.
+     * Pooling is disabled by default.
+     *
+     * @param pool the pool to use or {@code null} to stop pooling
+     */
+    public static void setBitmapPool(@Nullable BitmapPool pool) {
+        bitmapPool = pool;
+    }
+
+    /**
+     * Receives a notification for each image resource, that {@link IndexedDrawable} could not decode to
+     * ALPHA_8 Bitmap, along with the reason. Use it to find out, which images take the slow path (and
+     * count them by reason). Native decoder failures are also counted in {@link PngDecoder.Stats}.
+     */
+    public interface FallbackListener {
+        /**
+         * Called on the decoding thread (which may be a background one) after the image was decoded by slower means.
+         *
+         * @param image path of resource file, such as {@code res/drawable-hdpi/icon.png}
+         * @param error why the image could not be decoded to ALPHA_8 Bitmap, one of {@code PngDecoder.ERROR_*} constants
+         * @param platformDecoder true if the image was decoded by BitmapFactory, false if by this library
+         *                        to ARGB_8888 Bitmap
+         */
+        void onFallback(@NonNull String image, @PngDecoder.DecodingError int error, boolean platformDecoder);
+    }
+
+    /**
+     * @param listener the listener to notify about fallback decodes or {@code null} to stop notifications
+     */
+    public static void setFallbackListener(@Nullable FallbackListener listener) {
+        fallbackListener = listener;
+    }
+
+    static void reportFallback(String image, int error, boolean platformDecoder) {
+        final FallbackListener listener = fallbackListener;
+        if (listener != null) {
+            listener.onFallback(image, error, platformDecoder);
+        }
+    }
+
+    static @NonNull Bitmap obtainBitmap(int width, int height, Bitmap.Config config) {
+        final BitmapPool pool = bitmapPool;
+        if (pool == null) {
+            return Bitmap.createBitmap(width, height, config);
+        }
+        return pool.acquire(width, height, config);
+    }
+
+    static void releaseBitmap(Bitmap bitmap) {
+        final BitmapPool pool = bitmapPool;
+        if (pool == null) {
+            bitmap.recycle();
+        } else {
+            pool.release(bitmap);
+        }
     }
 
     static TypedValue loadValue(Resources r, @AnyRes int resourceId) {
@@ -256,11 +548,20 @@ public final class PngSupport {
 
     private static volatile boolean noHwAlpha8;
 
+    private static volatile BitmapPool bitmapPool;
+
+    private static volatile FallbackListener fallbackListener;
+
     private static BitmapShader newImageShader(Bitmap rawImage, Shader.TileMode tileMode) {
+        if (Build.VERSION.SDK_INT >= 26 && rawImage.getConfig() == Bitmap.Config.HARDWARE) {
+            // already decoded to hardware buffer
+            return new BitmapShader(rawImage, tileMode, tileMode);
+        }
+
         if (Build.VERSION.SDK_INT >= 26 && !noHwAlpha8) {
             Bitmap hw = rawImage.copy(Bitmap.Config.HARDWARE, false);
             if (hw != null) {
-                rawImage.recycle();
+                releaseBitmap(rawImage);
 
                 return new BitmapShader(hw, tileMode, tileMode);
             }
@@ -273,13 +574,28 @@ public final class PngSupport {
         return new BitmapShader(rawImage, tileMode, tileMode);
     }
 
+    private static BitmapShader newBitmapShader(Bitmap image, Shader.TileMode tileMode) {
+        Bitmap bm = image;
+
+        if (Build.VERSION.SDK_INT >= 26) {
+            bm = image.copy(Bitmap.Config.HARDWARE, false);
+            if (bm != null) {
+                releaseBitmap(image);
+            } else {
+                bm = image;
+            }
+        }
+
+        return new BitmapShader(bm, tileMode, tileMode);
+    }
+
     private static BitmapShader newPaletteShader(Bitmap palette) {
         Bitmap bm = palette;
 
         if (Build.VERSION.SDK_INT >= 26) {
             bm = palette.copy(Bitmap.Config.HARDWARE, false);
             if (bm != null) {
-                palette.recycle();
+                releaseBitmap(palette);
             } else {
                 bm = palette;
             }
@@ -303,4 +619,42 @@ public final class PngSupport {
 
         return 0xff000000 | (r << 16) | (g << 8) | b;
     }
+
+    private static final class PrefetchTask implements Callable<Boolean> {
+        private final Resources resources;
+        private final int resId;
+
+        PrefetchTask(Resources resources, int resId) {
+            this.resources = resources;
+            this.resId = resId;
+        }
+
+        @Override
+        public Boolean call() {
+            Trace.beginSection("PngSupport.prefetch");
+            try {
+                final TypedValue typedValue = loadValue(resources, resId);
+
+                if (typedValue.string != null && typedValue.string.toString().endsWith(".xml")) {
+                    if (Build.VERSION.SDK_INT < 24) {
+                        // custom drawable classes can't be inflated from XML
+                        return false;
+                    }
+
+                    final Drawable drawable = resources.getDrawable(resId, null);
+
+                    // lazily inflated drawables still have to be decoded
+                    return drawable instanceof IndexedDrawable && ((IndexedDrawable) drawable).decodePending();
+                }
+
+                new IndexedDrawable(resources, resId);
+                return true;
+            } catch (RuntimeException e) {
+                Log.w(TAG, "Failed to prefetch " + Integer.toHexString(resId), e);
+                return false;
+            } finally {
+                Trace.endSection();
+            }
+        }
+    }
 }
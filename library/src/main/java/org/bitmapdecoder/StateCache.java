@@ -0,0 +1,158 @@
+/*
+ * Copyright 2023 Alexander Rvachev.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+package org.bitmapdecoder;
+
+import android.content.ComponentCallbacks2;
+import android.content.res.AssetManager;
+import android.util.LruCache;
+import androidx.annotation.NonNull;
+import androidx.annotation.Nullable;
+
+import java.lang.ref.WeakReference;
+
+/**
+ * Process-wide cache of decoded resource images, shared by all {@link IndexedDrawable} instances.
+ *
+ * <p>The cache holds drawable states before tinting and density scaling are applied. Each hit is handed out as
+ * {@link ShaderDrawable.State#copy() copy} with it's own Paint, but the same Shader (and Bitmaps), so identical
+ * images across screens are backed by single texture.
+ */
+final class StateCache {
+    static final int DEFAULT_SIZE = 4 * 1024 * 1024;
+
+    private static final Cache cache = new Cache(DEFAULT_SIZE);
+
+    private static volatile boolean enabled = true;
+
+    private StateCache() {}
+
+    static @Nullable ShaderDrawable.State get(@NonNull Key key) {
+        if (!enabled) {
+            return null;
+        }
+
+        final Entry entry = cache.get(key);
+        return entry == null ? null : entry.state.copy();
+    }
+
+    static void put(@NonNull Key key, @NonNull ShaderDrawable.State state, int byteCount) {
+        if (!enabled) {
+            return;
+        }
+
+        cache.put(key, new Entry(state.copy(), byteCount));
+    }
+
+    static void setMaxSize(int bytes) {
+        if (bytes <= 0) {
+            enabled = false;
+            cache.evictAll();
+        } else {
+            cache.resize(bytes);
+            enabled = true;
+        }
+    }
+
+    static void trimMemory(int level) {
+        if (level >= ComponentCallbacks2.TRIM_MEMORY_MODERATE) {
+            cache.evictAll();
+        } else if (level >= ComponentCallbacks2.TRIM_MEMORY_BACKGROUND
+                || level == ComponentCallbacks2.TRIM_MEMORY_RUNNING_LOW
+                || level == ComponentCallbacks2.TRIM_MEMORY_RUNNING_CRITICAL) {
+            cache.trimToSize(cache.maxSize() / 2);
+        }
+    }
+
+    /**
+     * Identifies decoded resource. Asset cookies are only meaningful within their AssetManager (resources of
+     * other packages reuse the same numbers), so the key also refers to AssetManager, compared by identity.
+     * The reference is weak to not keep AssetManagers of other packages alive, keys of collected ones match nothing
+     * and are eventually evicted.
+     */
+    static final class Key {
+        private final WeakReference<AssetManager> assets;
+        private final int assetsHash;
+        private final int assetCookie;
+        private final String path;
+        private final int density;
+        private final int tileMode;
+        private final boolean forceMask;
+        private final int sampleSize;
+
+        Key(@NonNull AssetManager assets, int assetCookie, @NonNull String path, int density, int tileMode,
+            boolean forceMask, int sampleSize) {
+            this.assets = new WeakReference<>(assets);
+            this.assetsHash = System.identityHashCode(assets);
+            this.assetCookie = assetCookie;
+            this.path = path;
+            this.density = density;
+            this.tileMode = tileMode;
+            this.forceMask = forceMask;
+            this.sampleSize = sampleSize;
+        }
+
+        @Override
+        public boolean equals(Object o) {
+            if (this == o) return true;
+            if (!(o instanceof Key)) return false;
+
+            final Key key = (Key) o;
+
+            final AssetManager assets = this.assets.get();
+
+            return assets != null && assets == key.assets.get()
+                    && assetCookie == key.assetCookie
+                    && density == key.density
+                    && tileMode == key.tileMode
+                    && forceMask == key.forceMask
+                    && sampleSize == key.sampleSize
+                    && path.equals(key.path);
+        }
+
+        @Override
+        public int hashCode() {
+            int result = assetsHash;
+            result = 31 * result + assetCookie;
+            result = 31 * result + path.hashCode();
+            result = 31 * result + density;
+            result = 31 * result + tileMode;
+            result = 31 * result + (forceMask ? 1 : 0);
+            result = 31 * result + sampleSize;
+            return result;
+        }
+    }
+
+    private static final class Entry {
+        final ShaderDrawable.State state;
+        final int byteCount;
+
+        Entry(ShaderDrawable.State state, int byteCount) {
+            this.state = state;
+            this.byteCount = byteCount;
+        }
+    }
+
+    private static final class Cache extends LruCache<Key, Entry> {
+        Cache(int maxSize) {
+            super(maxSize);
+        }
+
+        @Override
+        protected int sizeOf(Key key, Entry value) {
+            return value.byteCount;
+        }
+    }
+}
@@ -19,8 +19,21 @@
  * is able to determine if it is attached to Activity without hardware-acceleration  — IndexedDrawable just renders
  * nothing when that happens, while PngImageView falls back to decoding image as BitmapDrawable.
  *
+ * <p>{@link org.bitmapdecoder.PngRegionView} displays images, that are too big to be decoded at once, by decoding
+ * only the visible tiles.
+ *
  * <p>{@link org.bitmapdecoder.PaletteShader} is a corresponding alternative to {@link android.graphics.BitmapShader}.
  *
+ * <p>{@link org.bitmapdecoder.IndexedAtlas} packs many small images into shared textures, to reduce the number
+ * of texture uploads for screens with lots of icons.
+ *
+ * <p>{@link org.bitmapdecoder.IndexedAnimatedDrawable} plays indexed and greyscale APNG animations, composing
+ * each frame in a single ALPHA_8 Bitmap.
+ *
+ * <p>Images, that are decoded on every start, can be precompiled by {@code convertIndexedImages} Gradle task of the
+ * library into uncompressed files, that are copied to Bitmap without inflating. Put them into {@code res/raw}, keep
+ * them uncompressed in APK ({@code noCompress 'idx'}) and use in IndexedDrawable the same way as PNG images.
+ *
  * <p>If you want to directly decode a PNG file to ALPHA_8 Bitmap and ARGB_8888 palette, compatible with PaletteShader,
  * use {@link org.bitmapdecoder.PngDecoder}.
  */